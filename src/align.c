@@ -0,0 +1,121 @@
+#include "align.h"
+#include "context.h"
+#include "argparse.h"
+#include "expr.h"
+#include "cfg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Register number at the start of an operand list, -1 if it is not a register
+static int leadingRegister(const char * args) {
+	if (args[0] != 'r' || !isdigit((unsigned char)args[1])) return -1;
+	int reg = atoi(args + 1);
+	return reg < 32 ? reg : -1;
+}
+
+// Copy of the last operand of str into out (64 bytes) when it is a plain
+// ":label", else 0: the target of a label expression is not known here
+static int labelOperand(const char * str, char * out) {
+	const char * p = strrchr(str, ',');
+	p = p ? p + 1 : str;
+	while (isspace((unsigned char)*p)) p++;
+	if (!isPlainLabel(p)) return 0;
+	snprintf(out, 64, "%.*s", labelLength(p), p);
+	return 1;
+}
+
+static int compareAddress(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int alignLoopTargets(Script * script, int boundary) {
+	if (boundary <= 0 || (boundary & (boundary - 1)) || boundary > MAX_ALIGN) {
+		asmError("Error: loop alignment %d is not a power of two up to %d\n", boundary, MAX_ALIGN);
+	}
+	// addresses of backward branch targets
+	uint64_t * targets = asmAlloc((script->numEntries + 1) * sizeof(uint64_t));
+	int numTargets = 0;
+	// label each register was last loaded with by ld, straight line approximation
+	char regLabel[32][64];
+	int regValid[32] = {0};
+
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type != 0 || entry->str == null) continue;
+
+		CommandType type = entry->cmd.type;
+		int reg = leadingRegister(entry->str);
+		char label[64];
+		int haveTarget = 0;
+
+		if (type == BRR) {
+			haveTarget = labelOperand(entry->str, label);
+		} else if (type == BR || type == BRNZ || type == BRGT) {
+			if (reg >= 0 && regValid[reg]) {
+				strcpy(label, regLabel[reg]);
+				haveTarget = 1;
+			}
+		} else if (reg >= 0) {
+			// anything else with a leading register overwrites it
+			regValid[reg] = type == LD && labelOperand(entry->str, regLabel[reg]);
+		}
+
+		uint64_t address;
+		if (haveTarget && findLabel(label, script->ltable, &address) && address <= (uint64_t)entry->address)
+			targets[numTargets++] = address;
+	}
+
+	if (numTargets == 0) {
+		asmFree(targets);
+		return 0;
+	}
+	qsort(targets, numTargets, sizeof(uint64_t), compareAddress);
+
+	Entry * entries = asmAlloc((script->numEntries + numTargets) * sizeof(Entry));
+	int n = 0;
+	int aligned = 0;
+	int data = 0;
+	uint64_t last = 0;
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type == 3 || entry->type == 4) data = entry->type == 4;
+
+		// one .align in front of the first of the labels at a target address
+		uint64_t address = entry->address;
+		if (entry->type == 2 && !data && (aligned == 0 || address != last) &&
+				bsearch(&address, targets, numTargets, sizeof(uint64_t), compareAddress)) {
+			char text[32];
+			snprintf(text, sizeof(text), ".align %d", boundary);
+			entries[n++] = (Entry){
+				.type = 7,
+				.address = entry->address,
+				.align = boundary,
+				.value = (unsigned long long)NOP_WORD << 32 | NOP_WORD,
+				.str = asmStrdup(text),
+			};
+			last = address;
+			aligned++;
+		}
+		entries[n++] = *entry;
+	}
+
+	asmFree(script->entries);
+	asmFree(targets);
+	script->entries = entries;
+	script->numEntries = n;
+	return aligned;
+}
+
+void reportAlignment(Script * script, int aligned, FILE * out) {
+	int count = 0;
+	long padding = 0;
+	for (int i = 0; i < script->numEntries; i++) {
+		if (script->entries[i].type != 7) continue;
+		count++;
+		padding += script->entries[i].size;
+	}
+	fprintf(out, "alignment: %d loop targets aligned, %d .align directives, %ld bytes of padding\n",
+			aligned, count, padding);
+}
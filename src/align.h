@@ -0,0 +1,15 @@
+#pragma once
+#include "parse.h"
+
+// Boundary used by --align-loops without a value: one cache line
+#define ALIGN_LOOP_DEFAULT 64
+
+// Must run after fillLabelTable (it needs the addresses).
+// Inserts ".align boundary" in front of every code label that a later branch
+// jumps back to: brr :L, or br / brnz / brgt through a register last loaded
+// with "ld rX, :L". Returns the number of labels aligned; when it is non zero
+// the label table is stale and fillLabelTable has to run again.
+int alignLoopTargets(Script * script, int boundary);
+
+// Number of .align directives and the padding bytes they add
+void reportAlignment(Script * script, int aligned, FILE * out);
@@ -1,4 +1,5 @@
 #include "argparse.h"
+#include "context.h"
 #include "parse.h"
 #include <string.h>
 #include <stdlib.h>
@@ -45,7 +46,7 @@ char * trimWhitespaceAlloc(char * str) {
     
     // If entire string is whitespace, return empty string
     if (str[start] == '\0') {
-        char * result = malloc(1);
+        char * result = asmAlloc(1);
         result[0] = '\0';
         return result;
     }
@@ -58,7 +59,7 @@ char * trimWhitespaceAlloc(char * str) {
     
     // Allocate and copy trimmed content
     int len = end - start + 1;
-    char * result = malloc((len + 1) * sizeof(char));
+    char * result = asmAlloc((len + 1) * sizeof(char));
     strncpy(result, str + start, len);
     result[len] = '\0';
     
@@ -69,13 +70,11 @@ char * trimWhitespaceAlloc(char * str) {
 int parseRegister(char * reg) {
     reg = trimWhitespace(reg);
     if (reg[0] != 'r') {
-        fprintf(stderr, "Error: Invalid register '%s'\n", reg);
-        exit(1);
+        asmError("Error: Invalid register '%s'\n", reg);
     }
     int regNum = atoi(reg + 1);  // Skip 'r'
     if (regNum < 0 || regNum > 31) {
-        fprintf(stderr, "Error: Register out of range (0-31): r%d\n", regNum);
-        exit(1);
+        asmError("Error: Register out of range (0-31): r%d\n", regNum);
     }
     return regNum;
 }
@@ -89,14 +88,13 @@ unsigned long long parseLiteral(char * lit) {
     
     // Check if it's a label reference
     if (lit[0] == ':') {
-        fprintf(stderr, "Error: parseLiteral called with unresolved label '%s'\n", lit);
-        fprintf(stderr, "Labels must be resolved before parsing\n");
-        exit(1);
+        asmError("Error: parseLiteral called with unresolved label '%s'\n"
+                 "Labels must be resolved before parsing\n", lit);
     }
     
-    // Handle hex (0x...)
+    // Handle hex (0x...), all 64 bits of it like parseOperands reads it
     if (lit[0] == '0' && (lit[1] == 'x' || lit[1] == 'X')) {
-        return strtol(lit, NULL, 16);
+        return strtoull(lit, NULL, 16);
     }
     
     // Handle negative numbers
@@ -117,58 +115,60 @@ int isLabel(char * str) {
 
 // Parse three registers: "r0, r1, r3"
 void parseThreeReg(char * args, int * rd, int * rs, int * rt) {
-    char * argsCopy = strdup(args);
+    char * argsCopy = asmStrdup(args);
     char * token;
+    char * save;
     
-    token = strtok(argsCopy, ",");
+    token = strtok_r(argsCopy, ",", &save);
     if (token) *rd = parseRegister(token);
     
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &save);
     if (token) *rs = parseRegister(token);
     
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &save);
     if (token) *rt = parseRegister(token);
     
-    free(argsCopy);
+    asmFree(argsCopy);
 }
 
 // Parse two registers: "r5, r6"
 void parseTwoReg(char * args, int * rd, int * rs) {
-    char * argsCopy = strdup(args);
+    char * argsCopy = asmStrdup(args);
     char * token;
+    char * save;
     
-    token = strtok(argsCopy, ",");
+    token = strtok_r(argsCopy, ",", &save);
     if (token) *rd = parseRegister(token);
     
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &save);
     if (token) *rs = parseRegister(token);
     
-    free(argsCopy);
+    asmFree(argsCopy);
 }
 
 // Parse register and literal: "r5, 10"
 void parseRegLit(char * args, int * rd, int * L) {
-    char * argsCopy = strdup(args);
+    char * argsCopy = asmStrdup(args);
     char * token;
+    char * save;
     
-    token = strtok(argsCopy, ",");
+    token = strtok_r(argsCopy, ",", &save);
     if (token) *rd = parseRegister(token);
     
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &save);
     if (token) *L = parseLiteral(token);
     
-    free(argsCopy);
+    asmFree(argsCopy);
 }
 
 // Parse memory load: "r7, (r6)(0)"
 void parseMemoryLoad(char * args, int * rd, int * rs, int * offset) {
-    char * argsCopy = strdup(args);
+    char * argsCopy = asmStrdup(args);
     
     // Find the comma
     char * comma = strchr(argsCopy, ',');
     if (!comma) {
-        fprintf(stderr, "Error: Invalid memory load format\n");
-        exit(1);
+        asmError("Error: Invalid memory load format\n");
     }
     
     *comma = '\0';
@@ -181,15 +181,13 @@ void parseMemoryLoad(char * args, int * rd, int * rs, int * offset) {
     // Find first (
     char * paren1 = strchr(rest, '(');
     if (!paren1) {
-        fprintf(stderr, "Error: Invalid memory format\n");
-        exit(1);
+        asmError("Error: Invalid memory format\n");
     }
     
     // Find first )
     char * paren2 = strchr(paren1, ')');
     if (!paren2) {
-        fprintf(stderr, "Error: Invalid memory format\n");
-        exit(1);
+        asmError("Error: Invalid memory format\n");
     }
     
     // Extract register between first ( and )
@@ -208,18 +206,17 @@ void parseMemoryLoad(char * args, int * rd, int * rs, int * offset) {
         }
     }
     
-    free(argsCopy);
+    asmFree(argsCopy);
 }
 
 // Parse memory store: "(r5)(8), r3"
 void parseMemoryStore(char * args, int * rd, int * rs, int * offset) {
-    char * argsCopy = strdup(args);
+    char * argsCopy = asmStrdup(args);
     
     // Find the comma
     char * comma = strchr(argsCopy, ',');
     if (!comma) {
-        fprintf(stderr, "Error: Invalid memory store format\n");
-        exit(1);
+        asmError("Error: Invalid memory store format\n");
     }
     
     *comma = '\0';
@@ -231,14 +228,12 @@ void parseMemoryStore(char * args, int * rd, int * rs, int * offset) {
     // Parse (rd)(offset)
     char * paren1 = strchr(memPart, '(');
     if (!paren1) {
-        fprintf(stderr, "Error: Invalid memory format\n");
-        exit(1);
+        asmError("Error: Invalid memory format\n");
     }
     
     char * paren2 = strchr(paren1, ')');
     if (!paren2) {
-        fprintf(stderr, "Error: Invalid memory format\n");
-        exit(1);
+        asmError("Error: Invalid memory format\n");
     }
     
     *paren2 = '\0';
@@ -256,7 +251,7 @@ void parseMemoryStore(char * args, int * rd, int * rs, int * offset) {
         }
     }
     
-    free(argsCopy);
+    asmFree(argsCopy);
 }
 
 // Parse single register
@@ -266,15 +261,15 @@ int parseSingleReg(char * args) {
 
 // Extract command name from instruction line
 char * extractCommandName(char * line) {
-    char * lineCopy = strdup(line);
+    char * lineCopy = asmStrdup(line);
     char * space = strchr(lineCopy, ' ');
     
     if (space) {
         *space = '\0';
     }
     
-    char * cmd = strdup(lineCopy);
-    free(lineCopy);
+    char * cmd = asmStrdup(lineCopy);
+    asmFree(lineCopy);
     return cmd;
 }
 
@@ -285,7 +280,7 @@ char * extractArguments(char * line) {
         return trimWhitespaceAlloc(space + 1);
     }
     // No arguments
-    char * result = malloc(1);
+    char * result = asmAlloc(1);
     result[0] = '\0';
     return result;
 }
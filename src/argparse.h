@@ -1,5 +1,8 @@
 #pragma once
 
+// Trim leading/trailing whitespace in place, returns the new start
+char * trimWhitespace(char * str);
+
 // Parse register name to number (e.g., "r5" -> 5, "r31" -> 31)
 int parseRegister(char * reg);
 
@@ -0,0 +1,355 @@
+#include "assembler.h"
+#include "context.h"
+#include "parse.h"
+#include "macro.h"
+#include "encode.h"
+#include "pool.h"
+#include "image.h"
+#include "intermediate.h"
+#include "align.h"
+#include "reorder.h"
+#include "deadcode.h"
+#include "constprop.h"
+#include "inline.h"
+#include "legalize.h"
+#include "schedule.h"
+#include "spill.h"
+#include "expr.h"
+#include "instrument.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Steps:
+// 1: Read the source and get a script object
+// 2: go through the commands and turn each entry into machine bytecode
+// 3: output the binary
+
+void expandMacros(Script * script) {
+	int total = 0;
+	for (int i = 0; i < script->numEntries; i++)
+		total += script->entries[i].type == 0 ? cmdTable[script->entries[i].cmd.type].cnt : 1;
+
+	int newNumEntries = 0;
+	Entry * newEntries = asmAlloc(total * sizeof(Entry));
+	Entry add[MAX_EXPANSION];
+	for (int i = 0; i < script->numEntries; i++) {
+		if (script->entries[i].type != 0) {
+			newEntries[newNumEntries++] = script->entries[i];
+			continue;
+		}
+
+		int toAdd = expandMacro(&script->entries[i], add, script->ltable);
+
+		for (int j = 0; j < toAdd; j++)
+			newEntries[newNumEntries++] = add[j];
+	}
+
+	asmFree(script->entries);
+	script->entries = newEntries;
+	script->numEntries = newNumEntries;
+}
+
+// sectionAlign != 0 starts every switch between .code and .data on a multiple of it
+void fillLabelTable(Script * script, int sectionAlign) {
+	uint64_t address = 0x1000;
+	int section = -1;
+	int inCode = 0; // before any directive the lines are data
+	uint64_t sizes[2] = {0, 0};
+	script->hasCode = 0;
+	for (int i = 0; i < script->numEntries; i++) {
+		int type = script->entries[i].type;
+		script->hasCode |= type == 3;
+		if (sectionAlign && (type == 3 || type == 4)) {
+			if (section != -1 && type != section)
+				address = (address + sectionAlign - 1) / sectionAlign * sectionAlign;
+			section = type;
+		}
+		if (type == 3 || type == 4) inCode = type == 3;
+		uint64_t start = address;
+		if (script->entries[i].type != 2) script->entries[i].address = address;
+		if (script->entries[i].type == 2) {
+			script->entries[i].address = address;
+			insertLabel(script->entries[i].lbl, address, script->ltable);
+		} else if (script->entries[i].type == 1) { 
+			address += 8;
+		} else if (script->entries[i].type == 5 || script->entries[i].type == 6) {
+			address += script->entries[i].size;
+		} else if (script->entries[i].type == 7) {
+			script->entries[i].size = -address & (script->entries[i].align - 1);
+			address += script->entries[i].size;
+		}
+		else if (script->entries[i].type == 0) {
+			address += 4 * cmdTable[script->entries[i].cmd.type].cnt;
+		}
+		sizes[inCode] += address - start;
+	}
+	script->ltable->sized = 1;
+	script->ltable->dataSize = sizes[0];
+	script->ltable->codeSize = sizes[1];
+}
+
+void replaceLabels(Script * script) {
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type != 0 || entry->str == null) continue;
+		char missing[64];
+		char * modified = entry->cmd.type == BRR && entry->str[0] == ':'
+			? substituteRelative(entry->str, entry->address, script->ltable, missing)
+			: substituteLabels(entry->str, script->ltable, missing);
+		if (modified == null) {
+			asmError("Error: Label '%s' not found!\n", missing);
+		}
+		entry->str = modified;
+	}
+}
+
+void printToBinary(Script * script, FILE * file) {
+	for (int i = 0; i < script->numEntries; i++) {
+		writeEntry(file, &script->entries[i]);
+	}
+}
+
+struct AsmWorkspace {
+	AsmArena * arena;
+	ltable * table;
+};
+
+AsmWorkspace * newAsmWorkspace(void) {
+	AsmWorkspace * ws = malloc(sizeof(AsmWorkspace));
+	ws->arena = newAsmArena();
+	ws->table = malloc(sizeof(ltable));
+	return ws;
+}
+
+void freeAsmWorkspace(AsmWorkspace * ws) {
+	if (ws == null) return;
+	freeAsmArena(ws->arena);
+	free(ws->table);
+	free(ws);
+}
+
+typedef struct CachedScript {
+	char * key;
+	Script * script;    // keepScript copy, NULL for a free slot
+	int users;          // assemblies copying it right now, it stays while there are any
+	uint64_t used;      // last use, the least recent one makes room
+} CachedScript;
+
+struct AsmParseCache {
+	pthread_mutex_t lock;
+	CachedScript * slots;
+	int capacity;
+	uint64_t clock;
+};
+
+AsmParseCache * newAsmParseCache(int capacity) {
+	AsmParseCache * cache = calloc(1, sizeof(AsmParseCache));
+	pthread_mutex_init(&cache->lock, null);
+	cache->slots = calloc(capacity, sizeof(CachedScript));
+	cache->capacity = capacity;
+	return cache;
+}
+
+void freeAsmParseCache(AsmParseCache * cache) {
+	if (cache == null) return;
+	for (int i = 0; i < cache->capacity; i++) {
+		free(cache->slots[i].key);
+		freeKeptScript(cache->slots[i].script);
+	}
+	free(cache->slots);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+// Puts a kept script in the free or least recently used slot nobody is copying
+static void cacheScript(AsmParseCache * cache, const char * key, Script * kept) {
+	if (kept == null) return;
+	pthread_mutex_lock(&cache->lock);
+	CachedScript * slot = null;
+	for (int i = 0; i < cache->capacity; i++) {
+		CachedScript * s = &cache->slots[i];
+		if (s->script && strcmp(s->key, key) == 0) {
+			// parsed by another assembly meanwhile
+			slot = null;
+			break;
+		}
+		if (s->users == 0 && (slot == null || s->used < slot->used)) slot = s;
+	}
+	if (slot) {
+		free(slot->key);
+		freeKeptScript(slot->script);
+		*slot = (CachedScript){ strdup(key), kept, 0, ++cache->clock };
+		kept = null;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	freeKeptScript(kept);
+}
+
+// Where the script of an assembly comes from
+typedef struct Source {
+	FILE * in;
+	ltable * table;         // the workspace's, NULL for a new one
+	AsmParseCache * cache;  // NULL for none
+	const char * key;
+} Source;
+
+static Script * loadScript(Source * source) {
+	ltable * table = source->table ? source->table : asmAlloc(sizeof(ltable));
+	AsmParseCache * cache = source->key ? source->cache : null;
+	if (cache) {
+		CachedScript * hit = null;
+		pthread_mutex_lock(&cache->lock);
+		for (int i = 0; i < cache->capacity && hit == null; i++)
+			if (cache->slots[i].script && strcmp(cache->slots[i].key, source->key) == 0) hit = &cache->slots[i];
+		if (hit) {
+			hit->users++;
+			hit->used = ++cache->clock;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (hit) {
+			Script * script = copyScript(hit->script, table);
+			pthread_mutex_lock(&cache->lock);
+			hit->users--;
+			pthread_mutex_unlock(&cache->lock);
+			return script;
+		}
+	}
+	Script * script = parseScriptWith(source->in, table);
+	if (cache) cacheScript(cache, source->key, keepScript(script));
+	return script;
+}
+
+static void runPipeline(Source * source, FILE * image, FILE * intermediate, FILE * counterMap, const AsmOptions * options) {
+	if (options->pool && (options->poolReg < 0 || options->poolReg > 31))
+		asmError("Error: Register out of range (0-31): r%d\n", options->poolReg);
+	if (options->legalize && (options->scratchReg < -1 || options->scratchReg > 31))
+		asmError("Error: Register out of range (0-31): r%d\n", options->scratchReg);
+	if (options->instrument && (options->instrumentReg < 0 || options->instrumentReg > 31))
+		asmError("Error: Register out of range (0-31): r%d\n", options->instrumentReg);
+	if (options->instrument && ((options->pool && options->poolReg == options->instrumentReg) ||
+			(options->legalize && options->scratchReg == options->instrumentReg)))
+		asmError("Error: --instrument needs r%d to itself\n", options->instrumentReg);
+
+	Script * script = loadScript(source);
+	resolveEquates(script);
+
+	InlineStats inlined;
+	if (options->inlineBudget) inlined = inlineLeaves(script, options->inlineBudget);
+
+	// registers the options claim, passes that add code leave them alone
+	uint32_t reserved = 0;
+	if (options->pool) reserved |= 1u << options->poolReg;
+	if (options->legalize && options->scratchReg >= 0) reserved |= 1u << options->scratchReg;
+	if (options->instrument) reserved |= 1u << options->instrumentReg;
+
+	ReorderStats reorder;
+	if (options->profile) reorder = reorderBlocks(script, parseProfile(options->profile, options->profileSize), reserved);
+
+	DeadCodeStats dead;
+	if (options->deadCode) dead = eliminateDeadCode(script);
+
+	ConstPropStats constProp;
+	if (options->constProp) constProp = propagateConstants(script);
+
+	SpillStats spills;
+	if (options->spills) spills = eliminateSpills(script);
+
+	Counters * counters = null;
+	if (options->instrument) {
+		counters = instrumentBlocks(script, options->instrumentReg, reserved);
+	}
+
+	ConstantPool * pool = null;
+	if (options->pool) pool = buildConstantPool(script, options->poolReg);
+
+	// 1: Intermediate file created
+	fillLabelTable(script, options->raw ? 0 : IMAGE_PAGE);
+	int aligned = 0;
+	if (options->alignLoops && (aligned = alignLoopTargets(script, options->alignLoops))) {
+		script->ltable->count = 0;
+		fillLabelTable(script, options->raw ? 0 : IMAGE_PAGE);
+	}
+	LegalizeStats legal;
+	if (options->legalize) legal = legalizeImmediates(script, options->scratchReg, options->raw ? 0 : IMAGE_PAGE);
+	resolveConstantPool(pool, script);
+	resolveDataExpressions(script);
+
+	expandMacros(script);
+
+	ScheduleStats scheduled;
+	if (options->schedule) scheduled = scheduleBlocks(script);
+
+	replaceLabels(script);
+
+	if (intermediate) printToIntermediate(script, intermediate);
+	if (counters) writeCounterMap(counters, script, counterMap);
+	if (options->raw) printToBinary(script, image);
+	else printToImage(script, image, options->symbols);
+
+	if (options->inlineBudget) reportInline(&inlined, asmDiagnostics());
+	if (options->profile) reportReorder(&reorder, asmDiagnostics());
+	if (options->deadCode) reportDeadCode(&dead, asmDiagnostics());
+	if (options->constProp) reportConstProp(&constProp, asmDiagnostics());
+	if (options->spills) reportSpills(&spills, asmDiagnostics());
+	if (options->pool) reportConstantPool(pool, asmDiagnostics());
+	if (options->alignLoops) reportAlignment(script, aligned, asmDiagnostics());
+	if (options->legalize) reportLegalize(&legal, asmDiagnostics());
+	if (options->schedule) reportSchedule(&scheduled, asmDiagnostics());
+	if (options->instrument) reportInstrument(counters, asmDiagnostics());
+}
+
+AsmResult assemble(const char * src, size_t len, const AsmOptions * options) {
+	return assembleWith(null, null, null, src, len, options);
+}
+
+AsmResult assembleWith(AsmWorkspace * ws, AsmParseCache * cache, const char * key,
+		const char * src, size_t len, const AsmOptions * options) {
+	AsmOptions defaults = {0};
+	if (options == null) options = &defaults;
+
+	AsmResult result = {0};
+	FILE * diag = open_memstream(&result.diagnostics, &result.diagnosticsSize);
+	FILE * image = open_memstream((char **)&result.image, &result.imageSize);
+	FILE * intermediate = options->intermediate ? open_memstream(&result.intermediate, &result.intermediateSize) : null;
+	FILE * counterMap = options->instrument ? open_memstream(&result.counterMap, &result.counterMapSize) : null;
+	// fmemopen does not take an empty buffer everywhere
+	FILE * in = len ? fmemopen((void *)src, len, "r") : fmemopen("\n", 1, "r");
+
+	if (diag && image && (intermediate || !options->intermediate) && (counterMap || !options->instrument) && in) {
+		AsmContext ctx;
+		asmBeginIn(&ctx, diag, ws ? ws->arena : null);
+		ctx.directory = options->directory;
+		Source source = { in, ws ? ws->table : null, cache, key };
+		if (setjmp(ctx.fail) == 0) {
+			runPipeline(&source, image, intermediate, counterMap, options);
+			result.ok = 1;
+		}
+		asmEnd(&ctx);
+	}
+
+	if (in) fclose(in);
+	if (image) fclose(image);
+	if (intermediate) fclose(intermediate);
+	if (counterMap) fclose(counterMap);
+	if (diag) fclose(diag);
+
+	if (!result.ok) {
+		free(result.image);
+		free(result.intermediate);
+		free(result.counterMap);
+		result.image = null;
+		result.intermediate = null;
+		result.counterMap = null;
+		result.imageSize = result.intermediateSize = result.counterMapSize = 0;
+	}
+	return result;
+}
+
+void freeAsmResult(AsmResult * result) {
+	free(result->image);
+	free(result->intermediate);
+	free(result->counterMap);
+	free(result->diagnostics);
+	*result = (AsmResult){0};
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+
+// In-memory assembler, the library interface of hw3 (libtinker.a / libtinker.so).
+//
+// assemble() takes .tk source and returns the image, the intermediate
+// (macro expanded) source, the counter map of an instrumented build and any
+// diagnostics. It does no I/O of its own
+// apart from reading .incbin files, keeps no global state and never exits:
+// an error fails that one call. Any number of threads may assemble at once.
+// assembleWith() is the same for a caller that assembles again and again
+// (hw3 --daemon): it reuses a workspace and skips parsing a source it has
+// parsed before.
+
+typedef struct AsmOptions {
+	int pool;           // move ld constants into a constant pool (see pool.h)
+	int poolReg;        // register holding the pool address when pool is set
+	int raw;            // headerless image instead of the sectioned format (image.h)
+	int symbols;        // add the label table to the sectioned image
+	int intermediate;   // also return the intermediate source
+	int alignLoops;     // align backward branch targets to this many bytes (see align.h), 0 for off
+	const char * profile;   // execution profile text (see profile.h) to lay out blocks by, or NULL
+	size_t profileSize;
+	int deadCode;       // drop unreachable code, unused data and labels (see deadcode.h)
+	int constProp;      // constant propagation and strength reduction (see constprop.h)
+	int spills;         // remove and batch push / pop around calls (see spill.h)
+	int inlineBudget;   // inline leaf routines up to this many words (see inline.h), 0 for off
+	int legalize;       // rewrite out of range immediates into sequences (see legalize.h)
+	int scratchReg;     // register legalize may clobber when legalize is set, -1 for none
+	int schedule;       // reorder straight line code to hide latencies (see schedule.h)
+	int instrument;     // count every code block entry (see instrument.h)
+	int instrumentReg;  // register holding the counter region address when instrument is set
+	const char * directory; // relative .incbin paths start here, NULL for the current directory
+} AsmOptions;
+
+typedef struct AsmResult {
+	int ok;                     // 0 if assembly failed, diagnostics says why
+	unsigned char * image;      // NULL when !ok
+	size_t imageSize;
+	char * intermediate;        // NUL terminated, NULL when !ok or not requested
+	size_t intermediateSize;
+	char * diagnostics;         // NUL terminated, errors and reports (may be empty)
+	size_t diagnosticsSize;
+	char * counterMap;          // NUL terminated, NULL when !ok or not instrumented
+	size_t counterMapSize;
+} AsmResult;
+
+// options may be NULL for the defaults (all zero)
+AsmResult assemble(const char * src, size_t len, const AsmOptions * options);
+
+// Frees the buffers of a result
+void freeAsmResult(AsmResult * result);
+
+// Memory one thread keeps between assemblies: the label table and an arena
+// every allocation of an assembly comes from. Use it on one thread at a time.
+typedef struct AsmWorkspace AsmWorkspace;
+AsmWorkspace * newAsmWorkspace(void);
+void freeAsmWorkspace(AsmWorkspace * ws);
+
+// Parsed sources by a key the caller makes unique to the source text (hw3
+// --daemon: its path, modification time and size), at most capacity of them.
+// Any number of threads may share one. Sources with .incbin are not kept.
+typedef struct AsmParseCache AsmParseCache;
+AsmParseCache * newAsmParseCache(int capacity);
+void freeAsmParseCache(AsmParseCache * cache);
+
+// assemble() in ws (NULL for a fresh one). With cache and key a source parsed
+// under key before is copied from the cache, and src is not read.
+AsmResult assembleWith(AsmWorkspace * ws, AsmParseCache * cache, const char * key,
+		const char * src, size_t len, const AsmOptions * options);
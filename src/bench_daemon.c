@@ -0,0 +1,67 @@
+#include "daemon.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Request latency of a fresh hw3 process against the same request served by
+// a running hw3 --daemon (socket from $HW3_SOCKET or the default).
+// usage: bench_daemon requests path/to/hw3 input.tk intermediate.tk output.tko
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char * name, double * samples, int n) {
+	qsort(samples, n, sizeof(double), compare);
+	printf("%-14s p50 %8.1f us   p99 %8.1f us   max %8.1f us\n", name,
+			samples[n / 2] * 1e6, samples[(int)(n * 0.99)] * 1e6, samples[n - 1] * 1e6);
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s requests path/to/hw3 args...\n", argv[0]);
+		return 1;
+	}
+	int n = atoi(argv[1]);
+	char ** args = argv + 2;
+	int numArgs = argc - 2;
+	double * samples = malloc(n * sizeof(double));
+
+	for (int i = 0; i < n; i++) {
+		double start = now();
+		pid_t pid = fork();
+		if (pid == 0) {
+			execv(args[0], args);
+			_exit(127);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		samples[i] = now() - start;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "fresh process run failed\n");
+			return 1;
+		}
+	}
+	report("fresh process", samples, n);
+
+	for (int i = 0; i < n; i++) {
+		double start = now();
+		int status = daemonRequest(NULL, numArgs, args);
+		samples[i] = now() - start;
+		if (status != 0) {
+			fprintf(stderr, status < 0 ? "no daemon listening\n" : "daemon request failed\n");
+			return 1;
+		}
+	}
+	report("daemon", samples, n);
+	return 0;
+}
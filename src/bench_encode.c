@@ -0,0 +1,55 @@
+#include "parse.h"
+#include "encode.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Encoder throughput: encodes a representative instruction mix over and over
+// and reports encoded instructions per second.
+// usage: bench_encode [iterations]
+
+static const char * mix[] = {
+	"add r1, r2, r3",
+	"addi r1, 4095",
+	"subi r31, 8",
+	"mul r4, r5, r6",
+	"xor r1, r1, r1",
+	"shftli r1, 12",
+	"brr -4",
+	"brr r6",
+	"brnz r1, r2",
+	"call r7",
+	"return",
+	"priv r1, r2, r0, 3",
+	"mov r1, (r31)(0)",
+	"mov (r31)(-8), r3",
+	"mov r1, r2",
+	"mov r1, 255",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 200000;
+	int n = sizeof(mix) / sizeof(mix[0]);
+
+	Entry entries[sizeof(mix) / sizeof(mix[0])];
+	for (int i = 0; i < n; i++)
+		entries[i] = *handleCmd((char *)mix[i], 0x1000 + 4 * i);
+
+	uint32_t checksum = 0;
+	double start = now();
+	for (long it = 0; it < iterations; it++)
+		for (int i = 0; i < n; i++)
+			checksum += getInstruction(&entries[i]);
+	double elapsed = now() - start;
+
+	long total = iterations * n;
+	printf("%ld instructions in %.3f s: %.2f M instructions/s (checksum %08x)\n",
+			total, elapsed, total / elapsed / 1e6, checksum);
+	return 0;
+}
@@ -1 +1,10 @@
-gcc -o hw3 main.c parse.c argparse.c labletable.c macro.c encode.c
+LIB="assembler.c context.c parse.c argparse.c labletable.c macro.c encode.c pool.c image.c intermediate.c align.c profile.c reorder.c cfg.c deadcode.c regs.c constprop.c inline.c legalize.c schedule.c spill.c decode.c expr.c instrument.c"
+gcc -pthread -o hw3 main.c stream.c daemon.c $LIB
+gcc -O2 -o tkemu emulator.c machine.c timing.c labletable.c context.c argparse.c
+gcc -O2 -pthread -o tkfarm farm.c machine.c labletable.c context.c argparse.c
+gcc -O2 -pthread -o tkdis disassembler.c machine.c $LIB
+gcc -O2 -o tkprof profiler.c
+gcc -O2 -pthread -o bench_encode bench_encode.c $LIB
+gcc -pthread -o hw3c client.c daemon.c
+gcc -O2 -pthread -o bench_daemon bench_daemon.c daemon.c
+gcc -c -fPIC -pthread $LIB && ar rcs libtinker.a ${LIB//.c/.o} && gcc -shared -pthread -o libtinker.so ${LIB//.c/.o}
@@ -0,0 +1,184 @@
+#include "cfg.h"
+#include "context.h"
+#include "argparse.h"
+#include "expr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static int compareLabel(const void * a, const void * b) {
+	return strcmp(((const CfgLabel *)a)->label, ((const CfgLabel *)b)->label);
+}
+
+static int isBlockHead(Entry * entries, int i, int n) {
+	return entries[i].type == 2 || (entries[i].type == 7 && i + 1 < n && entries[i + 1].type == 2);
+}
+
+int isHalt(Entry * entry) {
+	if (entry->cmd.type == HALT) return 1;
+	if (entry->cmd.type != PRIV || entry->str == null) return 0;
+	char * comma = strrchr(entry->str, ',');
+	return comma && strcmp(trimWhitespace(comma + 1), "0") == 0;
+}
+
+int labelLength(const char * p) {
+	int k = 0;
+	while (p[k] && !isspace((unsigned char)p[k]) && p[k] != ',' && p[k] != ')') k++;
+	return k;
+}
+
+// Instructions that end a block
+static int endsBlock(Entry * entry) {
+	switch (entry->cmd.type) {
+		case BR: case BRR: case BRNZ: case BRGT: case CALL: case RETURN: return 1;
+		default: return isHalt(entry);
+	}
+}
+
+// Instructions after which control never reaches the next one
+static int isUnconditional(Entry * entry) {
+	CommandType type = entry->cmd.type;
+	return type == BR || type == BRR || type == RETURN || isHalt(entry);
+}
+
+// brr :label, a label expression goes wherever it works out to
+static int isDirectBranch(Entry * entry) {
+	return entry->cmd.type == BRR && entry->str && isPlainLabel(entry->str);
+}
+
+Cfg * buildCfg(Script * script) {
+	Entry * entries = script->entries;
+	int n = script->numEntries;
+	Cfg * cfg = asmCalloc(1, sizeof(Cfg));
+	cfg->script = script;
+	cfg->blocks = asmAlloc((n + 1) * sizeof(BasicBlock));
+	cfg->labels = asmAlloc((n + 1) * sizeof(CfgLabel));
+
+	int data = 1; // until the first .code, tab lines are data
+	BasicBlock * cur = null;
+	for (int i = 0; i < n; i++) {
+		Entry * entry = &entries[i];
+		if (entry->type == 3 || entry->type == 4) {
+			data = entry->type == 4;
+			cur = null;
+			continue;
+		}
+		if (cur == null || (isBlockHead(entries, i, n) && !isBlockHead(entries, i - 1, n))) {
+			cur = &cfg->blocks[cfg->numBlocks++];
+			*cur = (BasicBlock){ .first = i, .last = i, .data = data, .succs = {-1, -1} };
+		}
+		cur->last = i + 1;
+
+		if (entry->type == 2)
+			cfg->labels[cfg->numLabels++] = (CfgLabel){ entry->lbl, cfg->numBlocks - 1 };
+		if (!data && entry->type == 0) {
+			if (entry->cmd.type == BRR && !isDirectBranch(entry)) cfg->pcRelative = 1;
+			if (endsBlock(entry)) cur = null;
+		}
+	}
+	qsort(cfg->labels, cfg->numLabels, sizeof(CfgLabel), compareLabel);
+
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		BasicBlock * block = &cfg->blocks[b];
+		if (block->data) continue;
+
+		Entry * last = null;
+		for (int i = block->last - 1; i >= block->first && last == null; i--)
+			if (entries[i].type == 0) last = &entries[i];
+
+		int k = 0;
+		// falls into the next block unless a directive comes first
+		if ((last == null || !isUnconditional(last)) && b + 1 < cfg->numBlocks &&
+				cfg->blocks[b + 1].first == block->last && !cfg->blocks[b + 1].data)
+			block->succs[k++] = b + 1;
+		if (last && isDirectBranch(last)) {
+			char * label = trimWhitespace(last->str);
+			int target = cfgLabelBlock(cfg, label);
+			if (target < 0) {
+				asmError("Error: Label '%s' not found!\n", label);
+			}
+			block->succs[k++] = target;
+		}
+	}
+	return cfg;
+}
+
+void freeCfg(Cfg * cfg) {
+	asmFree(cfg->blocks);
+	asmFree(cfg->labels);
+	asmFree(cfg);
+}
+
+char * cfgLabelText(Entry * entry) {
+	if (entry->type == 0) return entry->str;
+	if (entry->type == 1 || entry->type == 5) return entry->lbl;
+	return null;
+}
+
+int cfgLabelBlock(Cfg * cfg, char * label) {
+	CfgLabel key = { label, 0 };
+	CfgLabel * found = bsearch(&key, cfg->labels, cfg->numLabels, sizeof(CfgLabel), compareLabel);
+	return found ? found->block : -1;
+}
+
+static void reach(Cfg * cfg, int b, int * stack, int * top) {
+	if (b < 0 || cfg->blocks[b].reachable) return;
+	cfg->blocks[b].reachable = 1;
+	stack[(*top)++] = b;
+}
+
+// Are data blocks b and b + 1 back to back, with only .data between them
+static int sameDataRun(Cfg * cfg, int b) {
+	if (b + 1 >= cfg->numBlocks || !cfg->blocks[b].data || !cfg->blocks[b + 1].data) return 0;
+	Entry * entries = cfg->script->entries;
+	for (int i = cfg->blocks[b].last; i < cfg->blocks[b + 1].first; i++)
+		if (entries[i].type != 4) return 0;
+	return 1;
+}
+
+void markReachable(Cfg * cfg) {
+	Entry * entries = cfg->script->entries;
+	int * stack = asmAlloc((cfg->numBlocks + 1) * sizeof(int));
+	int top = 0;
+
+	int entry = -1;
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		BasicBlock * block = &cfg->blocks[b];
+		block->reachable = 0;
+		if (!block->data && entry < 0) entry = b;
+	}
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		// code reached by pc relative offsets, and data in front of the first
+		// label of its section
+		BasicBlock * block = &cfg->blocks[b];
+		if (block->data ? !isBlockHead(entries, block->first, cfg->script->numEntries) : cfg->pcRelative)
+			reach(cfg, b, stack, &top);
+	}
+	// the program entry is the first code block
+	reach(cfg, entry, stack, &top);
+
+	while (top > 0) {
+		int b = stack[--top];
+		BasicBlock * block = &cfg->blocks[b];
+		if (!block->data) {
+			reach(cfg, block->succs[0], stack, &top);
+			reach(cfg, block->succs[1], stack, &top);
+		} else {
+			// data may be read at any offset from a label of its run
+			if (sameDataRun(cfg, b)) reach(cfg, b + 1, stack, &top);
+			if (b > 0 && sameDataRun(cfg, b - 1)) reach(cfg, b - 1, stack, &top);
+		}
+
+		for (int i = block->first; i < block->last; i++) {
+			// every :label operand or data word expression is address taken
+			char * text = cfgLabelText(&entries[i]);
+			if (text == null || (entries[i].type == 0 && isDirectBranch(&entries[i]))) continue;
+			for (char * p = strchr(text, ':'); p; p = strchr(p + 1, ':')) {
+				char label[64];
+				snprintf(label, sizeof(label), "%.*s", labelLength(p), p);
+				reach(cfg, cfgLabelBlock(cfg, label), stack, &top);
+			}
+		}
+	}
+	asmFree(stack);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "parse.h"
+
+// Basic block control flow graph over the parsed (not yet expanded) entries.
+// Macros expand to straight line code, so a block of macro entries is also a
+// block of the expanded program.
+//
+// Code blocks start at labels (and at an .align right in front of one) and
+// end after br, brr, brnz, brgt, call, return and halt. Data sections are cut
+// into blocks at their labels.
+
+typedef struct BasicBlock {
+	int first;          // entries [first, last)
+	int last;
+	int data;           // part of a data section
+	int succs[2];       // fall-through / brr :label successors, -1 when unused
+	int reachable;      // set by markReachable
+} BasicBlock;
+
+typedef struct CfgLabel {
+	char * label;
+	int block;
+} CfgLabel;
+
+typedef struct Cfg {
+	Script * script;
+	BasicBlock * blocks;
+	int numBlocks;
+	CfgLabel * labels;  // sorted by name
+	int numLabels;
+	int pcRelative;     // brr by a number, a register or a label expression: targets are unknown
+} Cfg;
+
+// halt, or priv with the halt code 0
+int isHalt(Entry * entry);
+
+// Length of the ":label" token at p, which ends at a blank, ',' or ')'
+int labelLength(const char * p);
+
+Cfg * buildCfg(Script * script);
+void freeCfg(Cfg * cfg);
+
+// Text holding the :label references of an entry: instruction operands, or
+// the data words written as expressions. null if it has none
+char * cfgLabelText(Entry * entry);
+
+// Block a label belongs to, -1 if there is no such label
+int cfgLabelBlock(Cfg * cfg, char * label);
+
+// Flood from the entry block along the successors. A label referenced by a
+// reachable instruction (ld, mov, ...) is address taken, and may be the target
+// of any br / brnz / brgt / call through a register, so its block is reachable
+// too. With pcRelative set every code block is. A run of data blocks with no
+// code between them is reachable as a whole, it may be read at any offset
+// from one of its labels.
+void markReachable(Cfg * cfg);
@@ -0,0 +1,338 @@
+#include "constprop.h"
+#include "cfg.h"
+#include "regs.h"
+#include "encode.h"
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+typedef struct RegState {
+	int known;
+	uint64_t value;
+	int nonNeg;         // known to be >= 0 as a signed value
+	int pendingLd;      // "ld r, literal" that set it with no read since, -1
+	int pendingArith;   // addi / subi / shftli / shftri on it with no read since, -1
+} RegState;
+
+// Working state for one script
+typedef struct Pass {
+	Entry * entries;
+	char * removed;
+	RegState regs[32];
+	ConstPropStats * stats;
+} Pass;
+
+static int isPowerOfTwo(uint64_t v) {
+	return v && !(v & (v - 1));
+}
+
+static int log2u(uint64_t v) {
+	int k = 0;
+	while (v >>= 1) k++;
+	return k;
+}
+
+// div as the machine does it, t != 0
+static uint64_t quotient(uint64_t s, uint64_t t) {
+	if (t == (uint64_t)-1) return 0 - s; // INT64_MIN / -1 wraps
+	return (uint64_t)((int64_t)s / (int64_t)t);
+}
+
+static void rewrite(Entry * entry, CommandType type, const char * fmt, ...) __attribute__((format(printf, 3, 4)));
+static void rewrite(Entry * entry, CommandType type, const char * fmt, ...) {
+	char text[64];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+	entry->cmd.type = type;
+	entry->str = asmStrdup(text);
+}
+
+static void removeEntry(Pass * p, int i) {
+	p->removed[i] = 1;
+	p->stats->bytesSaved += 4 * cmdTable[p->entries[i].cmd.type].cnt;
+}
+
+// Apply an immediate arithmetic instruction to a value
+static uint64_t applyImmediate(CommandType type, uint64_t value, uint64_t imm) {
+	switch (type) {
+		case ADDI: return value + imm;
+		case SUBI: return value - imm;
+		case SHFTLI: return imm < 64 ? value << imm : 0;
+		default: return imm < 64 ? value >> imm : 0;
+	}
+}
+
+// A register known to hold value, -1 if there is none
+static int registerHolding(Pass * p, uint64_t value) {
+	for (int r = 0; r < 32; r++)
+		if (p->regs[r].known && p->regs[r].value == value) return r;
+	return -1;
+}
+
+// Fold "op r, imm" into the pending ld or arithmetic on r, 1 if the entry went away
+static int foldImmediate(Pass * p, int i, Operand * ops) {
+	Entry * entry = &p->entries[i];
+	CommandType type = entry->cmd.type;
+	int r = ops[0].reg;
+	uint64_t imm = ops[1].imm;
+	RegState * st = &p->regs[r];
+
+	if (st->pendingLd >= 0) {
+		st->value = applyImmediate(type, st->value, imm);
+		st->nonNeg = !(st->value >> 63);
+		rewrite(&p->entries[st->pendingLd], LD, "r%d, %llu", r, (unsigned long long)st->value);
+		removeEntry(p, i);
+		p->stats->ldFolds++;
+		return 1;
+	}
+	if (st->pendingArith < 0) return 0;
+
+	Entry * prev = &p->entries[st->pendingArith];
+	Operand prevOps[5];
+	parseOperands(prev->str, prevOps);
+	long long a = prevOps[1].imm, b = imm;
+	CommandType prevType = prev->cmd.type;
+
+	if ((prevType == ADDI || prevType == SUBI) && (type == ADDI || type == SUBI)) {
+		long long net = (prevType == ADDI ? a : -a) + (type == ADDI ? b : -b);
+		if (net < -4095 || net > 4095) return 0;
+		if (net == 0) {
+			removeEntry(p, st->pendingArith);
+			st->pendingArith = -1;
+		} else {
+			rewrite(prev, net > 0 ? ADDI : SUBI, "r%d, %lld", r, net > 0 ? net : -net);
+		}
+	} else if (prevType == type && (type == SHFTLI || type == SHFTRI) && a + b < 64) {
+		rewrite(prev, type, "r%d, %lld", r, a + b);
+	} else {
+		return 0;
+	}
+	if (st->known) st->value = applyImmediate(type, st->value, imm), st->nonNeg = !(st->value >> 63);
+	removeEntry(p, i);
+	p->stats->chains++;
+	return 1;
+}
+
+// rd = rx * 2^k or rx / 2^k (shift left / right) in one instruction when possible
+static int shiftInto(Pass * p, Entry * entry, int rd, int rx, int k, int left) {
+	if (rd == rx) {
+		rewrite(entry, left ? SHFTLI : SHFTRI, "r%d, %d", rd, k);
+		return 1;
+	}
+	int q = registerHolding(p, k);
+	if (q < 0) return 0;
+	rewrite(entry, left ? SHFTL : SHFTR, "r%d, r%d, r%d", rd, rx, q);
+	return 1;
+}
+
+// Strength reduce mul / div by a known constant, 1 if the entry went away
+static int reduceMulDiv(Pass * p, int i, Operand * ops, int * changed) {
+	Entry * entry = &p->entries[i];
+	int rd = ops[0].reg, rs = ops[1].reg, rt = ops[2].reg;
+	RegState * s = &p->regs[rs], * t = &p->regs[rt];
+	int mul = entry->cmd.type == MUL;
+
+	// both known: one cheap instruction that leaves rd at the result
+	RegState * d = &p->regs[rd];
+	if (s->known && t->known && d->known && (mul || t->value != 0)) {
+		uint64_t result = mul ? s->value * t->value : quotient(s->value, t->value);
+		int done = 1;
+		if (result == d->value) {
+			removeEntry(p, i);
+			p->stats->folded++;
+			return 1;
+		}
+		if (result - d->value <= 4095) rewrite(entry, ADDI, "r%d, %llu", rd, (unsigned long long)(result - d->value));
+		else if (d->value - result <= 4095) rewrite(entry, SUBI, "r%d, %llu", rd, (unsigned long long)(d->value - result));
+		else if ((result & ~0xfffull) == (d->value & ~0xfffull)) rewrite(entry, MOV, "r%d, %llu", rd, (unsigned long long)(result & 0xfff));
+		else done = 0;
+		if (done) {
+			p->stats->folded++;
+			*changed = 1;
+			return 0;
+		}
+	}
+
+	// the constant operand and the other one
+	uint64_t c;
+	int rx;
+	if (t->known) c = t->value, rx = rs;
+	else if (mul && s->known) c = s->value, rx = rt;
+	else return 0;
+
+	int done = 0;
+	if (mul && c == 0) {
+		rewrite(entry, XOR, "r%d, r%d, r%d", rd, rd, rd);
+		done = 1;
+	} else if (c == 1) {
+		if (rd == rx) {
+			removeEntry(p, i);
+			p->stats->strength++;
+			return 1;
+		}
+		rewrite(entry, MOV, "r%d, r%d", rd, rx);
+		done = 1;
+	} else if (isPowerOfTwo(c) && (mul || (log2u(c) < 63 && p->regs[rx].nonNeg))) {
+		done = shiftInto(p, entry, rd, rx, log2u(c), mul);
+	}
+	if (done) {
+		p->stats->strength++;
+		*changed = 1;
+	}
+	return 0;
+}
+
+// Value written to rd by the (possibly rewritten) instruction
+static void evaluate(Pass * p, Entry * entry, Operand * ops, int count) {
+	RegState * regs = p->regs;
+	int rd = ops[0].reg;
+	RegState * d = &regs[rd];
+	RegState * s = count > 1 && ops[1].kind == K_REG ? &regs[ops[1].reg] : null;
+	RegState * t = count > 2 && ops[2].kind == K_REG ? &regs[ops[2].reg] : null;
+	int both = s && t && s->known && t->known;
+	uint64_t imm = count > 1 && ops[1].kind == K_IMM ? (uint64_t)ops[1].imm : 0;
+
+	RegState out = {0};
+	switch (entry->cmd.type) {
+		case ADD: if (both) out.known = 1, out.value = s->value + t->value; break;
+		case SUB: if (both) out.known = 1, out.value = s->value - t->value; break;
+		case MUL: if (both) out.known = 1, out.value = s->value * t->value; break;
+		case DIV:
+			if (both && t->value != 0) out.known = 1, out.value = quotient(s->value, t->value);
+			out.nonNeg = s && t && s->nonNeg && t->nonNeg;
+			break;
+		case AND:
+			if (both) out.known = 1, out.value = s->value & t->value;
+			out.nonNeg = (s && s->nonNeg) || (t && t->nonNeg);
+			break;
+		case OR: if (both) out.known = 1, out.value = s->value | t->value; break;
+		case XOR:
+			if (both) out.known = 1, out.value = s->value ^ t->value;
+			if (s && t && ops[1].reg == ops[2].reg) out.known = 1, out.value = 0;
+			break;
+		case NOT: if (s && s->known) out.known = 1, out.value = ~s->value; break;
+		case SHFTL: if (both && t->value < 64) out.known = 1, out.value = s->value << t->value; break;
+		case SHFTR:
+			if (both && t->value < 64) out.known = 1, out.value = s->value >> t->value;
+			out.nonNeg = t && t->known && t->value >= 1;
+			break;
+		case ADDI: case SUBI: case SHFTLI: case SHFTRI:
+			if (count > 1 && ops[1].kind == K_IMM && d->known)
+				out.known = 1, out.value = applyImmediate(entry->cmd.type, d->value, imm);
+			out.nonNeg = entry->cmd.type == SHFTRI && imm >= 1;
+			break;
+		case MOV:
+			if (s && s->known) out.known = 1, out.value = s->value;
+			if (s) out.nonNeg = s->nonNeg;
+			// past 12 bits only --legalize assembles it, as the whole value
+			if (count > 1 && ops[1].kind == K_IMM && imm > 4095)
+				out.known = 1, out.value = imm;
+			else if (count > 1 && ops[1].kind == K_IMM && d->known)
+				out.known = 1, out.value = (d->value & ~0xfffull) | (imm & 0xfff);
+			break;
+		case CLR: out.known = 1, out.value = 0; break;
+		case LD: if (count > 1 && ops[1].kind == K_IMM) out.known = 1, out.value = imm; break;
+		default: break;
+	}
+	if (out.known && !(out.value >> 63)) out.nonNeg = 1;
+	d->known = out.known;
+	d->value = out.value;
+	d->nonNeg = out.nonNeg;
+}
+
+static void forwardBlock(Pass * p, BasicBlock * block) {
+	for (int r = 0; r < 32; r++)
+		p->regs[r] = (RegState){ .pendingLd = -1, .pendingArith = -1 };
+
+	for (int i = block->first; i < block->last; i++) {
+		Entry * entry = &p->entries[i];
+		if (entry->type != 0 || p->removed[i]) continue;
+
+		Operand ops[5] = {0};
+		int count = parseOperands(entry->str, ops);
+		CommandType type = entry->cmd.type;
+		int regImm = count == 2 && ops[0].kind == K_REG && ops[1].kind == K_IMM;
+		int threeReg = count == 3 && ops[0].kind == K_REG && ops[1].kind == K_REG && ops[2].kind == K_REG;
+
+		if ((type == ADDI || type == SUBI || type == SHFTLI || type == SHFTRI) && regImm && foldImmediate(p, i, ops))
+			continue;
+		if ((type == MUL || type == DIV) && threeReg) {
+			int changed = 0;
+			if (reduceMulDiv(p, i, ops, &changed)) continue;
+			if (changed) count = parseOperands(entry->str, ops);
+		}
+
+		RegEffects fx = registerEffects(entry);
+		for (int r = 0; r < 32; r++)
+			if ((fx.uses & REG_BIT(r)) || fx.sideEffects)
+				p->regs[r].pendingLd = p->regs[r].pendingArith = -1;
+
+		if (fx.defs == ALL_REGS) {
+			for (int r = 0; r < 32; r++)
+				p->regs[r] = (RegState){ .pendingLd = -1, .pendingArith = -1 };
+			continue;
+		}
+		for (int r = 0; r < 32; r++) {
+			if (!(fx.defs & REG_BIT(r))) continue;
+			if (ops[0].kind == K_REG && ops[0].reg == r) evaluate(p, entry, ops, count);
+			else p->regs[r].known = p->regs[r].nonNeg = 0;
+			p->regs[r].pendingLd = type == LD && p->regs[r].known ? i : -1;
+			p->regs[r].pendingArith = (type == ADDI || type == SUBI || type == SHFTLI || type == SHFTRI) && regImm ? i : -1;
+		}
+	}
+}
+
+// Drop instructions whose result nothing in the block reads before it is
+// written again; everything is live at the end
+static void removeDeadWrites(Pass * p, BasicBlock * block) {
+	uint32_t live = ALL_REGS;
+	for (int i = block->last - 1; i >= block->first; i--) {
+		Entry * entry = &p->entries[i];
+		if (entry->type != 0 || p->removed[i]) continue;
+		RegEffects fx = registerEffects(entry);
+		if (!fx.sideEffects && fx.defs && !(fx.defs & live)) {
+			removeEntry(p, i);
+			p->stats->deadWrites++;
+			continue;
+		}
+		live = (live & ~fx.defs) | fx.uses;
+	}
+}
+
+ConstPropStats propagateConstants(Script * script) {
+	ConstPropStats stats = {0};
+	Cfg * cfg = buildCfg(script);
+	if (cfg->pcRelative) {
+		// removing instructions would move the targets of pc relative offsets
+		stats.pcRelative = 1;
+		freeCfg(cfg);
+		return stats;
+	}
+
+	Pass p = { script->entries, asmCalloc(script->numEntries + 1, 1), {{0}}, &stats };
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		if (cfg->blocks[b].data) continue;
+		forwardBlock(&p, &cfg->blocks[b]);
+		removeDeadWrites(&p, &cfg->blocks[b]);
+	}
+	freeCfg(cfg);
+
+	int n = 0;
+	for (int i = 0; i < script->numEntries; i++)
+		if (!p.removed[i]) script->entries[n++] = script->entries[i];
+	script->numEntries = n;
+	asmFree(p.removed);
+	return stats;
+}
+
+void reportConstProp(ConstPropStats * stats, FILE * out) {
+	if (stats->pcRelative) {
+		fprintf(out, "constant propagation: skipped (pc relative brr)\n");
+		return;
+	}
+	fprintf(out, "constant propagation: %d folded into ld, %d chains merged, %d mul/div strength reduced, %d mul/div folded, %d dead writes removed, %ld bytes saved\n",
+			stats->ldFolds, stats->chains, stats->strength, stats->folded, stats->deadWrites, stats->bytesSaved);
+}
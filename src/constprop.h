@@ -0,0 +1,22 @@
+#pragma once
+#include "parse.h"
+
+typedef struct ConstPropStats {
+	int ldFolds;        // addi / subi / shftli / shftri folded into the ld literal before it
+	int chains;         // addi / subi and shift chains merged into one instruction
+	int strength;       // mul / div turned into shifts, moves or clears
+	int folded;         // mul / div with known operands replaced by one cheap instruction
+	int deadWrites;     // instructions whose result is overwritten before it is read
+	long bytesSaved;
+	int pcRelative;     // nothing done because of brr by a number, a register or a label expression
+} ConstPropStats;
+
+// Must run before fillLabelTable.
+// Local dataflow over every code basic block (cfg.h) tracking registers that
+// hold known constants (ld of a literal, clr, and arithmetic on those). Values
+// are 64 bit two's complement: add / sub / mul wrap, div is signed and shftr
+// logical, so div by 2^k only becomes a shift for a dividend known to be
+// non negative. Registers are all live at the end of a block.
+ConstPropStats propagateConstants(Script * script);
+
+void reportConstProp(ConstPropStats * stats, FILE * out);
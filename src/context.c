@@ -0,0 +1,217 @@
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+static _Thread_local AsmContext * current = NULL;
+
+// Allocation header, padded so the memory handed out keeps malloc's alignment.
+// Arena allocations keep their size in it instead of the links
+typedef union Header {
+	AsmBlock block;
+	size_t size;
+	max_align_t align;
+} Header;
+
+// Chunks smaller allocations share, a larger one gets a chunk of its own
+#define ARENA_CHUNK (1 << 20)
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+	ArenaChunk * next;
+	size_t size;        // bytes after the chunk header
+	size_t used;
+	max_align_t align;
+};
+
+struct AsmArena {
+	ArenaChunk * first;
+	ArenaChunk * chunk; // the one allocations come from, the ones after it are empty
+};
+
+AsmArena * newAsmArena(void) {
+	return calloc(1, sizeof(AsmArena));
+}
+
+void freeAsmArena(AsmArena * arena) {
+	if (arena == NULL) return;
+	while (arena->first) {
+		ArenaChunk * next = arena->first->next;
+		free(arena->first);
+		arena->first = next;
+	}
+	free(arena);
+}
+
+static void resetArena(AsmArena * arena) {
+	for (ArenaChunk * c = arena->first; c; c = c->next) c->used = 0;
+	arena->chunk = arena->first;
+}
+
+// size bytes (a multiple of the header size) from the arena, NULL when out of memory
+static void * arenaTake(AsmArena * arena, size_t size) {
+	ArenaChunk * c = arena->chunk;
+	while (c && c->size - c->used < size) c = c->next;
+	if (c == NULL) {
+		size_t bytes = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		c = malloc(sizeof(ArenaChunk) + bytes);
+		if (c == NULL) return NULL;
+		c->size = bytes;
+		c->used = 0;
+		// in front of the empty chunks, so the next reset finds it in order
+		ArenaChunk ** link = arena->chunk ? &arena->chunk->next : &arena->first;
+		c->next = *link;
+		*link = c;
+	}
+	arena->chunk = c;
+	void * p = (char *)(c + 1) + c->used;
+	c->used += size;
+	return p;
+}
+
+void asmBegin(AsmContext * ctx, FILE * diag) {
+	asmBeginIn(ctx, diag, NULL);
+}
+
+void asmBeginIn(AsmContext * ctx, FILE * diag, AsmArena * arena) {
+	ctx->diag = diag;
+	ctx->blocks.prev = ctx->blocks.next = &ctx->blocks;
+	ctx->maps = NULL;
+	ctx->numMaps = ctx->capMaps = 0;
+	ctx->arena = arena;
+	ctx->directory = NULL;
+	if (arena) resetArena(arena);
+	current = ctx;
+}
+
+void asmEnd(AsmContext * ctx) {
+	AsmBlock * b = ctx->blocks.next;
+	while (b != &ctx->blocks) {
+		AsmBlock * next = b->next;
+		free(b);
+		b = next;
+	}
+	for (int i = 0; i < ctx->numMaps; i++)
+		munmap(ctx->maps[i].addr, ctx->maps[i].length);
+	free(ctx->maps);
+	ctx->blocks.prev = ctx->blocks.next = &ctx->blocks;
+	if (ctx->arena) resetArena(ctx->arena);
+	if (current == ctx) current = NULL;
+}
+
+static void outOfMemory(void) {
+	asmError("Error: out of memory\n");
+}
+
+static void * arenaAlloc(size_t size) {
+	size_t rounded = (size + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+	if (rounded < size) outOfMemory();
+	Header * h = arenaTake(current->arena, sizeof(Header) + rounded);
+	if (h == NULL) outOfMemory();
+	h->size = size;
+	return h + 1;
+}
+
+static void * linkBlock(Header * h) {
+	AsmBlock * head = &current->blocks;
+	h->block.prev = head;
+	h->block.next = head->next;
+	head->next->prev = &h->block;
+	head->next = &h->block;
+	return h + 1;
+}
+
+static void unlinkBlock(Header * h) {
+	h->block.prev->next = h->block.next;
+	h->block.next->prev = h->block.prev;
+}
+
+void * asmAlloc(size_t size) {
+	if (current == NULL) {
+		void * p = malloc(size);
+		if (p == NULL && size) outOfMemory();
+		return p;
+	}
+	if (current->arena) return arenaAlloc(size);
+	Header * h = malloc(sizeof(Header) + size);
+	if (h == NULL) outOfMemory();
+	return linkBlock(h);
+}
+
+void * asmCalloc(size_t count, size_t size) {
+	if (size && count > (size_t)-1 / size) outOfMemory();
+	void * p = asmAlloc(count * size);
+	memset(p, 0, count * size);
+	return p;
+}
+
+void * asmRealloc(void * ptr, size_t size) {
+	if (current == NULL) {
+		void * p = realloc(ptr, size);
+		if (p == NULL && size) outOfMemory();
+		return p;
+	}
+	if (ptr == NULL) return asmAlloc(size);
+	Header * h = (Header *)ptr - 1;
+	if (current->arena) {
+		if (size <= h->size) return ptr;
+		void * p = arenaAlloc(size);
+		memcpy(p, ptr, h->size);
+		return p;
+	}
+	unlinkBlock(h);
+	Header * moved = realloc(h, sizeof(Header) + size);
+	if (moved == NULL) {
+		linkBlock(h);
+		outOfMemory();
+	}
+	return linkBlock(moved);
+}
+
+char * asmStrdup(const char * str) {
+	size_t n = strlen(str) + 1;
+	char * copy = asmAlloc(n);
+	memcpy(copy, str, n);
+	return copy;
+}
+
+void asmFree(void * ptr) {
+	if (ptr == NULL) return;
+	if (current == NULL) {
+		free(ptr);
+		return;
+	}
+	// arena memory goes back all at once with asmEnd
+	if (current->arena) return;
+	Header * h = (Header *)ptr - 1;
+	unlinkBlock(h);
+	free(h);
+}
+
+void asmTrackMapping(void * addr, size_t length) {
+	if (current == NULL) return;
+	if (current->numMaps == current->capMaps) {
+		current->capMaps = current->capMaps ? current->capMaps * 2 : 4;
+		current->maps = realloc(current->maps, current->capMaps * sizeof(AsmMapping));
+	}
+	current->maps[current->numMaps++] = (AsmMapping){ addr, length };
+}
+
+FILE * asmDiagnostics(void) {
+	return current ? current->diag : stderr;
+}
+
+const char * asmDirectory(void) {
+	return current ? current->directory : NULL;
+}
+
+void asmError(const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(asmDiagnostics(), fmt, args);
+	va_end(args);
+
+	if (current) longjmp(current->fail, 1);
+	exit(1);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <setjmp.h>
+
+// Per assembly state that lets the assembler run as a library.
+//
+// While a context is active on the calling thread every allocation made
+// through asmAlloc & co. is recorded and released by asmEnd, and asmError
+// records its message and jumps back to the asmBegin caller instead of
+// exiting. With no active context (the command line tools) they behave like
+// malloc & co. and print + exit(1).
+
+typedef struct AsmBlock AsmBlock;
+struct AsmBlock {
+	AsmBlock * prev;
+	AsmBlock * next;
+};
+
+typedef struct AsmMapping {
+	void * addr;
+	size_t length;
+} AsmMapping;
+
+// Memory for a caller that assembles again and again on one thread (hw3
+// --daemon). Allocations are carved out of large chunks, asmFree leaves them
+// and asmEnd empties the arena at once but keeps its chunks for the next
+// assembly, so a warm arena allocates nothing.
+typedef struct AsmArena AsmArena;
+
+typedef struct AsmContext {
+	jmp_buf fail;           // asmError longjmps here
+	FILE * diag;            // where diagnostics are written
+	AsmBlock blocks;        // every live allocation
+	AsmMapping * maps;      // .incbin mappings to unmap
+	int numMaps;
+	int capMaps;
+	AsmArena * arena;       // allocations come from here instead, NULL for none
+	const char * directory; // relative file names (.incbin) start here, NULL for the current directory
+} AsmContext;
+
+// Make ctx the active context of this thread, diagnostics go to diag
+void asmBegin(AsmContext * ctx, FILE * diag);
+// asmBegin with every allocation taken from arena
+void asmBeginIn(AsmContext * ctx, FILE * diag, AsmArena * arena);
+// Release everything allocated under ctx and deactivate it
+void asmEnd(AsmContext * ctx);
+
+AsmArena * newAsmArena(void);
+void freeAsmArena(AsmArena * arena);
+
+void * asmAlloc(size_t size);
+void * asmCalloc(size_t count, size_t size);
+void * asmRealloc(void * ptr, size_t size);
+char * asmStrdup(const char * str);
+void asmFree(void * ptr);
+
+// Unmapped by asmEnd (kept for the life of the process without a context)
+void asmTrackMapping(void * addr, size_t length);
+
+// Stream for reports and warnings: the context's diagnostics or stderr
+FILE * asmDiagnostics(void);
+
+// The context's directory: where relative file names start, NULL for the current one
+const char * asmDirectory(void);
+
+// Report an error and abandon the current assembly
+void asmError(const char * fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
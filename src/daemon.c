@@ -0,0 +1,229 @@
+#include "daemon.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+void daemonSocketPath(const char * path, char * out, int size) {
+	if (path == NULL) path = getenv("HW3_SOCKET");
+	if (path != NULL) snprintf(out, size, "%s", path);
+	else snprintf(out, size, DAEMON_SOCKET_FMT, (int)getuid());
+}
+
+static int socketAddress(const char * path, struct sockaddr_un * addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int readAll(int fd, void * buf, size_t n) {
+	char * p = buf;
+	while (n > 0) {
+		ssize_t got = read(fd, p, n);
+		if (got <= 0) return -1;
+		p += got;
+		n -= got;
+	}
+	return 0;
+}
+
+static int writeAll(int fd, const void * buf, size_t n) {
+	const char * p = buf;
+	while (n > 0) {
+		ssize_t put = write(fd, p, n);
+		if (put <= 0) return -1;
+		p += put;
+		n -= put;
+	}
+	return 0;
+}
+
+// Receives the request header together with the client's stdin, stdout and stderr
+static int receiveHeader(int conn, DaemonRequest * req, int fds[3]) {
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { req, sizeof(*req) };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t got = recvmsg(conn, &msg, MSG_WAITALL);
+	struct cmsghdr * cmsg = got < 0 ? NULL : CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	if (got != sizeof(*req)) {
+		// the descriptors came along, they would stay open in the daemon
+		for (int i = 0; i < 3; i++) close(fds[i]);
+		return -1;
+	}
+	return 0;
+}
+
+typedef struct Daemon {
+	int listener;
+	void * (*newWorker)(void);
+	int (*run)(DaemonCall * call);
+} Daemon;
+
+// Reads the payload after the header: cwd, argv[0], ..., argv[argc - 1].
+// Returns argv (NULL terminated) and the payload, which starts with the cwd,
+// or NULL for a malformed request
+static char ** readArguments(int conn, DaemonRequest * req, char ** payload) {
+	// every argument takes a byte at least
+	if (req->argc > req->length) return NULL;
+	*payload = malloc(req->length + 1);
+	char ** argv = malloc((req->argc + 1) * sizeof(char *));
+	if (*payload == NULL || argv == NULL || readAll(conn, *payload, req->length) < 0) {
+		free(argv);
+		return NULL;
+	}
+	char * end = *payload + req->length;
+	*end = '\0';
+	char * p = *payload + strlen(*payload) + 1;
+	for (unsigned int i = 0; i < req->argc; i++) {
+		if (p >= end) {
+			free(argv);
+			return NULL;
+		}
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[req->argc] = NULL;
+	return argv;
+}
+
+// One connection, on the worker thread that accepted it
+static void serve(int conn, Daemon * daemon, void * worker) {
+	DaemonRequest req;
+	int fds[3];
+	if (receiveHeader(conn, &req, fds) < 0) return;
+
+	char * payload = NULL;
+	char ** argv = readArguments(conn, &req, &payload);
+	FILE * streams[3] = { NULL, NULL, NULL };
+	const char * modes[3] = { "r", "w", "w" };
+	for (int i = 0; i < 3; i++) {
+		if (argv) streams[i] = fdopen(fds[i], modes[i]);
+		if (streams[i] == NULL) close(fds[i]);
+	}
+	int status = 1;
+	if (streams[0] && streams[1] && streams[2]) {
+		DaemonCall call = { payload, req.argc, argv, streams[0], streams[1], streams[2], worker };
+		status = daemon->run(&call);
+	}
+	// everything the request wrote reaches the client before its exit status
+	for (int i = 0; i < 3; i++)
+		if (streams[i]) fclose(streams[i]);
+	writeAll(conn, &status, sizeof(status));
+	free(argv);
+	free(payload);
+}
+
+static void * workerThread(void * arg) {
+	Daemon * daemon = arg;
+	void * worker = daemon->newWorker ? daemon->newWorker() : NULL;
+	for (;;) {
+		int conn = accept(daemon->listener, NULL, NULL);
+		if (conn < 0) continue;
+		serve(conn, daemon, worker);
+		close(conn);
+	}
+	return NULL;
+}
+
+int runDaemon(const char * path, int threads, void * (*newWorker)(void), int (*run)(DaemonCall * call)) {
+	char sockPath[108];
+	daemonSocketPath(path, sockPath, sizeof(sockPath));
+
+	struct sockaddr_un addr;
+	if (socketAddress(sockPath, &addr) < 0) return 1;
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(sockPath);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0) {
+		perror("hw3 daemon");
+		return 1;
+	}
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	if (threads > DAEMON_MAX_THREADS) threads = DAEMON_MAX_THREADS;
+	fprintf(stderr, "hw3 daemon listening on %s, %d worker threads\n", sockPath, threads);
+
+	// a client that goes away mid request must not take the daemon with it
+	signal(SIGPIPE, SIG_IGN);
+
+	static Daemon daemon;
+	daemon = (Daemon){ listener, newWorker, run };
+	for (int i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, workerThread, &daemon) != 0) {
+			perror("hw3 daemon");
+			break;
+		}
+		pthread_detach(thread);
+	}
+	workerThread(&daemon);
+	return 0;
+}
+
+int daemonRequest(const char * path, int argc, char * argv[]) {
+	char sockPath[108];
+	daemonSocketPath(path, sockPath, sizeof(sockPath));
+
+	struct sockaddr_un addr;
+	if (socketAddress(sockPath, &addr) < 0) return -1;
+	int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (conn < 0 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (conn >= 0) close(conn);
+		return -1;
+	}
+
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		close(conn);
+		return -1;
+	}
+	size_t length = strlen(cwd) + 1;
+	for (int i = 0; i < argc; i++) length += strlen(argv[i]) + 1;
+
+	char * payload = malloc(length);
+	char * p = payload;
+	p = stpcpy(p, cwd) + 1;
+	for (int i = 0; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+
+	DaemonRequest req = { argc, length };
+	int fds[3] = { 0, 1, 2 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int status = -1;
+	if (sendmsg(conn, &msg, 0) == sizeof(req) && writeAll(conn, payload, length) == 0 &&
+			readAll(conn, &status, sizeof(status)) < 0)
+		status = -1;
+
+	free(payload);
+	close(conn);
+	return status;
+}
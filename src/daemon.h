@@ -0,0 +1,46 @@
+#pragma once
+#include <stdio.h>
+
+// hw3 --daemon [socket] keeps one warm assembler process listening on a unix
+// domain socket; hw3c is the client and takes the same arguments as hw3.
+//
+// A request carries the client's working directory, its argv and its
+// stdin / stdout / stderr (passed as file descriptors), so paths, --stream
+// pipes and diagnostics behave exactly as if hw3 had been run by the client.
+// Requests are served in the daemon process by a fixed set of worker
+// threads, each keeping its own state (newWorker) from one request to the
+// next; an assembly error only fails its request. The handler must not use
+// the process' working directory or standard streams, only the call's.
+// The reply is the request's exit status.
+
+// Used when neither the argument nor HW3_SOCKET names a socket
+#define DAEMON_SOCKET_FMT "/tmp/hw3-%d.sock"
+#define DAEMON_MAX_THREADS 256
+
+typedef struct DaemonRequest {
+	unsigned int argc;
+	unsigned int length;    // bytes of cwd + args that follow, each NUL terminated
+} DaemonRequest;
+
+// One request as a worker hands it to the handler
+typedef struct DaemonCall {
+	const char * cwd;   // the client's working directory
+	int argc;
+	char ** argv;
+	FILE * in;          // the client's stdin / stdout / stderr
+	FILE * out;
+	FILE * err;
+	void * worker;      // what newWorker made for the thread serving the call
+} DaemonCall;
+
+// Socket path to use: path if given, else $HW3_SOCKET, else the per user default
+void daemonSocketPath(const char * path, char * out, int size);
+
+// Serve requests forever on threads worker threads (0: one per processor),
+// running each with run. newWorker (may be NULL) is called once on every
+// worker thread for the state its calls get.
+int runDaemon(const char * path, int threads, void * (*newWorker)(void), int (*run)(DaemonCall * call));
+
+// Client side: send argv to the daemon and return the exit status of the request,
+// or -1 if no daemon is listening
+int daemonRequest(const char * path, int argc, char * argv[]);
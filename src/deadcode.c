@@ -0,0 +1,94 @@
+#include "deadcode.h"
+#include "cfg.h"
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes an entry adds to the image (alignment padding is not known yet)
+static long entryBytes(Entry * entry) {
+	switch (entry->type) {
+		case 0: return 4 * cmdTable[entry->cmd.type].cnt;
+		case 1: return 8;
+		case 5:
+		case 6: return entry->size;
+		default: return 0;
+	}
+}
+
+static int compareName(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Every ":label" operand of the kept instructions and data words, sorted
+static char ** referencedLabels(Entry * entries, int n, int * count) {
+	int cap = 64;
+	char ** names = asmAlloc(cap * sizeof(char *));
+	*count = 0;
+	for (int i = 0; i < n; i++) {
+		char * text = cfgLabelText(&entries[i]);
+		if (text == null) continue;
+		for (char * p = strchr(text, ':'); p; p = strchr(p + 1, ':')) {
+			int k = labelLength(p);
+			char * name = asmAlloc(k + 1);
+			memcpy(name, p, k);
+			name[k] = '\0';
+			if (*count == cap) names = asmRealloc(names, (cap *= 2) * sizeof(char *));
+			names[(*count)++] = name;
+		}
+	}
+	qsort(names, *count, sizeof(char *), compareName);
+	return names;
+}
+
+DeadCodeStats eliminateDeadCode(Script * script) {
+	DeadCodeStats stats = {0};
+	Cfg * cfg = buildCfg(script);
+	markReachable(cfg);
+	stats.pcRelative = cfg->pcRelative;
+
+	Entry * entries = script->entries;
+	char * keep = asmAlloc(script->numEntries + 1);
+	memset(keep, 1, script->numEntries);
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		BasicBlock * block = &cfg->blocks[b];
+		if (block->reachable) continue;
+		long bytes = 0;
+		for (int i = block->first; i < block->last; i++) {
+			bytes += entryBytes(&entries[i]);
+			keep[i] = 0;
+		}
+		if (block->data) stats.dataBlocks++, stats.dataBytes += bytes;
+		else stats.codeBlocks++, stats.codeBytes += bytes;
+	}
+	freeCfg(cfg);
+
+	int n = 0;
+	for (int i = 0; i < script->numEntries; i++)
+		if (keep[i]) entries[n++] = entries[i];
+
+	// then the labels nothing left refers to
+	int numNames;
+	char ** names = referencedLabels(entries, n, &numNames);
+	int k = 0;
+	for (int i = 0; i < n; i++) {
+		if (entries[i].type == 2 && !bsearch(&entries[i].lbl, names, numNames, sizeof(char *), compareName)) {
+			stats.labels++;
+			continue;
+		}
+		entries[k++] = entries[i];
+	}
+	script->numEntries = k;
+
+	for (int i = 0; i < numNames; i++) asmFree(names[i]);
+	asmFree(names);
+	asmFree(keep);
+	return stats;
+}
+
+void reportDeadCode(DeadCodeStats * stats, FILE * out) {
+	fprintf(out, "dead code: %d unreachable code blocks (%ld bytes), %d unused data blocks (%ld bytes), %d labels removed, %ld bytes saved",
+			stats->codeBlocks, stats->codeBytes, stats->dataBlocks, stats->dataBytes, stats->labels,
+			stats->codeBytes + stats->dataBytes);
+	if (stats->pcRelative) fprintf(out, ", code kept (pc relative brr)");
+	fputc('\n', out);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "parse.h"
+
+typedef struct DeadCodeStats {
+	int codeBlocks;     // unreachable code blocks removed
+	long codeBytes;
+	int dataBlocks;     // data blocks no reachable instruction refers to
+	long dataBytes;
+	int labels;         // labels nothing refers to any more
+	int pcRelative;     // code kept because of brr by a number, a register or a label expression
+} DeadCodeStats;
+
+// Must run before fillLabelTable.
+// Builds the CFG (cfg.h), drops the code blocks that cannot be reached from
+// the entry and the runs of data (blocks with no code between them) that no
+// reachable entry refers to, then every label no remaining entry refers to.
+// A run with any label referenced is kept whole, since the program may read
+// it at an offset from that label.
+DeadCodeStats eliminateDeadCode(Script * script);
+
+void reportDeadCode(DeadCodeStats * stats, FILE * out);
@@ -0,0 +1,155 @@
+#include "decode.h"
+#include <string.h>
+#include <pthread.h>
+
+// The encodings of one opcode, call has two (call rd and call rd, rs, rt)
+typedef struct OpcodeInfo {
+	CommandType type;
+	const char * name;
+	int nameLength;
+	int count;
+	const OpFormat * variants[2];
+} OpcodeInfo;
+
+static OpcodeInfo decodeTable[32];
+static pthread_once_t decodeOnce = PTHREAD_ONCE_INIT;
+
+static void buildDecodeTable(void) {
+	for (int type = 0; type < DATA; type++)
+		for (int v = 0; v < MAX_VARIANTS && opTable[type][v].format != F_END; v++) {
+			OpcodeInfo * info = &decodeTable[opTable[type][v].opcode];
+			info->type = type;
+			info->name = cmdTable[type].name;
+			info->nameLength = strlen(info->name);
+			if (info->count < 2) info->variants[info->count++] = &opTable[type][v];
+		}
+}
+
+// Word bits each format fills: rd 26..22, rs 21..17, rt 16..12, L 11..0
+static const uint32_t fieldMask[] = {
+	[F_END]   = 0,
+	[F_NONE]  = 0,
+	[F_R]     = 0x07c00000,
+	[F_RR]    = 0x07fe0000,
+	[F_RRR]   = 0x07fff000,
+	[F_RI]    = 0x07c00fff,
+	[F_I]     = 0x00000fff,
+	[F_RRRI]  = 0x07ffffff,
+	[F_LOAD]  = 0x07fe0fff,
+	[F_STORE] = 0x07fe0fff,
+};
+
+int decodeWord(uint32_t word, Decoded * d) {
+	pthread_once(&decodeOnce, buildDecodeTable);
+	d->word = word;
+	d->opcode = word >> 27;
+	d->rd = (word >> 22) & 31;
+	d->rs = (word >> 17) & 31;
+	d->rt = (word >> 12) & 31;
+
+	const OpcodeInfo * info = &decodeTable[d->opcode];
+	if (info->count == 0) {
+		d->format = F_END;
+		d->exact = 0;
+		return 0;
+	}
+	// the first encoding that covers every set bit, else the widest
+	const OpFormat * f = info->variants[info->count - 1];
+	for (int v = 0; v < info->count; v++)
+		if ((word & 0x07ffffff & ~fieldMask[info->variants[v]->format]) == 0) {
+			f = info->variants[v];
+			break;
+		}
+	d->type = info->type;
+	d->format = f->format;
+	d->exact = (word & 0x07ffffff & ~fieldMask[f->format]) == 0;
+	uint32_t L = word & 0xfff;
+	d->imm = f->imm == IMM_S12 && (L & 0x800) ? (int64_t)L - 4096 : (int64_t)L;
+	return 1;
+}
+
+static char * putReg(char * p, int r) {
+	static const char text[32][4] = {
+		"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25", "r26", "r27", "r28", "r29", "r30", "r31",
+	};
+	memcpy(p, text[r], 4);
+	return p + (r < 10 ? 2 : 3);
+}
+
+// |v| < 4096, so at most four digits
+static char * putImm(char * p, int64_t v) {
+	if (v < 0) {
+		*p++ = '-';
+		v = -v;
+	}
+	unsigned u = v;
+	if (u >= 1000) *p++ = '0' + u / 1000;
+	if (u >= 100) *p++ = '0' + u / 100 % 10;
+	if (u >= 10) *p++ = '0' + u / 10 % 10;
+	*p++ = '0' + u % 10;
+	return p;
+}
+
+static char * putSep(char * p) {
+	*p++ = ',';
+	*p++ = ' ';
+	return p;
+}
+
+// "(rN)(L)"
+static char * putMem(char * p, int r, int64_t imm) {
+	*p++ = '(';
+	p = putReg(p, r);
+	*p++ = ')';
+	*p++ = '(';
+	p = putImm(p, imm);
+	*p++ = ')';
+	return p;
+}
+
+int formatInstruction(const Decoded * d, char * out) {
+	const OpcodeInfo * info = &decodeTable[d->opcode];
+	memcpy(out, info->name, info->nameLength);
+	char * p = out + info->nameLength;
+	if (d->format != F_NONE) *p++ = ' ';
+	switch (d->format) {
+		case F_R:
+			p = putReg(p, d->rd);
+			break;
+		case F_RR:
+			p = putSep(putReg(p, d->rd));
+			p = putReg(p, d->rs);
+			break;
+		case F_RRR:
+			p = putSep(putReg(p, d->rd));
+			p = putSep(putReg(p, d->rs));
+			p = putReg(p, d->rt);
+			break;
+		case F_RI:
+			p = putSep(putReg(p, d->rd));
+			p = putImm(p, d->imm);
+			break;
+		case F_I:
+			p = putImm(p, d->imm);
+			break;
+		case F_RRRI:
+			p = putSep(putReg(p, d->rd));
+			p = putSep(putReg(p, d->rs));
+			p = putSep(putReg(p, d->rt));
+			p = putImm(p, d->imm);
+			break;
+		case F_LOAD:
+			p = putSep(putReg(p, d->rd));
+			p = putMem(p, d->rs, d->imm);
+			break;
+		case F_STORE:
+			p = putSep(putMem(p, d->rd, d->imm));
+			p = putReg(p, d->rs);
+			break;
+		default:
+			break;
+	}
+	*p = '\0';
+	return p - out;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "encode.h"
+#include <stdint.h>
+
+// Inverse of getInstruction: splits a word into its fields with a table
+// indexed by opcode, built from opTable so the two cannot disagree.
+
+// Longest text formatInstruction writes, with the terminating NUL
+#define DECODE_MAX_TEXT 48
+
+typedef struct Decoded {
+	uint32_t word;
+	int opcode;
+	CommandType type;
+	Format format;      // F_END for an opcode nothing encodes to
+	int rd, rs, rt;
+	int64_t imm;        // sign extended for IMM_S12
+	int exact;          // no bits set outside the fields of the format
+} Decoded;
+
+// Decode one word, returns 0 for an illegal opcode
+int decodeWord(uint32_t word, Decoded * d);
+
+// Write d as hw3 assembles it ("mov r1, (r2)(-8)"), returns the length.
+// out must hold DECODE_MAX_TEXT bytes. Only valid after decodeWord returned 1.
+int formatInstruction(const Decoded * d, char * out);
+
+// Where a brr L (0xa) at address goes
+static inline uint64_t relativeTarget(const Decoded * d, uint64_t address) {
+	return address + (uint64_t)d->imm;
+}
@@ -0,0 +1,45 @@
+# Differential check of the optimisation passes, run after build.sh:
+#   sh difftest.sh [sample.tk ...]      (default: samples/*.tk and *.tk)
+# Every sample is assembled plain and with each flag, and tkemu has to print
+# the same and end the same way on both. A sample that only assembles with
+# --legalize gets it in every run, and one an option refuses by name (say
+# --instrument on a brr to a label expression) is skipped for that option.
+# A sample.prof next to a sample adds a --profile run with it.
+# Exit status 1 if anything differs.
+cd "$(dirname "$0")"
+FLAGS="--pool --align-loops --strip-dead --const-prop --strip-spills --inline --legalize --schedule --instrument"
+ALL="--pool --strip-dead --const-prop --strip-spills --inline --legalize --schedule"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+fail=0
+
+# output and exit status of the image assembled from $1 with the other arguments
+run() {
+	src=$1
+	shift
+	./hw3 "$@" "$src" "$TMP/image.tko" 2>"$TMP/asm.err" || { echo "assembly failed: $(head -1 "$TMP/asm.err")"; return; }
+	./tkemu --max-steps=100000000 "$TMP/image.tko" </dev/null 2>/dev/null
+	echo "exit $?"
+}
+
+[ $# -gt 0 ] || set -- samples/*.tk *.tk
+for src in "$@"; do
+	base=
+	./hw3 "$src" "$TMP/image.tko" 2>/dev/null || base=--legalize
+	run "$src" $base >"$TMP/expected"
+	prof=
+	[ -f "${src%.tk}.prof" ] && prof=--profile=${src%.tk}.prof
+	for flags in $FLAGS "$ALL" $prof; do
+		run "$src" $base $flags >"$TMP/actual"
+		# an option that turns the sample down by name is not a wrong result
+		if grep -q "^assembly failed: Error: $flags " "$TMP/actual"; then
+			echo "skip $src $flags: $(sed 's/^assembly failed: Error: //' "$TMP/actual")"
+		elif ! cmp -s "$TMP/expected" "$TMP/actual"; then
+			echo "DIFF $src $base $flags"
+			diff "$TMP/expected" "$TMP/actual" | head -6
+			fail=1
+		fi
+	done
+done
+[ $fail = 0 ] && echo "difftest: $# samples agree with every flag"
+exit $fail
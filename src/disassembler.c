@@ -0,0 +1,334 @@
+#include "decode.h"
+#include "machine.h"
+#include "image.h"
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+// Lists a Tinker image written by hw3 (sectioned or --raw): address, word and
+// instruction for code, the 64 bit words of data. Labels from the symbol
+// table of a --symbols image are printed where they are and name branch
+// targets: brr L, and br / brnz / brgt / call through a register that was
+// just loaded with a label address (ld).
+//
+// --verify lists nothing: every code word is decoded, reassembled with the
+// assembler's own encoder and compared with the image, mismatches go to
+// stdout. A word that has no instruction or sets bits outside its fields is
+// data (all of a --raw image is taken for code, .fill / .space can sit in
+// .code): it is reported as not an instruction and not verified.
+// --stats reports words and MB/s on stderr.
+// Exit status: 0 fine, 1 bad arguments, a malformed image or a mismatch.
+
+typedef struct Symbol {
+	uint64_t address;
+	char name[64];
+} Symbol;
+
+typedef struct Section {
+	uint32_t type;
+	uint64_t address;
+	uint64_t memSize;
+	const unsigned char * bytes;
+	uint64_t size;
+} Section;
+
+typedef struct Listing {
+	Symbol * symbols;   // by address
+	int numSymbols;
+	int next;           // first symbol not printed yet
+	char * buf;
+	size_t len;
+	size_t cap;
+	FILE * out;
+} Listing;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareSymbols(const void * a, const void * b) {
+	uint64_t x = ((const Symbol *)a)->address, y = ((const Symbol *)b)->address;
+	return x < y ? -1 : x > y;
+}
+
+// Sections and symbols of image, returns the number of sections or -1
+static int readImage(const unsigned char * image, size_t size, Section ** sections, Listing * listing) {
+	ImageHeader hdr;
+	if (size < sizeof(hdr) || memcmp(image, IMAGE_MAGIC, 4) != 0) {
+		*sections = malloc(sizeof(Section));
+		(*sections)[0] = (Section){ SECTION_CODE, IMAGE_ENTRY, size, image, size };
+		return 1;
+	}
+	memcpy(&hdr, image, sizeof(hdr));
+	if (hdr.version != IMAGE_VERSION || sizeof(hdr) + hdr.numSections * sizeof(SectionHeader) > size) {
+		fprintf(stderr, "unsupported image version %d\n", hdr.version);
+		return -1;
+	}
+	*sections = malloc((hdr.numSections + 1) * sizeof(Section));
+	for (int i = 0; i < hdr.numSections; i++) {
+		SectionHeader sec;
+		memcpy(&sec, image + sizeof(hdr) + i * sizeof(SectionHeader), sizeof(sec));
+		if (sec.type != SECTION_BSS && (sec.offset > size || sec.fileSize > size - sec.offset)) {
+			fprintf(stderr, "section at 0x%" PRIx64 " outside the image\n", sec.address);
+			return -1;
+		}
+		(*sections)[i] = (Section){ sec.type, sec.address, sec.memSize, image + sec.offset, sec.type == SECTION_BSS ? 0 : sec.fileSize };
+	}
+
+	uint64_t names = hdr.symbolOffset + (uint64_t)hdr.numSymbols * sizeof(SymbolEntry);
+	if (hdr.numSymbols == 0 || !listing) return hdr.numSections;
+	if (hdr.symbolOffset > size || names > size) {
+		fprintf(stderr, "symbol table outside the image\n");
+		return -1;
+	}
+	listing->symbols = malloc(hdr.numSymbols * sizeof(Symbol));
+	for (uint32_t i = 0; i < hdr.numSymbols; i++) {
+		SymbolEntry sym;
+		memcpy(&sym, image + hdr.symbolOffset + i * sizeof(SymbolEntry), sizeof(sym));
+		if (names + sym.nameOffset + sym.nameLength > size || sym.nameLength > 62) {
+			fprintf(stderr, "symbol name outside the image\n");
+			return -1;
+		}
+		Symbol * s = &listing->symbols[listing->numSymbols++];
+		s->address = sym.address;
+		s->name[0] = ':';
+		memcpy(s->name + 1, image + names + sym.nameOffset, sym.nameLength);
+		s->name[sym.nameLength + 1] = '\0';
+	}
+	qsort(listing->symbols, listing->numSymbols, sizeof(Symbol), compareSymbols);
+	return hdr.numSections;
+}
+
+static const Symbol * symbolAt(Listing * listing, uint64_t address) {
+	int lo = 0, hi = listing->numSymbols - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (listing->symbols[mid].address == address) return &listing->symbols[mid];
+		if (listing->symbols[mid].address < address) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return NULL;
+}
+
+static void flush(Listing * listing) {
+	fwrite(listing->buf, 1, listing->len, listing->out);
+	listing->len = 0;
+}
+
+// Room for one more line
+static char * reserve(Listing * listing) {
+	if (listing->cap - listing->len < 256) flush(listing);
+	return listing->buf + listing->len;
+}
+
+static char * putStr(char * p, const char * s) {
+	size_t len = strlen(s);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+// digits is even
+static char * putHex(char * p, uint64_t v, int digits) {
+	static const char hex[] = "0123456789abcdef";
+	static char pairs[256][2];
+	if (pairs[1][1] == 0)
+		for (int i = 0; i < 256; i++) pairs[i][0] = hex[i >> 4], pairs[i][1] = hex[i & 15];
+	for (int i = digits - 2; i >= 0; i -= 2, v >>= 8) memcpy(p + i, pairs[v & 0xff], 2);
+	return p + digits;
+}
+
+// Labels at addresses up to address that have not been printed
+static void printLabels(Listing * listing, uint64_t address) {
+	while (listing->next < listing->numSymbols && listing->symbols[listing->next].address <= address) {
+		char * p = reserve(listing);
+		p = putStr(p, listing->symbols[listing->next++].name);
+		*p++ = '\n';
+		listing->len = p - listing->buf;
+	}
+}
+
+static char * putTarget(char * p, Listing * listing, uint64_t target) {
+	p = putStr(p, "  <");
+	const Symbol * s = symbolAt(listing, target);
+	if (s) p = putStr(p, s->name);
+	else p = putHex(putStr(p, "0x"), target, 8);
+	*p++ = '>';
+	return p;
+}
+
+static void listCode(Listing * listing, const Section * sec) {
+	// values of registers set by ld / clr / addi / shftli / mov rd, L since the
+	// last control transfer; labels keep them, "ld r5, :loop" comes before :loop
+	uint64_t value[32] = {0};
+	uint32_t known = 0;
+	for (uint64_t off = 0; off + 4 <= sec->size; off += 4) {
+		uint64_t address = sec->address + off;
+		printLabels(listing, address);
+		uint32_t word;
+		memcpy(&word, sec->bytes + off, 4);
+		char * p = reserve(listing);
+		*p++ = ' ';
+		*p++ = ' ';
+		p = putHex(p, address, 8);
+		*p++ = ':';
+		*p++ = ' ';
+		p = putHex(p, word, 8);
+		*p++ = ' ';
+		*p++ = ' ';
+
+		Decoded d;
+		if (!decodeWord(word, &d)) {
+			p = putStr(p, "(illegal)");
+			known = 0;
+		} else {
+			p += formatInstruction(&d, p);
+			if (!d.exact) p = putStr(p, "  (stray bits)");
+			uint32_t rd = 1u << d.rd;
+			switch (d.opcode) {
+				case 0xa:
+					p = putTarget(p, listing, relativeTarget(&d, address));
+					break;
+				case 0x8: case 0xb: case 0xc: case 0xe:
+					if (known & rd) p = putTarget(p, listing, value[d.rd]);
+					break;
+				case 0x2:
+					if (d.rd == d.rs && d.rs == d.rt) value[d.rd] = 0, known |= rd;
+					else known &= ~rd;
+					break;
+				case 0x19: value[d.rd] += d.imm; break;
+				case 0x1b: value[d.rd] -= d.imm; break;
+				case 0x7: value[d.rd] = d.imm < 64 ? value[d.rd] << d.imm : 0; break;
+				case 0x12: value[d.rd] = (value[d.rd] & ~0xfffull) | (uint64_t)d.imm; break;
+				default:
+					if (d.opcode <= 0x7 || d.opcode >= 0x10 || d.opcode == 0xf) known &= ~rd;
+					break;
+			}
+			// leaving the block forgets what is known
+			if (d.opcode >= 0x8 && d.opcode <= 0xe) known = 0;
+		}
+		*p++ = '\n';
+		listing->len = p - listing->buf;
+	}
+}
+
+static void listData(Listing * listing, const Section * sec) {
+	for (uint64_t off = 0; off < sec->size; off += 8) {
+		uint64_t address = sec->address + off;
+		printLabels(listing, address);
+		uint64_t word = 0;
+		memcpy(&word, sec->bytes + off, sec->size - off < 8 ? sec->size - off : 8);
+		char * p = reserve(listing);
+		*p++ = ' ';
+		*p++ = ' ';
+		p = putHex(p, address, 8);
+		*p++ = ':';
+		*p++ = ' ';
+		p = putHex(p, word, 16);
+		*p++ = '\n';
+		listing->len = p - listing->buf;
+	}
+}
+
+// Reassemble every code word, returns the number of mismatches
+static long verifyCode(const Section * sec, long * notInstructions) {
+	AsmContext ctx;
+	asmBegin(&ctx, stdout);
+	long mismatches = 0;
+	for (uint64_t off = 0; off + 4 <= sec->size; off += 4) {
+		uint64_t address = sec->address + off;
+		uint32_t word;
+		memcpy(&word, sec->bytes + off, 4);
+		Decoded d;
+		if (!decodeWord(word, &d) || !d.exact) {
+			printf("0x%" PRIx64 ": %08x is not an instruction\n", address, word);
+			(*notInstructions)++;
+			continue;
+		}
+		char text[DECODE_MAX_TEXT];
+		formatInstruction(&d, text);
+		// asmError comes back here, with its message already on stdout
+		volatile uint32_t again = ~word;
+		if (setjmp(ctx.fail) == 0) {
+			Entry * entry = handleCmd(text, address);
+			again = getInstruction(entry);
+			asmFree(entry->str);
+			asmFree(entry);
+		}
+		if (again != word) {
+			printf("0x%" PRIx64 ": %08x disassembles to '%s', which assembles to %08x\n", address, word, text, again);
+			mismatches++;
+		}
+	}
+	asmEnd(&ctx);
+	return mismatches;
+}
+
+static int usage(const char * name) {
+	fprintf(stderr, "usage: %s [--verify] [--stats] [--no-symbols] image.tko\n", name);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int verify = 0, stats = 0, symbols = 1;
+	const char * file = NULL;
+	for (int i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		if (strcmp(arg, "--verify") == 0) verify = 1;
+		else if (strcmp(arg, "--stats") == 0) stats = 1;
+		else if (strcmp(arg, "--no-symbols") == 0) symbols = 0;
+		else if (arg[0] == '-' && arg[1] == '-') {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return usage(argv[0]);
+		} else file = arg;
+	}
+	if (file == NULL) return usage(argv[0]);
+
+	size_t size;
+	unsigned char * image = readImageFile(file, &size);
+	if (image == NULL) {
+		fprintf(stderr, "could not open %s\n", file);
+		return 1;
+	}
+	Listing listing = { .out = stdout, .cap = 1 << 20 };
+	Section * sections = NULL;
+	int numSections = readImage(image, size, &sections, symbols ? &listing : NULL);
+	if (numSections < 0) return 1;
+
+	double start = now();
+	long words = 0, mismatches = 0, notInstructions = 0;
+	listing.buf = malloc(listing.cap);
+	for (int i = 0; i < numSections; i++) {
+		Section * sec = &sections[i];
+		if (sec->type == SECTION_CODE) words += sec->size / 4;
+		if (verify) {
+			if (sec->type == SECTION_CODE) mismatches += verifyCode(sec, &notInstructions);
+			continue;
+		}
+		char * p = reserve(&listing);
+		p = putStr(p, sec->type == SECTION_CODE ? ".code" : sec->type == SECTION_DATA ? ".data" : ".bss");
+		p = putHex(putStr(p, "  0x"), sec->address, 8);
+		*p++ = '\n';
+		listing.len = p - listing.buf;
+		if (sec->type == SECTION_CODE) listCode(&listing, sec);
+		else if (sec->type == SECTION_DATA) listData(&listing, sec);
+		else printLabels(&listing, sec->address + sec->memSize - 1);
+	}
+	flush(&listing);
+	fflush(stdout);
+	double elapsed = now() - start;
+
+	if (verify)
+		fprintf(stderr, "verify: %ld words, %ld mismatches, %ld not instructions\n", words, mismatches, notInstructions);
+	if (stats)
+		fprintf(stderr, "%ld code words in %.3f s, %.1f MB/s\n", words, elapsed, elapsed > 0 ? words * 4 / elapsed / 1e6 : 0.0);
+
+	free(listing.buf);
+	free(listing.symbols);
+	free(sections);
+	free(image);
+	return mismatches ? 1 : 0;
+}
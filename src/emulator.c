@@ -0,0 +1,114 @@
+#include "machine.h"
+#include "timing.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Runs a Tinker image written by hw3 (sectioned or --raw), optionally through
+// the pipeline timing model (timing.h). Program I/O is stdin / stdout, reports
+// go to stderr. Exit status: 0 halted, 1 fault or bad arguments, 2 step limit.
+// --dump writes the memory the program ends with, for tkprof to read the
+// counters of an --instrument build from.
+
+static int usage(const char * name) {
+	fprintf(stderr, "usage: %s [--max-steps=N] [--dump=file] [--timing] [--stages=N] [--latency=op=N,...] [--no-forwarding]\n"
+			"       [--predictor=static|bimodal|gshare] [--predictor-bits=N] [--branches=N] image.tko\n"
+			"latency ops: mul div addf subf mulf divf load\n", name);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int timing = 0;
+	int topBranches = 10;
+	uint64_t maxSteps = 0;
+	const char * file = NULL;
+	const char * dumpFile = NULL;
+	TimingConfig config;
+	defaultTimingConfig(&config);
+
+	for (int i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		if (strcmp(arg, "--timing") == 0) timing = 1;
+		else if (strncmp(arg, "--max-steps=", 12) == 0) maxSteps = strtoull(arg + 12, NULL, 0);
+		else if (strncmp(arg, "--dump=", 7) == 0) dumpFile = arg + 7;
+		else if (strncmp(arg, "--stages=", 9) == 0) timing = 1, config.stages = atoi(arg + 9);
+		else if (strcmp(arg, "--no-forwarding") == 0) timing = 1, config.forwarding = 0;
+		else if (strncmp(arg, "--predictor-bits=", 17) == 0) timing = 1, config.predictorBits = atoi(arg + 17);
+		else if (strncmp(arg, "--branches=", 11) == 0) timing = 1, topBranches = atoi(arg + 11);
+		else if (strncmp(arg, "--latency=", 10) == 0) {
+			timing = 1;
+			if (!parseLatencies(&config, arg + 10)) {
+				fprintf(stderr, "invalid latency list '%s'\n", arg + 10);
+				return usage(argv[0]);
+			}
+		} else if (strncmp(arg, "--predictor=", 12) == 0) {
+			timing = 1;
+			if (!parsePredictor(&config, arg + 12)) {
+				fprintf(stderr, "unknown predictor '%s'\n", arg + 12);
+				return usage(argv[0]);
+			}
+		} else if (arg[0] == '-' && arg[1] == '-') {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return usage(argv[0]);
+		} else {
+			file = arg;
+		}
+	}
+	if (file == NULL) return usage(argv[0]);
+	if (config.stages < 3) {
+		fprintf(stderr, "a pipeline needs at least 3 stages\n");
+		return 1;
+	}
+
+	size_t len;
+	unsigned char * image = readImageFile(file, &len);
+	if (image == NULL) {
+		fprintf(stderr, "could not open %s\n", file);
+		return 1;
+	}
+
+	Machine * m = newMachine();
+	ltable * symbols = calloc(1, sizeof(ltable));
+	int loaded = loadImage(m, image, len, symbols);
+	free(image);
+
+	TimingModel model;
+	if (timing) initTiming(&model, &config);
+	if (loaded) {
+		Step step;
+		if (timing) {
+			while (machineStep(m, &step)) {
+				timeStep(&model, &step);
+				if (maxSteps && m->steps >= maxSteps) break;
+			}
+			// the halt itself
+			if (m->status == MACHINE_HALTED) timeStep(&model, &step);
+		} else {
+			runMachine(m, maxSteps);
+		}
+	}
+	fflush(m->out);
+
+	int status = 0;
+	if (m->status == MACHINE_FAULT) {
+		fprintf(stderr, "fault at 0x%" PRIx64 " after %" PRIu64 " instructions: %s\n", m->pc, m->steps, m->fault);
+		status = 1;
+	} else if (m->status == MACHINE_RUNNING) {
+		fprintf(stderr, "stopped at 0x%" PRIx64 " after %" PRIu64 " instructions (--max-steps)\n", m->pc, m->steps);
+		status = 2;
+	}
+	if (timing && loaded) reportTiming(&model, symbols, topBranches, stderr);
+	if (dumpFile) {
+		FILE * dump = fopen(dumpFile, "wb");
+		if (dump == NULL || !dumpMemory(m, dump)) {
+			fprintf(stderr, "could not write %s\n", dumpFile);
+			status = 1;
+		}
+		if (dump) fclose(dump);
+	}
+
+	if (timing) freeTiming(&model);
+	free(symbols);
+	freeMachine(m);
+	return status;
+}
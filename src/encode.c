@@ -1,27 +1,55 @@
 #include "encode.h"
+#include "context.h"
+#include "expr.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
-// Helper to build a 32-bit instruction
-// Bits are filled from MSB (31) to LSB (0)
 #include "argparse.h"
-#include "encode.h"
-
-int isLiteralArg(char * arg) {
-	char new = trim(arg)[0];
-	return new == 'r' ? 0 : new == '(' ? 0 : 1;
-}
 
-int isParArg(char * arg) {
-	char new = trim(arg)[0];
-	return new == '(';
-}
-
-int isRegArg(char * arg) {
-	return !(isLiteralArg(arg) | isParArg(arg));
-}
+const OpFormat opTable[DATA][MAX_VARIANTS] = {
+	[AND]    = {{0x0,  F_RRR}},
+	[OR]     = {{0x1,  F_RRR}},
+	[XOR]    = {{0x2,  F_RRR}},
+	[NOT]    = {{0x3,  F_RR}},
+	[SHFTR]  = {{0x4,  F_RRR}},
+	[SHFTRI] = {{0x5,  F_RI, IMM_U12}},
+	[SHFTL]  = {{0x6,  F_RRR}},
+	[SHFTLI] = {{0x7,  F_RI, IMM_U12}},
+	[BR]     = {{0x8,  F_R}},
+	[BRR]    = {{0x9,  F_R}, {0xa, F_I, IMM_S12}},
+	[BRNZ]   = {{0xb,  F_RR}},
+	[CALL]   = {{0xc,  F_R}, {0xc, F_RRR}},
+	[RETURN] = {{0xd,  F_NONE}},
+	[BRGT]   = {{0xe,  F_RRR}},
+	[PRIV]   = {{0xf,  F_RRRI, IMM_U12}},
+	[MOV]    = {{0x10, F_LOAD, IMM_S12}, {0x11, F_RR}, {0x12, F_RI, IMM_U12}, {0x13, F_STORE, IMM_S12}},
+	[ADDF]   = {{0x14, F_RRR}},
+	[SUBF]   = {{0x15, F_RRR}},
+	[MULF]   = {{0x16, F_RRR}},
+	[DIVF]   = {{0x17, F_RRR}},
+	[ADD]    = {{0x18, F_RRR}},
+	[ADDI]   = {{0x19, F_RI, IMM_U12}},
+	[SUB]    = {{0x1a, F_RRR}},
+	[SUBI]   = {{0x1b, F_RI, IMM_U12}},
+	[MUL]    = {{0x1c, F_RRR}},
+	[DIV]    = {{0x1d, F_RRR}},
+};
+
+// Operand kinds each format expects, in order
+static const struct { int count; OpKind kinds[4]; } shapes[] = {
+	[F_NONE]  = {0, {0}},
+	[F_R]     = {1, {K_REG}},
+	[F_RR]    = {2, {K_REG, K_REG}},
+	[F_RRR]   = {3, {K_REG, K_REG, K_REG}},
+	[F_RI]    = {2, {K_REG, K_IMM}},
+	[F_I]     = {1, {K_IMM}},
+	[F_RRRI]  = {4, {K_REG, K_REG, K_REG, K_IMM}},
+	[F_LOAD]  = {2, {K_REG, K_MEM}},
+	[F_STORE] = {2, {K_MEM, K_REG}},
+};
 
 uint32_t build_instruction(uint32_t opcode, int rd, int rs, int rt, uint32_t imm) {
     uint32_t instr = 0;
@@ -35,83 +63,124 @@ uint32_t build_instruction(uint32_t opcode, int rd, int rs, int rt, uint32_t imm
     return instr;
 }
 
-int instructionList(char ** list, char * args) {
-    if (args == NULL || strlen(args) == 0) return 0;
-    
-    char * argsCopy = strdup(args);
-    int count = 0;
-    char * token = strtok(argsCopy, ",");
-    
-    while (token != NULL && count < 4) {
-        list[count] = trim(token);
-        count++;
-        token = strtok(NULL, ",");
-    }
-    
-    free(argsCopy);
-    return count;
+static long long parseImmediate(char * lit) {
+	char * end;
+	long long value = lit[0] == '-' ? strtoll(lit, &end, 0) : (long long)strtoull(lit, &end, 0);
+	if (end == lit || *end != '\0') {
+		asmError("Error: Invalid literal '%s'\n", lit);
+	}
+	return value;
 }
 
-
-
-uint32_t getMovInstruction(Entry * entry) {
-	uint32_t opcode = cmdTable[entry->cmd.type].opcode;
-	int r[3] = {0, 0, 0}; // rd rs rt
-	int imm = 0;
-	
-	char * args[4];
-	for (int i = 0; i < 4; i++) 
-		args[i] = malloc(500*sizeof(char));
-	
-	char *rr = entry->str;
-	int len = instructionList(args, rr);
-	if (isRegArg(args[0]) && isParArg(args[1])) {
-		parseMemoryLoad(rr, &r[0], &r[1], &imm);
-	} else if (isRegArg(args[0]) && isRegArg(args[1])) {
-		opcode += 1;
-		r[0] = parseSingleReg(args[0]);
-		r[1] = parseSingleReg(args[1]);
-	} else if (isRegArg(args[0]) && isLiteralArg(args[1])) {
-		opcode += 2;
-		r[0] = parseSingleReg(args[0]);
-		imm = parseLiteral(args[1]);
-	} else if (isParArg(args[0]) && isRegArg(args[1])) {
-		opcode += 3;
-		parseMemoryStore(rr, &r[0], &r[1], &imm);
+// "(r5)(12)" or "(r5)"
+static void parseMemory(char * text, Operand * op) {
+	char * close = strchr(text, ')');
+	if (!close) {
+		asmError("Error: Invalid memory format '%s'\n", text);
+	}
+	*close = '\0';
+	op->reg = parseRegister(text + 1);
+	op->imm = 0;
+
+	char * off = strchr(close + 1, '(');
+	if (off) {
+		char * offEnd = strchr(off, ')');
+		if (!offEnd) {
+			asmError("Error: Invalid memory format\n");
+		}
+		*offEnd = '\0';
+		// a label offset is only known after layout, when it is substituted
+		char * text = trimWhitespace(off + 1);
+		op->imm = isLayoutExpression(text) ? 0 : parseImmediate(text);
 	}
+}
 
-	return build_instruction(opcode, r[0], r[1], r[2], imm);
+int parseOperands(char * args, Operand * ops) {
+	char buf[256];
+	size_t len = args ? strlen(args) : 0;
+	if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+	if (len) memcpy(buf, args, len);
+	buf[len] = '\0';
+
+	int count = 0;
+	char * token = trimWhitespace(buf);
+	if (*token == '\0') return 0;
+	while (token) {
+		char * comma = strchr(token, ',');
+		if (comma) *comma = '\0';
+		if (count == 4) return 5;
+
+		char * text = trimWhitespace(token);
+		Operand * op = &ops[count++];
+		if (text[0] == 'r') {
+			op->kind = K_REG;
+			op->reg = parseRegister(text);
+		} else if (text[0] == '(' && text[1] == 'r') {
+			op->kind = K_MEM;
+			parseMemory(text, op);
+		} else if (isLayoutExpression(text)) {
+			op->kind = K_LABEL;
+			op->imm = 0;
+		} else {
+			op->kind = K_IMM;
+			op->imm = parseImmediate(text);
+		}
+		token = comma ? comma + 1 : null;
+	}
+	return count;
 }
 
-uint32_t getBrrInstruction(Entry * entry) {
-	uint32_t opcode = cmdTable[entry->cmd.type].opcode;
-	char * arg = entry->str;
-	
-	if (isLiteralArg(arg))
-		return build_instruction(opcode + 1, 0, 0, 0, parseLiteral(arg));
-	return build_instruction(opcode, parseSingleReg(arg), 0, 0, 0);
+static int matchesShape(Format format, Operand * ops, int count) {
+	if (shapes[format].count != count) return 0;
+	for (int i = 0; i < count; i++)
+		if (shapes[format].kinds[i] != ops[i].kind) return 0;
+	return 1;
+}
 
+static uint32_t checkImmediate(const OpFormat * f, long long imm, Entry * entry) {
+	long long lo = f->imm == IMM_S12 ? -2048 : 0;
+	long long hi = f->imm == IMM_S12 ? 2047 : 4095;
+	if (imm < lo || imm > hi) {
+		asmError("Error: Immediate %lld out of range [%lld, %lld] in '%s %s' at 0x%x\n",
+				imm, lo, hi, cmdTable[entry->cmd.type].name, entry->str, entry->address);
+	}
+	return (uint32_t)imm;
 }
 
+// One encoder per format: each knows exactly which fields it fills
+static inline uint32_t encodeNone(const OpFormat * f)              { return build_instruction(f->opcode, 0, 0, 0, 0); }
+static inline uint32_t encodeR(const OpFormat * f, Operand * o)    { return build_instruction(f->opcode, o[0].reg, 0, 0, 0); }
+static inline uint32_t encodeRR(const OpFormat * f, Operand * o)   { return build_instruction(f->opcode, o[0].reg, o[1].reg, 0, 0); }
+static inline uint32_t encodeRRR(const OpFormat * f, Operand * o)  { return build_instruction(f->opcode, o[0].reg, o[1].reg, o[2].reg, 0); }
+static inline uint32_t encodeRI(const OpFormat * f, Operand * o, uint32_t imm)   { return build_instruction(f->opcode, o[0].reg, 0, 0, imm); }
+static inline uint32_t encodeI(const OpFormat * f, uint32_t imm)   { return build_instruction(f->opcode, 0, 0, 0, imm); }
+static inline uint32_t encodeRRRI(const OpFormat * f, Operand * o, uint32_t imm) { return build_instruction(f->opcode, o[0].reg, o[1].reg, o[2].reg, imm); }
+static inline uint32_t encodeLoad(const OpFormat * f, Operand * o, uint32_t imm)  { return build_instruction(f->opcode, o[0].reg, o[1].reg, 0, imm); }
+static inline uint32_t encodeStore(const OpFormat * f, Operand * o, uint32_t imm) { return build_instruction(f->opcode, o[0].reg, o[1].reg, 0, imm); }
+
 uint32_t getInstruction(Entry * entry) {
-	if (entry->cmd.type == MOV) return getMovInstruction(entry);
-	if (entry->cmd.type == BRR) return getBrrInstruction(entry);
-	uint32_t opcode = cmdTable[entry->cmd.type].opcode;
-	int r[3] = {0, 0, 0}; // rd rs rt
-	int imm = 0;
-	
-	char * args[4];
-	for (int i = 0; i < 4; i++) 
-		args[i] = malloc(500*sizeof(char));
-	int len = instructionList(args, entry->str);
-	for (int i = 0; i < len; i++) {
-		if (isLiteralArg(args[i])) {
-			imm = parseLiteral(args[i]);
-			break;
+	Operand ops[5];
+	int count = parseOperands(entry->str, ops);
+
+	const OpFormat * variants = opTable[entry->cmd.type];
+	for (int v = 0; v < MAX_VARIANTS && variants[v].format != F_END; v++) {
+		const OpFormat * f = &variants[v];
+		if (!matchesShape(f->format, ops, count)) continue;
+
+		switch (f->format) {
+			case F_NONE:  return encodeNone(f);
+			case F_R:     return encodeR(f, ops);
+			case F_RR:    return encodeRR(f, ops);
+			case F_RRR:   return encodeRRR(f, ops);
+			case F_RI:    return encodeRI(f, ops, checkImmediate(f, ops[1].imm, entry));
+			case F_I:     return encodeI(f, checkImmediate(f, ops[0].imm, entry));
+			case F_RRRI:  return encodeRRRI(f, ops, checkImmediate(f, ops[3].imm, entry));
+			case F_LOAD:  return encodeLoad(f, ops, checkImmediate(f, ops[1].imm, entry));
+			case F_STORE: return encodeStore(f, ops, checkImmediate(f, ops[0].imm, entry));
+			default: break;
 		}
-		r[i] = parseSingleReg(args[i]);
 	}
-	return build_instruction(opcode, r[0], r[1], r[2], imm);
-}
-
 
+	asmError("Error: Invalid operands for %s: '%s' at 0x%x\n",
+			cmdTable[entry->cmd.type].name, entry->str ? entry->str : "", entry->address);
+}
@@ -1,5 +1,53 @@
+#pragma once
 #include "parse.h"
-#include <stdint.h> 
+#include <stdint.h>
+
+// Operand layout of one encoding of an instruction
+typedef enum Format {
+	F_END = 0,  // terminates the variant list of a command
+	F_NONE,     // return
+	F_R,        // br rd
+	F_RR,       // not rd, rs
+	F_RRR,      // add rd, rs, rt
+	F_RI,       // addi rd, L
+	F_I,        // brr L
+	F_RRRI,     // priv rd, rs, rt, L
+	F_LOAD,     // mov rd, (rs)(L)
+	F_STORE,    // mov (rd)(L), rs
+} Format;
+
+// How the 12 bit immediate field is interpreted
+typedef enum ImmKind {
+	IMM_NONE,
+	IMM_U12,    // 0 .. 4095
+	IMM_S12,    // -2048 .. 2047
+} ImmKind;
+
+typedef struct OpFormat {
+	uint32_t opcode;
+	Format format;
+	ImmKind imm;
+} OpFormat;
+
+// Most encodings one mnemonic has (mov)
+#define MAX_VARIANTS 4
+
+// Every encoding of every real instruction, indexed by CommandType.
+// A mnemonic with several encodings (mov, brr) lists them all and the
+// operand shape picks one.
+extern const OpFormat opTable[DATA][MAX_VARIANTS];
+
+typedef enum OpKind { K_REG, K_IMM, K_MEM, K_LABEL } OpKind;
+
+// One parsed operand: r5 / 12 / (r5)(12) / :label
+typedef struct Operand {
+	OpKind kind;
+	int reg;
+	long long imm;
+} Operand;
+
+// Split "r1, (r2)(8)" into classified operands, returns how many (5 for too many)
+int parseOperands(char * args, Operand * ops);
 
 uint32_t getInstruction(Entry * entry);
 uint32_t build_instruction(uint32_t opcode, int rd, int rs, int rt, uint32_t imm);
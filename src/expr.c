@@ -0,0 +1,494 @@
+#include "expr.h"
+#include "context.h"
+#include "argparse.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+
+// Symbol names and label names (after the ':') in expressions
+static int isNameStart(char c) { return isalpha((unsigned char)c) || c == '_'; }
+static int isNameChar(char c) { return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$'; }
+
+// r0 .. r31
+static int isRegisterName(const char * s, size_t len) {
+	if (len < 2 || len > 3 || s[0] != 'r') return 0;
+	for (size_t i = 1; i < len; i++)
+		if (!isdigit((unsigned char)s[i])) return 0;
+	return atoi(s + 1) <= 31;
+}
+
+// A whole literal parseImmediate takes: "12", "0x1f", "-8"
+static int isPlainLiteral(const char * s) {
+	if (*s == '-') s++;
+	if (!isdigit((unsigned char)*s)) return 0;
+	char * end;
+	strtoull(s, &end, 0);
+	return *end == '\0';
+}
+
+int isPlainLabel(const char * s) {
+	if (*s != ':' || !isNameChar(s[1])) return 0;
+	for (s++; isNameChar(*s); s++)
+		;
+	while (isspace((unsigned char)*s)) s++;
+	return *s == '\0';
+}
+
+int isLayoutExpression(const char * text) {
+	return strchr(text, ':') != null || strstr(text, "sizeof") != null;
+}
+
+void defineEquate(Equates * equates, char * name, char * expr, int position, int redefinable) {
+	size_t len = strlen(name);
+	if (!isNameStart(name[0]) || isRegisterName(name, len) || strcmp(name, "sizeof") == 0) {
+		asmError("Error: invalid symbol name '%s'\n", name);
+	}
+	for (size_t i = 0; i < len; i++)
+		if (!isNameChar(name[i])) {
+			asmError("Error: invalid symbol name '%s'\n", name);
+		}
+	for (int i = 0; i < equates->count; i++) {
+		Equate * e = &equates->items[i];
+		if (strcmp(e->name, name) != 0) continue;
+		if (!e->redefinable || !redefinable) {
+			asmError("Error: symbol '%s' is already defined\n", name);
+		}
+	}
+	if (equates->count == equates->cap) {
+		equates->cap = equates->cap ? equates->cap * 2 : 16;
+		equates->items = asmRealloc(equates->items, equates->cap * sizeof(Equate));
+	}
+	equates->items[equates->count++] = (Equate){ asmStrdup(name), asmStrdup(expr), position, redefinable };
+}
+
+void freeEquates(Equates * equates) {
+	for (int i = 0; i < equates->count; i++) {
+		asmFree(equates->items[i].name);
+		asmFree(equates->items[i].expr);
+	}
+	asmFree(equates->items);
+	*equates = (Equates){0};
+}
+
+// The definition of name that applies at position among the first limit
+// definitions: the last one at or before position, else the first other one
+static Equate * findEquate(Equates * equates, const char * name, size_t len, int position, int limit) {
+	Equate * before = null;
+	Equate * after = null;
+	for (int i = 0; i < equates->count; i++) {
+		Equate * e = &equates->items[i];
+		if (strlen(e->name) != len || strncmp(e->name, name, len) != 0) continue;
+		if (i < limit && e->position <= position) before = e;
+		else if (!after) after = e;
+	}
+	return before ? before : after;
+}
+
+typedef struct Text {
+	char * data;
+	size_t len;
+	size_t cap;
+} Text;
+
+static void append(Text * t, const char * s, size_t n) {
+	if (t->len + n + 1 > t->cap) {
+		while (t->len + n + 1 > t->cap) t->cap = t->cap ? t->cap * 2 : 64;
+		t->data = asmRealloc(t->data, t->cap);
+	}
+	memcpy(t->data + t->len, s, n);
+	t->len += n;
+	t->data[t->len] = '\0';
+}
+
+// Expansion deeper than this is taken to be a definition that uses itself
+#define EQUATE_DEPTH 64
+
+static void expandInto(Text * out, const char * text, Equates * equates, int position, int limit, int depth) {
+	const char * p = text;
+	while (*p) {
+		// numbers, labels and sections are copied whole, "0x1f", ":a_b" and
+		// ".code" hold no names
+		if (isdigit((unsigned char)*p) || *p == ':' || *p == '.') {
+			const char * start = p++;
+			while (isNameChar(*p)) p++;
+			append(out, start, p - start);
+			continue;
+		}
+		if (!isNameStart(*p)) {
+			append(out, p++, 1);
+			continue;
+		}
+		const char * start = p;
+		while (isNameChar(*p)) p++;
+		Equate * e = findEquate(equates, start, p - start, position, limit);
+		if (e == null) {
+			append(out, start, p - start);
+			continue;
+		}
+		if (depth == EQUATE_DEPTH) {
+			asmError("Error: symbol '%s' is defined in terms of itself\n", e->name);
+		}
+		// names in a definition mean what they meant where it was made, so
+		// ".set n, n + 1" uses the n before it
+		char * def = trimWhitespace(e->expr);
+		int single = isPlainLiteral(def) || isPlainLabel(def);
+		if (!single) append(out, "(", 1);
+		expandInto(out, def, equates, e->position, e - equates->items, depth + 1);
+		if (!single) append(out, ")", 1);
+	}
+}
+
+char * expandEquates(const char * text, Equates * equates, int position) {
+	Text out = {0};
+	append(&out, "", 0);
+	if (equates == null || equates->count == 0) append(&out, text, strlen(text));
+	else expandInto(&out, text, equates, position, equates->count, 0);
+	return out.data;
+}
+
+typedef struct Eval {
+	const char * p;
+	ltable * table;
+	char * missing;
+	int status;         // 1 fine, 0 unknown label, -1 not an expression
+} Eval;
+
+static int64_t parseOr(Eval * ev);
+
+static void skipSpace(Eval * ev) {
+	while (isspace((unsigned char)*ev->p)) ev->p++;
+}
+
+static int accept(Eval * ev, const char * op) {
+	skipSpace(ev);
+	size_t n = strlen(op);
+	if (strncmp(ev->p, op, n) != 0) return 0;
+	// "<" is not "<<" and so on
+	if (n == 1 && (op[0] == '<' || op[0] == '>') && ev->p[1] == op[0]) return 0;
+	ev->p += n;
+	return 1;
+}
+
+static void fail(Eval * ev, int status) {
+	if (ev->status == 1) ev->status = status;
+}
+
+static int64_t parsePrimary(Eval * ev) {
+	skipSpace(ev);
+	const char * p = ev->p;
+	if (*p == '(') {
+		ev->p++;
+		int64_t v = parseOr(ev);
+		if (!accept(ev, ")")) fail(ev, -1);
+		return v;
+	}
+	if (isdigit((unsigned char)*p)) {
+		char * end;
+		uint64_t v = strtoull(p, &end, 0);
+		if (isNameChar(*end)) fail(ev, -1);
+		ev->p = end;
+		return (int64_t)v;
+	}
+	if (*p == ':') {
+		char label[64];
+		size_t k = 0;
+		label[k++] = *p++;
+		while (isNameChar(*p)) {
+			if (k < sizeof(label) - 1) label[k++] = *p;
+			p++;
+		}
+		label[k] = '\0';
+		ev->p = p;
+		uint64_t address = 0;
+		if (k == 1) fail(ev, -1);
+		else if (ev->table == null || !findLabel(label, ev->table, &address)) {
+			if (ev->status == 1 && ev->missing) strcpy(ev->missing, label);
+			fail(ev, 0);
+		}
+		return (int64_t)address;
+	}
+	if (strncmp(p, "sizeof", 6) == 0 && !isNameChar(p[6])) {
+		ev->p = p + 6;
+		int code = 0;
+		if (accept(ev, "(") && (accept(ev, ".code") ? (code = 1) : accept(ev, ".data")) && accept(ev, ")")) {
+			if (ev->table && ev->table->sized) return code ? ev->table->codeSize : ev->table->dataSize;
+			if (ev->status == 1 && ev->missing) strcpy(ev->missing, code ? "sizeof(.code)" : "sizeof(.data)");
+			fail(ev, 0);
+			return 0;
+		}
+	}
+	fail(ev, -1);
+	return 0;
+}
+
+static int64_t parseUnary(Eval * ev) {
+	if (accept(ev, "-")) return (int64_t)(0 - (uint64_t)parseUnary(ev));
+	if (accept(ev, "~")) return ~parseUnary(ev);
+	if (accept(ev, "+")) return parseUnary(ev);
+	return parsePrimary(ev);
+}
+
+static int64_t parseMul(Eval * ev) {
+	int64_t v = parseUnary(ev);
+	for (;;) {
+		int op = accept(ev, "*") ? '*' : accept(ev, "/") ? '/' : accept(ev, "%") ? '%' : 0;
+		if (!op) return v;
+		int64_t r = parseUnary(ev);
+		if (op == '*') v = (int64_t)((uint64_t)v * (uint64_t)r);
+		else if (r == 0) {
+			if (ev->status == 1) {
+				asmError("Error: division by zero in constant expression\n");
+			}
+		} else if (r == -1) v = op == '/' ? (int64_t)(0 - (uint64_t)v) : 0; // INT64_MIN / -1 wraps
+		else v = op == '/' ? v / r : v % r;
+	}
+}
+
+static int64_t parseAdd(Eval * ev) {
+	int64_t v = parseMul(ev);
+	for (;;) {
+		if (accept(ev, "+")) v = (int64_t)((uint64_t)v + (uint64_t)parseMul(ev));
+		else if (accept(ev, "-")) v = (int64_t)((uint64_t)v - (uint64_t)parseMul(ev));
+		else return v;
+	}
+}
+
+static int64_t parseShift(Eval * ev) {
+	int64_t v = parseAdd(ev);
+	for (;;) {
+		int left = accept(ev, "<<");
+		if (!left && !accept(ev, ">>")) return v;
+		uint64_t n = parseAdd(ev);
+		v = n >= 64 ? 0 : (int64_t)(left ? (uint64_t)v << n : (uint64_t)v >> n);
+	}
+}
+
+static int64_t parseAnd(Eval * ev) {
+	int64_t v = parseShift(ev);
+	while (accept(ev, "&")) v &= parseShift(ev);
+	return v;
+}
+
+static int64_t parseXor(Eval * ev) {
+	int64_t v = parseAnd(ev);
+	while (accept(ev, "^")) v ^= parseAnd(ev);
+	return v;
+}
+
+static int64_t parseOr(Eval * ev) {
+	int64_t v = parseXor(ev);
+	while (accept(ev, "|")) v |= parseXor(ev);
+	return v;
+}
+
+int evalExpression(const char * text, ltable * table, int64_t * value, char * missing) {
+	Eval ev = { text, table, missing, 1 };
+	int64_t v = parseOr(&ev);
+	skipSpace(&ev);
+	if (*ev.p != '\0') fail(&ev, -1);
+	if (ev.status == 1) *value = v;
+	return ev.status;
+}
+
+uint64_t evalOperand(char * text, ltable * table) {
+	text = trimWhitespace(text);
+	if (isPlainLiteral(text)) return parseLiteral(text);
+	uint64_t address;
+	if (text[0] == ':' && table && findLabel(text, table, &address)) return address;
+
+	int64_t value;
+	char missing[64];
+	int status = evalExpression(text, table, &value, missing);
+	if (status == 0) {
+		asmError("Error: Label '%s' not found!\n", missing);
+	}
+	if (status < 0) {
+		asmError("Error: Invalid literal '%s'\n", text);
+	}
+	return (uint64_t)value;
+}
+
+// Passes before the layout find label references by scanning to a space,
+// comma or ')', so ":end-:start" goes out as ":end -:start"
+static void appendSpaced(Text * out, const char * text) {
+	for (const char * p = text; *p;) {
+		if (*p != ':') {
+			append(out, p++, 1);
+			continue;
+		}
+		const char * start = p++;
+		while (isNameChar(*p)) p++;
+		append(out, start, p - start);
+		if (*p && !isspace((unsigned char)*p) && *p != ',' && *p != ')') append(out, " ", 1);
+	}
+}
+
+// Append op (len bytes, trimmed) folded. Returns 0 for an unknown label
+static int foldOperand(Text * out, const char * op, size_t len, ltable * table, int layout, char * missing) {
+	char buf[256];
+	if (len >= sizeof(buf)) {
+		append(out, op, len);
+		return 1;
+	}
+	memcpy(buf, op, len);
+	buf[len] = '\0';
+	char * text = buf;
+
+	// (rN)(offset): the offset is the expression
+	if (text[0] == '(' && text[1] == 'r') {
+		char * close = strchr(text, ')');
+		char * open = close ? strchr(close, '(') : null;
+		char * end = open ? strrchr(open, ')') : null;
+		if (!end || end[1] != '\0') {
+			append(out, text, len);
+			return 1;
+		}
+		append(out, text, open + 1 - text);
+		*end = '\0';
+		if (!foldOperand(out, open + 1, strlen(open + 1), table, layout, missing)) return 0;
+		append(out, ")", 1);
+		return 1;
+	}
+
+	uint64_t address;
+	int64_t value;
+	char number[24];
+	if (isRegisterName(text, len) || isPlainLiteral(text) || text[0] == '\0') {
+		append(out, text, len);
+	} else if (table && text[0] == ':' && findLabel(text, table, &address)) {
+		append(out, number, sprintf(number, "%" PRIu64, address));
+	} else {
+		int status = evalExpression(text, layout ? table : null, &value, missing);
+		if (status == 1) append(out, number, sprintf(number, "%" PRId64, value));
+		else if (status == 0 && layout) return 0;
+		else if (status < 0 && layout && text[0] == ':') {
+			// not an expression, so a label name that is not defined
+			if (missing) snprintf(missing, 64, "%.63s", text);
+			return 0;
+		} else if (status == 0) appendSpaced(out, text);
+		else append(out, text, len);
+	}
+	return 1;
+}
+
+// Operands split at the commas outside parentheses
+static char * foldOperands(char * str, ltable * table, int layout, char * missing) {
+	Text out = {0};
+	append(&out, "", 0);
+	const char * p = str;
+	for (;;) {
+		while (isspace((unsigned char)*p)) p++;
+		const char * start = p;
+		int depth = 0;
+		while (*p && (*p != ',' || depth > 0)) {
+			depth += (*p == '(') - (*p == ')');
+			p++;
+		}
+		const char * end = p;
+		while (end > start && isspace((unsigned char)end[-1])) end--;
+		if (!foldOperand(&out, start, end - start, table, layout, missing)) {
+			asmFree(out.data);
+			return null;
+		}
+		if (*p == '\0') break;
+		append(&out, ", ", 2);
+		p++;
+	}
+	return out.data;
+}
+
+char * substituteLabels(char * str, ltable * table, char * missing) {
+	return foldOperands(str, table, 1, missing);
+}
+
+char * substituteRelative(char * str, uint64_t address, ltable * table, char * missing) {
+	char buf[256];
+	strncpy(buf, trimWhitespace(str), sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	uint64_t target;
+	if (!findLabel(buf, table, &target)) {
+		int64_t value;
+		char first[64];
+		int status = evalExpression(buf, table, &value, first);
+		if (status != 1) {
+			// not an expression: the whole text is taken for a label name
+			if (status < 0) snprintf(first, sizeof(first), "%.63s", buf);
+			if (missing) strcpy(missing, first);
+			return null;
+		}
+		target = value;
+	}
+	char * out = asmAlloc(24);
+	sprintf(out, "%" PRId64, (int64_t)(target - address));
+	return out;
+}
+
+// One data word, reported like handleData does
+static uint64_t dataWord(char * text, ltable * table) {
+	int64_t value;
+	char missing[64];
+	int status = evalExpression(trimWhitespace(text), table, &value, missing);
+	if (status == 0) {
+		asmError("Error: Label '%s' not found!\n", missing);
+	}
+	if (status < 0) {
+		asmError("invalid data\n");
+	}
+	return (uint64_t)value;
+}
+
+void evalDataEntry(Entry * entry, ltable * table) {
+	if (entry->type == 1) {
+		entry->value = dataWord(entry->lbl, table);
+		return;
+	}
+	char * list = asmStrdup(entry->lbl);
+	char * save;
+	uint64_t * words = (uint64_t *)entry->bytes;
+	int k = 0;
+	for (char * item = strtok_r(list, ",", &save); item && k < entry->size / 8; item = strtok_r(null, ",", &save))
+		words[k++] = dataWord(item, table);
+	asmFree(list);
+
+	// the intermediate file writes the line out again, with the values
+	Text text = {0};
+	char number[24];
+	append(&text, "", 0);
+	for (int i = 0; i < k; i++) {
+		if (i) append(&text, ", ", 2);
+		append(&text, number, sprintf(number, "%" PRIu64, words[i]));
+	}
+	entry->str = text.data;
+}
+
+void resolveEquates(Script * script) {
+	Equates * equates = script->equates;
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if ((entry->type == 1 || entry->type == 5) && entry->lbl) {
+			char * text = expandEquates(entry->lbl, equates, entry->address);
+			entry->lbl = foldOperands(text, null, 0, null);
+			asmFree(text);
+			// known now, so later passes see a plain data word
+			if (!isLayoutExpression(entry->lbl)) {
+				evalDataEntry(entry, null);
+				entry->lbl = null;
+			}
+			continue;
+		}
+		if (entry->type != 0 || entry->str == null || entry->str[0] == '\0') continue;
+		char * text = expandEquates(entry->str, equates, entry->address);
+		entry->str = foldOperands(text, null, 0, null);
+		asmFree(text);
+	}
+}
+
+void resolveDataExpressions(Script * script) {
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if ((entry->type == 1 || entry->type == 5) && entry->lbl) evalDataEntry(entry, script->ltable);
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "parse.h"
+#include <stdint.h>
+
+// Assembly time constant expressions:
+//     number  :label  sizeof(.code)  sizeof(.data)  (e)
+//     - ~ +   * / %   + -   << >>   &   ^   |       (C precedence)
+// on 64 bit values that wrap, / and % signed, >> logical like shftr.
+// Symbols made with ".equ NAME, e" (once) or ".set NAME, e" (again and
+// again) may appear anywhere an expression may, before or after their
+// definition.
+
+typedef struct Equate {
+	char * name;
+	char * expr;
+	int position;       // address of the definition in the source
+	int redefinable;    // .set
+} Equate;
+
+typedef struct Equates {
+	Equate * items;
+	int count;
+	int cap;
+} Equates;
+
+// .equ / .set name, expr at position (the address the assembler is at)
+void defineEquate(Equates * equates, char * name, char * expr, int position, int redefinable);
+
+// Frees the definitions, not equates itself
+void freeEquates(Equates * equates);
+
+// Copy of text with every equate replaced by its definition (in parentheses
+// unless it is a single number or label): the last one at or before
+// position, else the first one after it. NULL equates copies text.
+char * expandEquates(const char * text, Equates * equates, int position);
+
+// Is text a single ":label" (trailing blanks aside), not an expression of one
+int isPlainLabel(const char * text);
+
+// Does text use a label or sizeof, so that its value waits for the layout
+int isLayoutExpression(const char * text);
+
+// Value of text with labels from table (NULL: labels and sizeof unknown).
+// Returns 1, or 0 with the first unknown label in missing (64 bytes, may be
+// NULL), or -1 when text is not an expression.
+int evalExpression(const char * text, ltable * table, int64_t * value, char * missing);
+
+// Value of an ld operand or a data word, reporting anything that fails.
+// Plain literals and labels give what parseLiteral / getintAddress do.
+uint64_t evalOperand(char * text, ltable * table);
+
+// Copy of an operand list with every expression operand (and memory offset)
+// replaced by its decimal value. Registers, literals and anything that is
+// not an expression are kept as written, so the encoder reports them.
+// Returns NULL with the first unknown label in missing.
+char * substituteLabels(char * str, ltable * table, char * missing);
+
+// brr :label is pc relative: the operand (a label expression) minus address
+// as text, or NULL with the first unknown label in missing
+char * substituteRelative(char * str, uint64_t address, ltable * table, char * missing);
+
+// Must run right after parseScript.
+// Expands the equates of every instruction operand and data expression and
+// folds what does not depend on the layout, so later passes only see plain
+// literals. Expressions with labels or sizeof stay for substituteLabels.
+void resolveEquates(Script * script);
+
+// The words of one type 1 / 5 entry from the expressions in its lbl
+void evalDataEntry(Entry * entry, ltable * table);
+
+// Data words written as expressions (type 1 / 5 entries with lbl set), after
+// fillLabelTable
+void resolveDataExpressions(Script * script);
@@ -0,0 +1,297 @@
+#include "machine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+// Runs many image / input pairs across all cores. Every distinct image is
+// loaded once and its pages are shared copy on write by the machines that
+// run it (machine.h), each run gets its own memory, registers and I/O.
+//
+// The manifest has one run per line, "image.tko [input]", # starts a comment.
+// The input file feeds priv input (in), missing means no input. Per run, in
+// manifest order, stdout gets
+//     index status instructions output-hash image [input]
+// with status halted, fault or limit and the FNV-1a hash of everything the
+// run wrote with priv output (out). Totals and runs/s go to stderr.
+//
+// With --snapshot (at the first priv 5) or --snapshot-at=address or :label
+// (before that instruction runs), each image is first run without input up
+// to that point and its runs start from a snapshot of the machine there.
+// The output of the warm up counts towards every run, so the records match
+// a run from the start as long as nothing before the point reads input.
+// Exit status: 0 every run halted, 1 bad arguments or files, 2 otherwise.
+
+#define FARM_MAX_THREADS 256
+
+typedef struct Image {
+	char * path;
+	unsigned char * bytes;
+	size_t size;
+	uint64_t hash;
+	MachineImage * loaded;
+	MachineImage * warm;        // snapshot runs start from, NULL for loaded
+	uint64_t warmHash;          // of the output up to the snapshot
+	char fault[96];
+} Image;
+
+typedef struct Run {
+	int image;          // index into Farm.images
+	char * imagePath;
+	char * input;       // NULL for none
+	MachineStatus status;
+	uint64_t steps;
+	uint64_t hash;
+	char fault[96];
+} Run;
+
+typedef struct Farm {
+	Run * runs;
+	int numRuns;
+	Image * images;     // a manifest line adds at most one, so as many as runs fit
+	int numImages;
+	int next;           // first run nobody took yet
+	uint64_t maxSteps;
+} Farm;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define FNV_BASIS 0xcbf29ce484222325ull
+
+static uint64_t fnv1a(uint64_t h, const unsigned char * bytes, size_t len) {
+	for (size_t i = 0; i < len; i++) h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return h;
+}
+
+static void execute(Machine * m, Run * run, Image * image, uint64_t maxSteps) {
+	if (image->loaded == NULL) {
+		run->status = MACHINE_FAULT;
+		strcpy(run->fault, image->fault);
+		return;
+	}
+	FILE * in = fopen(run->input ? run->input : "/dev/null", "r");
+	if (in == NULL) {
+		run->status = MACHINE_FAULT;
+		snprintf(run->fault, sizeof(run->fault), "could not open %s", run->input);
+		return;
+	}
+	char * output = NULL;
+	size_t outputLen = 0;
+	FILE * out = open_memstream(&output, &outputLen);
+
+	startMachine(m, image->warm ? image->warm : image->loaded);
+	m->in = in;
+	m->out = out;
+	// the limit counts from the start of the program, a warm up included
+	if (maxSteps && m->steps >= maxSteps) run->status = m->status;
+	else run->status = runMachine(m, maxSteps ? maxSteps - m->steps : 0);
+	run->steps = m->steps;
+	strcpy(run->fault, m->fault);
+
+	fclose(in);
+	fclose(out);
+	run->hash = fnv1a(image->warm ? image->warmHash : FNV_BASIS, (unsigned char *)output, outputLen);
+	free(output);
+}
+
+static void * worker(void * arg) {
+	Farm * farm = arg;
+	Machine * m = newMachine();
+	for (;;) {
+		int i = __atomic_fetch_add(&farm->next, 1, __ATOMIC_RELAXED);
+		if (i >= farm->numRuns) break;
+		Run * run = &farm->runs[i];
+		execute(m, run, &farm->images[run->image], farm->maxSteps);
+	}
+	freeMachine(m);
+	return NULL;
+}
+
+// The image already read with the same path or the same bytes, or a new one
+static int findImage(Farm * farm, const char * path) {
+	Image * images = farm->images;
+	for (int i = 0; i < farm->numImages; i++)
+		if (strcmp(images[i].path, path) == 0) return i;
+	size_t size;
+	unsigned char * bytes = readImageFile(path, &size);
+	if (bytes == NULL) return -1;
+	uint64_t hash = fnv1a(FNV_BASIS, bytes, size);
+	for (int i = 0; i < farm->numImages; i++)
+		if (images[i].hash == hash && images[i].size == size && memcmp(images[i].bytes, bytes, size) == 0) {
+			free(bytes);
+			return i;
+		}
+	images[farm->numImages] = (Image){ .path = strdup(path), .bytes = bytes, .size = size, .hash = hash };
+	return farm->numImages++;
+}
+
+static int readManifest(const char * filename, Farm * farm) {
+	FILE * file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "could not open %s\n", filename);
+		return 0;
+	}
+	int cap = 64;
+	farm->runs = malloc(cap * sizeof(Run));
+	farm->images = malloc(cap * sizeof(Image));
+	char line[4096];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), file)) {
+		lineNo++;
+		char * hash = strchr(line, '#');
+		if (hash) *hash = '\0';
+		char * image = strtok(line, " \t\r\n");
+		if (image == NULL) continue;
+		char * input = strtok(NULL, " \t\r\n");
+		if (strtok(NULL, " \t\r\n")) {
+			fprintf(stderr, "%s:%d: expected image [input]\n", filename, lineNo);
+			fclose(file);
+			return 0;
+		}
+		if (farm->numRuns == cap) {
+			cap *= 2;
+			farm->runs = realloc(farm->runs, cap * sizeof(Run));
+			farm->images = realloc(farm->images, cap * sizeof(Image));
+		}
+		int found = findImage(farm, image);
+		if (found < 0) {
+			fprintf(stderr, "%s:%d: could not open %s\n", filename, lineNo, image);
+			fclose(file);
+			return 0;
+		}
+		farm->runs[farm->numRuns++] = (Run){ .image = found, .imagePath = strdup(image), .input = input ? strdup(input) : NULL };
+	}
+	fclose(file);
+	return 1;
+}
+
+// Run image up to the first priv 5 (atPriv) or to address (at) and keep the
+// state there
+static void warmUp(Image * image, int atPriv, int at, uint64_t address, uint64_t maxSteps) {
+	char * output = NULL;
+	size_t outputLen = 0;
+	FILE * in = fopen("/dev/null", "r");
+	FILE * out = open_memstream(&output, &outputLen);
+	Machine * m = newMachine();
+	m->in = in;
+	m->out = out;
+	startMachine(m, image->loaded);
+	int reached = 0;
+	while (!reached && (!maxSteps || m->steps < maxSteps)) {
+		if (at && m->pc == address) reached = 1;
+		else if (!machineStep(m, NULL)) break;
+		else if (atPriv && m->atSnapshot) reached = 1;
+	}
+	fclose(in);
+	fclose(out);
+	if (reached) {
+		image->warm = snapshotMachine(m);
+		image->warmHash = fnv1a(FNV_BASIS, (unsigned char *)output, outputLen);
+	} else {
+		fprintf(stderr, "farm: %s never reached the snapshot point, its runs start from the beginning\n", image->path);
+	}
+	free(output);
+	freeMachine(m);
+}
+
+static int usage(const char * name) {
+	fprintf(stderr, "usage: %s [--jobs=N] [--max-steps=N] [--snapshot | --snapshot-at=address|:label] manifest\n"
+			"manifest lines: image.tko [input]\n", name);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t maxSteps = 100000000;
+	int snapshot = 0;
+	const char * snapshotAt = NULL;
+	const char * manifest = NULL;
+	for (int i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		if (strncmp(arg, "--jobs=", 7) == 0) jobs = atol(arg + 7);
+		else if (strncmp(arg, "--max-steps=", 12) == 0) maxSteps = strtoull(arg + 12, NULL, 0);
+		else if (strcmp(arg, "--snapshot") == 0) snapshot = 1;
+		else if (strncmp(arg, "--snapshot-at=", 14) == 0) snapshotAt = arg + 14;
+		else if (arg[0] == '-' && arg[1] == '-') {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return usage(argv[0]);
+		} else manifest = arg;
+	}
+	if (manifest == NULL) return usage(argv[0]);
+	if (jobs < 1) jobs = 1;
+	if (jobs > FARM_MAX_THREADS) jobs = FARM_MAX_THREADS;
+
+	Farm farm = { .maxSteps = maxSteps };
+	if (!readManifest(manifest, &farm)) return 1;
+	Image * images = farm.images;
+	int numImages = farm.numImages;
+
+	double start = now();
+	int pages = 0, warmed = 0;
+	ltable * symbols = snapshotAt && snapshotAt[0] == ':' ? malloc(sizeof(ltable)) : NULL;
+	for (int i = 0; i < numImages; i++) {
+		Image * image = &images[i];
+		if (symbols) symbols->count = 0;
+		image->loaded = newMachineImage(image->bytes, image->size, symbols, image->fault);
+		free(image->bytes);
+		if (image->loaded == NULL) continue;
+		pages += image->loaded->pageCount;
+		uint64_t address = snapshotAt && !symbols ? strtoull(snapshotAt, NULL, 0) : 0;
+		if (symbols && !findLabel((char *)snapshotAt, symbols, &address))
+			fprintf(stderr, "farm: no label %s in %s, its runs start from the beginning\n", snapshotAt, image->path);
+		else if (snapshot || snapshotAt)
+			warmUp(image, snapshot, snapshotAt != NULL, address, maxSteps);
+		warmed += image->warm != NULL;
+	}
+	free(symbols);
+	if (jobs > farm.numRuns) jobs = farm.numRuns > 0 ? farm.numRuns : 1;
+
+	pthread_t threads[FARM_MAX_THREADS];
+	int started[FARM_MAX_THREADS] = {0};
+	for (int k = 1; k < jobs; k++)
+		started[k] = pthread_create(&threads[k], NULL, worker, &farm) == 0;
+	worker(&farm);
+	for (int k = 1; k < jobs; k++)
+		if (started[k]) pthread_join(threads[k], NULL);
+	double elapsed = now() - start;
+
+	int halted = 0, faulted = 0, limited = 0;
+	uint64_t instructions = 0, skipped = 0;
+	for (int i = 0; i < farm.numRuns; i++) {
+		Run * run = &farm.runs[i];
+		MachineImage * warm = images[run->image].warm;
+		uint64_t from = warm && run->steps >= warm->steps ? warm->steps : 0;
+		const char * status = run->status == MACHINE_HALTED ? "halted" : run->status == MACHINE_FAULT ? "fault" : "limit";
+		halted += run->status == MACHINE_HALTED;
+		faulted += run->status == MACHINE_FAULT;
+		limited += run->status == MACHINE_RUNNING;
+		instructions += run->steps - from;
+		skipped += from;
+		printf("%d %s %" PRIu64 " %016" PRIx64 " %s%s%s\n", i, status, run->steps, run->hash,
+				run->imagePath, run->input ? " " : "", run->input ? run->input : "");
+		if (run->status == MACHINE_FAULT) fprintf(stderr, "run %d (%s): %s\n", i, run->imagePath, run->fault);
+		free(run->imagePath);
+		free(run->input);
+	}
+	fprintf(stderr, "farm: %d runs (%d halted, %d faulted, %d hit the step limit) of %d images (%d shared pages) on %ld threads\n",
+			farm.numRuns, halted, faulted, limited, numImages, pages, jobs);
+	if (snapshot || snapshotAt)
+		fprintf(stderr, "farm: %d of %d images snapshotted, %" PRIu64 " instructions skipped\n", warmed, numImages, skipped);
+	fprintf(stderr, "farm: %" PRIu64 " instructions in %.3f s, %.1f runs/s, %.1f million instructions/s\n",
+			instructions, elapsed, elapsed > 0 ? farm.numRuns / elapsed : 0.0, elapsed > 0 ? instructions / elapsed / 1e6 : 0.0);
+
+	for (int i = 0; i < numImages; i++) {
+		freeMachineImage(images[i].warm);
+		freeMachineImage(images[i].loaded);
+		free(images[i].path);
+	}
+	free(images);
+	free(farm.runs);
+	return halted == farm.numRuns ? 0 : 2;
+}
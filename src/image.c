@@ -0,0 +1,176 @@
+#include "image.h"
+#include "context.h"
+#include "encode.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A section plus the entries that produce its contents
+typedef struct Section {
+	SectionHeader hdr;
+	int first;      // first entry
+	int last;       // one past the last entry written to the file
+} Section;
+
+static uint64_t alignUp(uint64_t value, uint64_t align) {
+	return (value + align - 1) & ~(align - 1);
+}
+
+int entrySize(Entry * entry) {
+	switch (entry->type) {
+		case 0: return 4;
+		case 1: return 8;
+		case 5:
+		case 6:
+		case 7: return entry->size;
+		default: return 0;
+	}
+}
+
+// size bytes of the 8 byte value repeated, written a block at a time
+static void writeFill(FILE * file, unsigned long long value, long size) {
+	unsigned long long block[512];
+	for (int i = 0; i < 512; i++) block[i] = value;
+	while (size > 0) {
+		long n = size < (long)sizeof(block) ? size : (long)sizeof(block);
+		fwrite(block, 1, n, file);
+		size -= n;
+	}
+}
+
+void writeEntry(FILE * file, Entry * entry) {
+	if (entry->type == 1) { // data
+		fwrite(&entry->value, sizeof(long long), 1, file);
+	} else if (entry->type == 0) { // instruction
+		uint32_t x = getInstruction(entry);
+		fwrite(&x, sizeof(uint32_t), 1, file);
+	} else if (entry->type == 5) { // .incbin / data array, straight from the mapping
+		fwrite(entry->bytes, 1, entry->size, file);
+	} else if (entry->type == 6 || entry->type == 7) { // .fill / .space / .align padding
+		writeFill(file, entry->value, entry->size);
+	}
+}
+
+static void writeZeros(FILE * file, long n) {
+	if (n > 0) writeFill(file, 0, n);
+}
+
+static int isZeroFill(Entry * entry) {
+	return (entry->type == 6 || entry->type == 7) && entry->value == 0;
+}
+
+// Split the entries into code / data sections the same way fillLabelTable
+// aligned them, moving trailing zero fills of data sections into bss
+static int buildSections(Script * script, Section * sections) {
+	int count = 0;
+	int kind = -1;          // directive type of the current section, 3 code / 4 data
+	uint64_t address = IMAGE_ENTRY;
+	Section * cur = null;
+
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type == 3 || entry->type == 4) {
+			if (kind != -1 && entry->type != kind) {
+				address = alignUp(address, IMAGE_PAGE);
+				cur = null;
+			}
+			kind = entry->type;
+			continue;
+		}
+		int size = entrySize(entry);
+		if (size == 0) continue;
+
+		if (cur == null) {
+			cur = &sections[count++];
+			int code = kind == -1 ? entry->type == 0 : kind == 3;
+			cur->hdr = (SectionHeader){
+				.type = code ? SECTION_CODE : SECTION_DATA,
+				.flags = SECTION_READ | (code ? SECTION_EXEC : SECTION_WRITE),
+				.address = address,
+			};
+			cur->first = i;
+			cur->last = i;
+		}
+		cur->hdr.memSize += size;
+		if (!isZeroFill(entry) || cur->hdr.type == SECTION_CODE) {
+			cur->hdr.fileSize = cur->hdr.memSize;
+			cur->last = i + 1;
+		}
+		address += size;
+	}
+
+	// split off bss right behind its data section, dropping sections left empty
+	Section * split = asmAlloc((2 * count + 1) * sizeof(Section));
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		SectionHeader * hdr = &sections[i].hdr;
+		uint64_t bss = hdr->memSize - hdr->fileSize;
+		hdr->memSize = hdr->fileSize;
+		if (hdr->memSize > 0) split[n++] = sections[i];
+		if (bss == 0) continue;
+		split[n++] = (Section){ .hdr = {
+			.type = SECTION_BSS,
+			.flags = SECTION_READ | SECTION_WRITE,
+			.address = hdr->address + hdr->fileSize,
+			.memSize = bss,
+		}};
+	}
+	memcpy(sections, split, n * sizeof(Section));
+	asmFree(split);
+	return n;
+}
+
+void printToImage(Script * script, FILE * file, int withSymbols) {
+	// every entry can at most start a section and a bss section
+	Section * sections = asmAlloc((2 * script->numEntries + 1) * sizeof(Section));
+	int numSections = buildSections(script, sections);
+
+	ltable * table = script->ltable;
+	int numSymbols = withSymbols ? table->count : 0;
+	uint64_t namesSize = 0;
+	for (int i = 0; i < numSymbols; i++)
+		namesSize += strlen(table->labels[i]) - 1;
+
+	uint64_t symbolOffset = sizeof(ImageHeader) + numSections * sizeof(SectionHeader);
+	uint64_t cursor = symbolOffset + numSymbols * sizeof(SymbolEntry) + namesSize;
+	for (int i = 0; i < numSections; i++) {
+		SectionHeader * hdr = &sections[i].hdr;
+		if (hdr->type == SECTION_BSS) continue;
+		cursor = alignUp(cursor, IMAGE_PAGE);
+		hdr->offset = cursor;
+		cursor += hdr->fileSize;
+	}
+
+	ImageHeader header = {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.numSections = numSections,
+		.entry = IMAGE_ENTRY,
+		.pageSize = IMAGE_PAGE,
+		.numSymbols = numSymbols,
+		.symbolOffset = numSymbols ? symbolOffset : 0,
+	};
+	fwrite(&header, sizeof(header), 1, file);
+	for (int i = 0; i < numSections; i++)
+		fwrite(&sections[i].hdr, sizeof(SectionHeader), 1, file);
+
+	uint32_t nameOffset = 0;
+	for (int i = 0; i < numSymbols; i++) {
+		SymbolEntry sym = {table->addresses[i], nameOffset, strlen(table->labels[i]) - 1};
+		fwrite(&sym, sizeof(sym), 1, file);
+		nameOffset += sym.nameLength;
+	}
+	for (int i = 0; i < numSymbols; i++)
+		fputs(table->labels[i] + 1, file);
+
+	uint64_t pos = symbolOffset + numSymbols * sizeof(SymbolEntry) + namesSize;
+	for (int i = 0; i < numSections; i++) {
+		Section * s = &sections[i];
+		if (s->hdr.type == SECTION_BSS) continue;
+		writeZeros(file, (long)(s->hdr.offset - pos));
+		for (int j = s->first; j < s->last; j++)
+			writeEntry(file, &script->entries[j]);
+		pos = s->hdr.offset + s->hdr.fileSize;
+	}
+
+	asmFree(sections);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "parse.h"
+#include <stdint.h>
+
+// Loadable image layout (all fields little endian):
+//
+//   ImageHeader
+//   SectionHeader[numSections]
+//   SymbolEntry[numSymbols] followed by their names   (optional)
+//   section contents, each starting on a page boundary of the file
+//
+// Code and data sections start on a page boundary of guest memory as well, so a
+// loader can map [offset, offset + fileSize) of the file straight to guest
+// address `address`. A bss section has no file contents: it is the trailing
+// zero fill (.space / .fill 0) of the data section right before it.
+
+#define IMAGE_MAGIC "TKIM"
+#define IMAGE_VERSION 1
+#define IMAGE_PAGE 4096
+#define IMAGE_ENTRY 0x1000
+
+typedef enum SectionType {
+	SECTION_CODE = 1,
+	SECTION_DATA = 2,
+	SECTION_BSS = 3,
+} SectionType;
+
+#define SECTION_READ 0x1
+#define SECTION_WRITE 0x2
+#define SECTION_EXEC 0x4
+
+typedef struct ImageHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t numSections;
+	uint64_t entry;
+	uint32_t pageSize;
+	uint32_t numSymbols;
+	uint64_t symbolOffset;   // file offset of the symbol table, 0 when there is none
+} ImageHeader;
+
+typedef struct SectionHeader {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t address;        // guest address, page aligned
+	uint64_t memSize;        // bytes the section occupies in guest memory
+	uint64_t offset;         // file offset of the contents, page aligned
+	uint64_t fileSize;       // bytes stored in the file (0 for bss)
+} SectionHeader;
+
+typedef struct SymbolEntry {
+	uint64_t address;
+	uint32_t nameOffset;     // from the start of the names, which follow the last entry
+	uint32_t nameLength;     // without the leading ':'
+} SymbolEntry;
+
+// Bytes the entry takes up in the image (0 for labels and directives)
+int entrySize(Entry * entry);
+
+// Encode / copy one entry into file
+void writeEntry(FILE * file, Entry * entry);
+
+// Write the script as a loadable image. Expects fillLabelTable to have been
+// run with IMAGE_PAGE alignment so every .code / .data switch is page aligned.
+void printToImage(Script * script, FILE * file, int withSymbols);
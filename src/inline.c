@@ -0,0 +1,218 @@
+#include "inline.h"
+#include "regs.h"
+#include "cfg.h"
+#include "encode.h"
+#include "context.h"
+#include "argparse.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Leaf {
+	int label;          // first label entry of the routine
+	int first;          // body entries [first, last), the return is at last
+	int last;
+	int words;
+} Leaf;
+
+// One ":label" operand and the entry it appears in
+typedef struct LabelRef {
+	char * label;
+	int entry;
+} LabelRef;
+
+static int compareRef(const void * a, const void * b) {
+	return strcmp(((const LabelRef *)a)->label, ((const LabelRef *)b)->label);
+}
+
+static LabelRef * collectRefs(Entry * entries, int n, int * count) {
+	int cap = 64;
+	LabelRef * refs = asmAlloc(cap * sizeof(LabelRef));
+	*count = 0;
+	for (int i = 0; i < n; i++) {
+		char * text = cfgLabelText(&entries[i]);
+		if (text == null) continue;
+		for (char * p = strchr(text, ':'); p; p = strchr(p + 1, ':')) {
+			int k = labelLength(p);
+			char * name = asmAlloc(k + 1);
+			memcpy(name, p, k);
+			name[k] = '\0';
+			if (*count == cap) refs = asmRealloc(refs, (cap *= 2) * sizeof(LabelRef));
+			refs[(*count)++] = (LabelRef){ name, i };
+		}
+	}
+	qsort(refs, *count, sizeof(LabelRef), compareRef);
+	return refs;
+}
+
+// Does any entry outside [first, last] refer to label
+static int referencedOutside(LabelRef * refs, int numRefs, char * label, int first, int last) {
+	LabelRef key = { label, 0 };
+	LabelRef * ref = bsearch(&key, refs, numRefs, sizeof(LabelRef), compareRef);
+	if (ref == null) return 0;
+	while (ref > refs && strcmp(ref[-1].label, label) == 0) ref--;
+	for (; ref < refs + numRefs && strcmp(ref->label, label) == 0; ref++)
+		if (ref->entry < first || ref->entry > last) return 1;
+	return 0;
+}
+
+// Is label one of the labels in [first, last)
+static int isInternal(Entry * entries, int first, int last, const char * label, int length) {
+	for (int i = first; i < last; i++)
+		if (entries[i].type == 2 && (int)strlen(entries[i].lbl) == length && strncmp(entries[i].lbl, label, length) == 0)
+			return 1;
+	return 0;
+}
+
+// Check the routine starting at the label group at index start, fill leaf
+static int findLeaf(Entry * entries, int n, int start, LabelRef * refs, int numRefs, Leaf * leaf) {
+	int first = start;
+	while (first < n && entries[first].type == 2) first++;
+	int end = first;
+	while (end < n && entries[end].type != 3 && entries[end].type != 4 &&
+			!(entries[end].type == 0 && entries[end].cmd.type == RETURN))
+		end++;
+	if (end == n || entries[end].type != 0) return 0;
+
+	uint32_t ldInternal = 0; // registers last loaded with one of the body's labels
+	int words = 0;
+	for (int i = first; i < end; i++) {
+		Entry * entry = &entries[i];
+		if (entry->type == 2) {
+			if (referencedOutside(refs, numRefs, entry->lbl, start, end)) return 0;
+			continue;
+		}
+		if (entry->type != 0) return 0;
+
+		CommandType type = entry->cmd.type;
+		if (type == CALL || type == PRIV) return 0;
+		RegEffects fx = registerEffects(entry);
+		if ((fx.uses | fx.defs) & REG_BIT(STACK_REG)) return 0;
+
+		Operand ops[5] = {0};
+		int count = parseOperands(entry->str, ops);
+		if (type == BRR && !(count == 1 && ops[0].kind == K_LABEL &&
+				isInternal(entries, first, end, entry->str, labelLength(entry->str))))
+			return 0;
+		// branch registers have to hold one of the body's own labels
+		if ((type == BR || type == BRNZ || type == BRGT) && !(ldInternal & REG_BIT(ops[0].reg))) return 0;
+
+		ldInternal &= ~fx.defs;
+		if (type == LD && count == 2 && ops[1].kind == K_LABEL) {
+			char * label = trimWhitespace(strchr(entry->str, ',') + 1);
+			if (isInternal(entries, first, end, label, labelLength(label))) ldInternal |= REG_BIT(ops[0].reg);
+		}
+		words += cmdTable[type].cnt;
+	}
+	*leaf = (Leaf){ start, first, end, words };
+	return 1;
+}
+
+// Copy of str with the suffix added to every label of the body [first, last)
+static char * renameLabels(Entry * entries, int first, int last, const char * str, const char * suffix) {
+	size_t n = strlen(str), extra = 0;
+	for (const char * p = strchr(str, ':'); p; p = strchr(p + 1, ':')) extra += strlen(suffix);
+	char * out = asmAlloc(n + extra + 1);
+	size_t len = 0;
+	for (size_t i = 0; i < n;) {
+		if (str[i] != ':') {
+			out[len++] = str[i++];
+			continue;
+		}
+		int k = labelLength(str + i);
+		memcpy(out + len, str + i, k);
+		len += k;
+		if (isInternal(entries, first, last, str + i, k)) len += sprintf(out + len, "%s", suffix);
+		i += k;
+	}
+	out[len] = '\0';
+	return out;
+}
+
+InlineStats inlineLeaves(Script * script, int budget) {
+	InlineStats stats = {0};
+	Entry * entries = script->entries;
+	int n = script->numEntries;
+
+	int numRefs;
+	LabelRef * refs = collectRefs(entries, n, &numRefs);
+
+	// leaves by name (every label of the entry group), entry = index into leaves
+	Leaf * leaves = asmAlloc((n + 1) * sizeof(Leaf));
+	LabelRef * names = asmAlloc((n + 1) * sizeof(LabelRef));
+	int numLeaves = 0, numNames = 0;
+	int code = 0;
+	for (int i = 0; i < n; i++) {
+		if (entries[i].type == 3 || entries[i].type == 4) code = entries[i].type == 3;
+		if (!code || entries[i].type != 2 || (i > 0 && entries[i - 1].type == 2)) continue;
+		Leaf leaf;
+		if (!findLeaf(entries, n, i, refs, numRefs, &leaf) || leaf.words > budget) continue;
+		leaves[numLeaves] = leaf;
+		for (int j = i; j < leaf.first; j++)
+			names[numNames++] = (LabelRef){ entries[j].lbl, numLeaves };
+		numLeaves++;
+	}
+	stats.leaves = numLeaves;
+	qsort(names, numNames, sizeof(LabelRef), compareRef);
+
+	int cap = n + 64;
+	Entry * out = asmAlloc(cap * sizeof(Entry));
+	int written = 0;
+	char * regLabel[32] = {0};  // label each register holds from an ld in this block
+	for (int i = 0; i < n; i++) {
+		Entry * entry = &entries[i];
+		int leafIndex = -1;
+		if (entry->type == 2 || entry->type == 3 || entry->type == 4) memset(regLabel, 0, sizeof(regLabel));
+
+		if (entry->type == 0) {
+			Operand ops[5] = {0};
+			int count = parseOperands(entry->str, ops);
+			if (entry->cmd.type == CALL && count == 1 && ops[0].kind == K_REG && regLabel[ops[0].reg]) {
+				LabelRef key = { regLabel[ops[0].reg], 0 };
+				LabelRef * found = bsearch(&key, names, numNames, sizeof(LabelRef), compareRef);
+				if (found) leafIndex = found->entry;
+			}
+			RegEffects fx = registerEffects(entry);
+			for (int r = 0; r < 32; r++)
+				if (fx.defs & REG_BIT(r)) regLabel[r] = null;
+			if (entry->cmd.type == LD && count == 2 && ops[0].kind == K_REG && ops[1].kind == K_LABEL)
+				regLabel[ops[0].reg] = trimWhitespace(strchr(entry->str, ',') + 1);
+		}
+
+		Leaf * leaf = leafIndex >= 0 ? &leaves[leafIndex] : null;
+		int size = leaf ? leaf->last - leaf->first : 1;
+		if (written + size > cap) out = asmRealloc(out, (cap = 2 * cap + size) * sizeof(Entry));
+		if (leaf == null) {
+			out[written++] = *entry;
+			continue;
+		}
+
+		// the body with its labels renamed for this site
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "__inl%d", stats.sites);
+		for (int j = leaf->first; j < leaf->last; j++) {
+			Entry copy = entries[j];
+			if (copy.type == 2) {
+				copy.lbl = renameLabels(entries, leaf->first, leaf->last, copy.lbl, suffix);
+			} else if (copy.str && strchr(copy.str, ':')) {
+				copy.str = renameLabels(entries, leaf->first, leaf->last, copy.str, suffix);
+			}
+			out[written++] = copy;
+		}
+		stats.sites++;
+		stats.wordsAdded += leaf->words - 1;
+	}
+
+	for (int i = 0; i < numRefs; i++) asmFree(refs[i].label);
+	asmFree(refs);
+	asmFree(names);
+	asmFree(leaves);
+	asmFree(script->entries);
+	script->entries = out;
+	script->numEntries = written;
+	return stats;
+}
+
+void reportInline(InlineStats * stats, FILE * out) {
+	fprintf(out, "inline: %d leaf routines, %d call sites inlined, %+ld instruction words\n",
+			stats->leaves, stats->sites, stats->wordsAdded);
+}
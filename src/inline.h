@@ -0,0 +1,23 @@
+#pragma once
+#include "parse.h"
+
+// Largest routine, in expanded instruction words, inlined by --inline alone
+#define INLINE_DEFAULT_BUDGET 16
+
+typedef struct InlineStats {
+	int leaves;         // routines that qualify as leaves under the budget
+	int sites;          // call sites replaced by a copy of the body
+	long wordsAdded;    // instruction words added (body minus the call)
+} InlineStats;
+
+// Must run before fillLabelTable.
+// A leaf routine is a label followed by straight code up to its first return:
+// no call, nothing that reads or writes r31 (push / pop included), no data,
+// and branches only to its own labels, which nothing outside refers to.
+// Every "call rX" where rX was loaded with "ld rX, :leaf" earlier in the same
+// block, and the leaf is at most budget words, becomes a copy of the body
+// with its labels renamed. The call no longer writes the return address
+// below r31; the routine itself stays for other uses.
+InlineStats inlineLeaves(Script * script, int budget);
+
+void reportInline(InlineStats * stats, FILE * out);
@@ -0,0 +1,119 @@
+#include "instrument.h"
+#include "cfg.h"
+#include "regs.h"
+#include "encode.h"
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+
+static Entry makeEntry(const char * fmt, int a, int b, int c, int line) {
+	char text[64];
+	snprintf(text, sizeof(text), fmt, a, b, c);
+	Entry * made = handleCmd(text, 0);
+	Entry entry = *made;
+	asmFree(made);
+	entry.line = line;
+	return entry;
+}
+
+Counters * instrumentBlocks(Script * script, int baseReg, uint32_t avoid) {
+	Counters * counters = asmCalloc(1, sizeof(Counters));
+	counters->baseReg = baseReg;
+
+	uint32_t used = usedRegisters(script);
+	if (used & REG_BIT(baseReg)) {
+		asmError("Error: --instrument base register r%d is used by the program\n", baseReg);
+	}
+	// a register nobody uses needs no saving, else any one but the base and stack
+	uint32_t taken = used | avoid | REG_BIT(baseReg) | REG_BIT(STACK_REG);
+	counters->scratchReg = -1;
+	for (int r = 0; r < 32 && counters->scratchReg < 0; r++)
+		if (!(taken & REG_BIT(r))) counters->scratchReg = r;
+	if (counters->scratchReg < 0) {
+		counters->saved = 1;
+		counters->scratchReg = baseReg == 0 ? 1 : 0;
+	}
+
+	Cfg * cfg = buildCfg(script);
+	if (cfg->pcRelative) {
+		asmError("Error: --instrument moves code, which brr by a number, a register or a label expression cannot follow\n");
+	}
+
+	// where each counted block gets its increment: its first instruction
+	Entry * entries = script->entries;
+	int n = script->numEntries;
+	int * slotAt = asmAlloc((n + 1) * sizeof(int));
+	for (int i = 0; i < n; i++) slotAt[i] = 0;
+	counters->slots = asmAlloc(INSTRUMENT_MAX_SLOTS * sizeof(CounterSlot));
+	counters->slots[0] = (CounterSlot){ null, 0 };
+	counters->numSlots = 1;
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		BasicBlock * block = &cfg->blocks[b];
+		if (block->data) continue;
+		char * label = null;
+		int i = block->first;
+		for (; i < block->last && entries[i].type != 0; i++)
+			if (entries[i].type == 2 && label == null) label = entries[i].lbl;
+		if (i == block->last) continue;
+		counters->blocks++;
+		if (counters->numSlots == INSTRUMENT_MAX_SLOTS) continue;
+		counters->slots[counters->numSlots] = (CounterSlot){ label, entries[i].line };
+		slotAt[i] = counters->numSlots++;
+	}
+	freeCfg(cfg);
+
+	int perCount = counters->saved ? 5 : 3;
+	int numCounted = counters->numSlots - 1;
+	Entry * out = asmAlloc((n + 2 + numCounted * perCount + 4) * sizeof(Entry));
+	int k = 0;
+
+	// .code / ld rB, :__counters + bias / <program> / .data / .align 8 / :__counters / .space
+	char text[64];
+	out[k++] = (Entry){ .type = 3 };
+	out[k++] = makeEntry("ld r%d, " INSTRUMENT_LABEL " + %d", baseReg, INSTRUMENT_BIAS, 0, 0);
+	counters->wordsAdded += cmdTable[LD].cnt;
+
+	int rB = baseReg, rS = counters->scratchReg;
+	for (int i = 0; i < n; i++) {
+		if (slotAt[i]) {
+			int off = slotAt[i] * 8 - INSTRUMENT_BIAS;
+			int line = entries[i].line;
+			if (counters->saved) out[k++] = makeEntry("mov (r%d)(%d), r%d", rB, -INSTRUMENT_BIAS, rS, line);
+			out[k++] = makeEntry("mov r%d, (r%d)(%d)", rS, rB, off, line);
+			out[k++] = makeEntry("addi r%d, 1", rS, 0, 0, line);
+			out[k++] = makeEntry("mov (r%d)(%d), r%d", rB, off, rS, line);
+			if (counters->saved) out[k++] = makeEntry("mov r%d, (r%d)(%d)", rS, rB, -INSTRUMENT_BIAS, line);
+			counters->wordsAdded += perCount;
+		}
+		out[k++] = entries[i];
+	}
+
+	out[k++] = (Entry){ .type = 4 };
+	out[k++] = (Entry){ .type = 7, .align = 8, .str = asmStrdup(".align 8") };
+	out[k++] = (Entry){ .type = 2, .lbl = asmStrdup(INSTRUMENT_LABEL) };
+	snprintf(text, sizeof(text), ".space %d", counters->numSlots * 8);
+	out[k++] = (Entry){ .type = 6, .size = counters->numSlots * 8, .str = asmStrdup(text) };
+
+	asmFree(slotAt);
+	asmFree(script->entries);
+	script->entries = out;
+	script->numEntries = k;
+	return counters;
+}
+
+void writeCounterMap(Counters * counters, Script * script, FILE * out) {
+	fprintf(out, "counters 0x%llx %d\n",
+			(unsigned long long)getintAddress(INSTRUMENT_LABEL, script->ltable), counters->numSlots - 1);
+	for (int i = 1; i < counters->numSlots; i++)
+		fprintf(out, "%d %d %s\n", i, counters->slots[i].line, counters->slots[i].label ? counters->slots[i].label : "-");
+}
+
+void reportInstrument(Counters * counters, FILE * out) {
+	fprintf(out, "instrument: %d counters, base r%d, scratch r%d%s, +%d words",
+			counters->numSlots - 1, counters->baseReg, counters->scratchReg,
+			counters->saved ? " (saved around each count)" : "", counters->wordsAdded);
+	if (counters->blocks > counters->numSlots - 1)
+		fprintf(out, ", %d blocks not counted (at most %d counters)",
+				counters->blocks - (counters->numSlots - 1), INSTRUMENT_MAX_SLOTS - 1);
+	fputc('\n', out);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "parse.h"
+
+// Register that holds the counter region address when --instrument is given without one
+#define INSTRUMENT_DEFAULT_REG 29
+#define INSTRUMENT_LABEL ":__counters"
+// The base register points 2048 bytes into the region so the signed 12 bit
+// mov offsets reach all of it: slot 0 saves the scratch register, the rest count
+#define INSTRUMENT_BIAS 2048
+#define INSTRUMENT_MAX_SLOTS 512
+
+// Counter map, the sidecar text file written next to an instrumented image:
+//
+//   counters <region address> <number of counters>
+//   <slot> <source line> <label or ->     one per counter, slot 1 up
+//
+// Counter n is the 8 byte little endian word at region + 8 * n: the number
+// of times the block starting at that source line was entered.
+
+typedef struct CounterSlot {
+	char * label;       // first label of the block, NULL when it has none
+	int line;
+} CounterSlot;
+
+typedef struct Counters {
+	CounterSlot * slots;    // slots[0] is the scratch save slot
+	int numSlots;
+	int baseReg;
+	int scratchReg;
+	int saved;              // the program uses every register, scratch is saved around each count
+	int blocks;             // code blocks with an instruction
+	int wordsAdded;
+} Counters;
+
+// Must run before buildConstantPool and fillLabelTable.
+// Puts "ld rB, :__counters + 2048" at the entry point and a counter increment
+// in front of the first instruction of every code block:
+//     mov rS, (rB)(off) / addi rS, 1 / mov (rB)(off), rS
+// rS is a register the program never touches, else one that is kept in
+// slot 0 across the increment. The zeroed region is appended as a last .data
+// section. Blocks past INSTRUMENT_MAX_SLOTS are left uncounted. The program
+// must not use baseReg, nor may avoid (a bit mask) be picked for rS.
+Counters * instrumentBlocks(Script * script, int baseReg, uint32_t avoid);
+
+// Must run after fillLabelTable: the counter map for the final layout
+void writeCounterMap(Counters * counters, Script * script, FILE * out);
+
+// Counters, registers and the words added
+void reportInstrument(Counters * counters, FILE * out);
@@ -0,0 +1,155 @@
+#include "intermediate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Growable output buffer. Chunks are formatted on worker threads, which have
+// no assembly context, so this uses plain malloc and never fails the assembly.
+typedef struct TextBuf {
+	char * data;
+	size_t len;
+	size_t cap;
+} TextBuf;
+
+typedef struct Chunk {
+	Script * script;
+	int first;
+	int last;
+	int mode;       // directive type in effect when the chunk starts
+	TextBuf out;
+} Chunk;
+
+static const char digitPairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static void reserve(TextBuf * b, size_t n) {
+	if (b->len + n <= b->cap) return;
+	size_t cap = b->cap ? b->cap * 2 : 1 << 16;
+	while (cap < b->len + n) cap *= 2;
+	b->data = realloc(b->data, cap);
+	b->cap = cap;
+}
+
+static inline void putBytes(TextBuf * b, const char * s, size_t n) {
+	reserve(b, n);
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+}
+
+static inline void putChar(TextBuf * b, char c) {
+	reserve(b, 1);
+	b->data[b->len++] = c;
+}
+
+// Decimal, two digits per step from the back
+static inline void putU64(TextBuf * b, uint64_t v) {
+	char tmp[20];
+	int i = 20;
+	while (v >= 100) {
+		int pair = (v % 100) * 2;
+		v /= 100;
+		tmp[--i] = digitPairs[pair + 1];
+		tmp[--i] = digitPairs[pair];
+	}
+	if (v >= 10) {
+		tmp[--i] = digitPairs[v * 2 + 1];
+		tmp[--i] = digitPairs[v * 2];
+	} else {
+		tmp[--i] = '0' + v;
+	}
+	putBytes(b, tmp + i, 20 - i);
+}
+
+static void formatChunk(Chunk * c) {
+	Entry * entries = c->script->entries;
+	TextBuf * b = &c->out;
+	int mode = c->mode;
+
+	size_t nameLen[DATA + 1];
+	for (int i = 0; i <= DATA; i++) nameLen[i] = strlen(cmdTable[i].name);
+
+	for (int i = c->first; i < c->last; i++) {
+		Entry * entry = &entries[i];
+
+		if (entry->type == 2) continue;
+
+		if (entry->type == 1) { // data
+			putChar(b, '\t');
+			putU64(b, entry->value);
+			putChar(b, '\n');
+		} else if (entry->type == 5 && entry->str[0] != '.') { // data array
+			putChar(b, '\t');
+			putBytes(b, entry->str, strlen(entry->str));
+			putChar(b, '\n');
+		} else if (entry->type == 5 || entry->type == 6 || entry->type == 7) { // .incbin / .fill / .space / .align
+			putBytes(b, entry->str, strlen(entry->str));
+			putChar(b, '\n');
+		} else if (entry->type == 0) { // code
+			size_t argsLen = strlen(entry->str);
+			reserve(b, nameLen[entry->cmd.type] + argsLen + 3);
+			putChar(b, '\t');
+			putBytes(b, cmdTable[entry->cmd.type].name, nameLen[entry->cmd.type]);
+			putChar(b, ' ');
+			putBytes(b, entry->str, argsLen);
+			putChar(b, '\n');
+		} else if (entry->type == 3 && mode != 3) {
+			putBytes(b, ".code\n", 6);
+			mode = entry->type;
+		} else if (entry->type == 4 && mode != 4) {
+			putBytes(b, ".data\n", 6);
+			mode = entry->type;
+		}
+	}
+}
+
+static void * formatThread(void * arg) {
+	formatChunk(arg);
+	return NULL;
+}
+
+void printToIntermediate(Script * script, FILE * file) {
+	int mode = -1;
+	if (!script->hasCode) fputs(".code\n", file), mode = 3;
+
+	int n = script->numEntries;
+	int numChunks = 1;
+	if (n >= INTERMEDIATE_PARALLEL_MIN) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		numChunks = cpus < 1 ? 1 : cpus > INTERMEDIATE_MAX_CHUNKS ? INTERMEDIATE_MAX_CHUNKS : cpus;
+	}
+
+	Chunk chunks[INTERMEDIATE_MAX_CHUNKS];
+	for (int k = 0; k < numChunks; k++) {
+		Chunk * c = &chunks[k];
+		c->script = script;
+		c->first = (long)n * k / numChunks;
+		c->last = (long)n * (k + 1) / numChunks;
+		c->out = (TextBuf){0};
+		// a chunk starts in the mode set by the last directive before it
+		c->mode = mode;
+		for (int i = c->first - 1; i >= 0; i--)
+			if (script->entries[i].type == 3 || script->entries[i].type == 4) {
+				c->mode = script->entries[i].type;
+				break;
+			}
+	}
+
+	pthread_t threads[INTERMEDIATE_MAX_CHUNKS];
+	int started[INTERMEDIATE_MAX_CHUNKS] = {0};
+	for (int k = 1; k < numChunks; k++)
+		started[k] = pthread_create(&threads[k], NULL, formatThread, &chunks[k]) == 0;
+	formatChunk(&chunks[0]);
+
+	for (int k = 0; k < numChunks; k++) {
+		if (k > 0) {
+			if (started[k]) pthread_join(threads[k], NULL);
+			else formatChunk(&chunks[k]);
+		}
+		fwrite(chunks[k].out.data, 1, chunks[k].out.len, file);
+		free(chunks[k].out.data);
+	}
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "parse.h"
+
+// Programs with fewer entries than this are formatted on the calling thread
+#define INTERMEDIATE_PARALLEL_MIN 65536
+#define INTERMEDIATE_MAX_CHUNKS 8
+
+// Write the macro expanded, label resolved source. Large scripts are split
+// into chunks formatted on separate threads and then written in order.
+void printToIntermediate(Script * script, FILE * file);
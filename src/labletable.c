@@ -1,12 +1,12 @@
 // TODO: IMPLEMENT
 #include "labletable.h"
+#include "context.h"
 #include <string.h>
 #include <stdlib.h>
 
 void insertLabel(char * label, uint64_t address, ltable *table) {
     if (table->count >= MAX_LABELS) {
-        fprintf(stderr, "Error: Too many labels!\n");
-        exit(1);
+        asmError("Error: Too many labels!\n");
     }
     
     strncpy(table->labels[table->count], label, 63);
@@ -15,11 +15,20 @@ void insertLabel(char * label, uint64_t address, ltable *table) {
     table->count++;
 }
 
-uint64_t getintAddress(char *label, ltable *table) {
+int findLabel(char *label, ltable *table, uint64_t *address) {
     for (int i = 0; i < table->count; i++)
-        if (strcmp(table->labels[i], label) == 0)
-			return table->addresses[i];
-    
-    fprintf(stderr, "Error: Label '%s' not found!\n", label);
-    exit(1);
+        if (strcmp(table->labels[i], label) == 0) {
+            *address = table->addresses[i];
+            return 1;
+        }
+    return 0;
 }
+
+uint64_t getintAddress(char *label, ltable *table) {
+    uint64_t address;
+    if (findLabel(label, table, &address))
+        return address;
+
+    asmError("Error: Label '%s' not found!\n", label);
+}
+
@@ -8,9 +8,16 @@ typedef struct ltable {
     char labels[MAX_LABELS][64];  // Array of label strings
     uint64_t addresses[MAX_LABELS];     // Array of addresses
     int count;                     // Number of labels
+    int sized;                     // codeSize / dataSize are set (fillLabelTable)
+    uint64_t codeSize;             // bytes of .code, for sizeof(.code)
+    uint64_t dataSize;             // bytes of .data, for sizeof(.data)
 } ltable;
 
 uint64_t getintAddress(char * label, ltable *table);
+// Same lookup as getintAddress, but returns 0 instead of exiting when the label is missing
+int findLabel(char * label, ltable *table, uint64_t * address);
+
+// substituteLabels / substituteRelative, which evaluate whole expressions, are in expr.h
 void insertLabel(char * label, uint64_t address, ltable *table);
 
 
@@ -0,0 +1,322 @@
+#include "legalize.h"
+#include "encode.h"
+#include "context.h"
+#include "expr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define MAX_SEQUENCE 32
+// Most addi / subi (or base moves) tried before building the constant instead
+#define MAX_CHUNKS 8
+
+typedef enum SeqKind { SEQ_NONE, SEQ_SPLIT, SEQ_SCRATCH, SEQ_MATERIALIZE, SEQ_REBASE, SEQ_CLEAR } SeqKind;
+
+typedef struct Sequence {
+	int count;
+	SeqKind kind;
+	char lines[MAX_SEQUENCE][48];
+} Sequence;
+
+static void emit(Sequence * seq, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+static void emit(Sequence * seq, const char * fmt, ...) {
+	if (seq->count < MAX_SEQUENCE) {
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(seq->lines[seq->count], sizeof(seq->lines[0]), fmt, args);
+		va_end(args);
+	}
+	seq->count++;
+}
+
+static void append(Sequence * seq, Sequence * part) {
+	for (int i = 0; i < part->count && seq->count < MAX_SEQUENCE; i++)
+		strcpy(seq->lines[seq->count++], part->lines[i]);
+}
+
+// r = value in 12 bit pieces from the top
+static void buildDirect(Sequence * seq, int r, uint64_t value) {
+	emit(seq, "xor r%d, r%d, r%d", r, r, r);
+	if (value == 0) return;
+	int top = 5;
+	while (((value >> (12 * top)) & 0xfff) == 0) top--;
+	emit(seq, "addi r%d, %llu", r, (unsigned long long)((value >> (12 * top)) & 0xfff));
+	int shift = 0;
+	for (int j = top - 1; j >= 0; j--) {
+		shift += 12;
+		uint64_t chunk = (value >> (12 * j)) & 0xfff;
+		if (chunk == 0) continue;
+		emit(seq, "shftli r%d, %d", r, shift);
+		emit(seq, "addi r%d, %llu", r, (unsigned long long)chunk);
+		shift = 0;
+	}
+	if (shift) emit(seq, "shftli r%d, %d", r, shift);
+}
+
+// r = value, the shortest of building it, its negation or its complement
+static void materialize(Sequence * seq, int r, uint64_t value) {
+	Sequence best = {0}, other = {0};
+	buildDirect(&best, r, value);
+	if (-value <= 4095) {
+		emit(&other, "xor r%d, r%d, r%d", r, r, r);
+		emit(&other, "subi r%d, %llu", r, (unsigned long long)-value);
+		if (other.count < best.count) best = other;
+	}
+	other = (Sequence){0};
+	buildDirect(&other, r, ~value);
+	emit(&other, "not r%d, r%d", r, r);
+	if (other.count < best.count) best = other;
+	append(seq, &best);
+}
+
+// r += delta in addi / subi steps, 0 if that takes too many
+static int addChunks(Sequence * seq, int r, long long delta) {
+	unsigned long long left = delta < 0 ? -(unsigned long long)delta : (unsigned long long)delta;
+	if (left > (unsigned long long)MAX_CHUNKS * 4095) return 0;
+	while (left > 0) {
+		unsigned long long step = left > 4095 ? 4095 : left;
+		emit(seq, "%s r%d, %llu", delta < 0 ? "subi" : "addi", r, step);
+		left -= step;
+	}
+	return 1;
+}
+
+static int fitsS12(long long v) {
+	return v >= -2048 && v <= 2047;
+}
+
+// Memory offset moved into range: the part the base register has to move by
+static long long rebaseDelta(long long offset) {
+	return offset > 0 ? offset - 2047 : offset + 2048;
+}
+
+static void pick(Sequence * seq, Sequence * candidate) {
+	if (candidate->count > 0 && (seq->count == 0 || candidate->count < seq->count)) *seq = *candidate;
+}
+
+// Instruction text with its operands resolved for the layout: entry at address
+static char * resolvedText(Entry * entry, ltable * table, uint64_t address) {
+	char missing[64];
+	if (entry->cmd.type == BRR && entry->str[0] == ':')
+		return substituteRelative(entry->str, address, table, missing);
+	return substituteLabels(entry->str, table, missing);
+}
+
+// Legal sequence for the entry at address. Returns its length, or 0 when the
+// entry fits as written and has no slot reserved, -1 if there is no sequence.
+static int plan(Entry * entry, ltable * table, uint64_t address, int scratch, int reserved, Sequence * seq) {
+	CommandType type = entry->cmd.type;
+	*seq = (Sequence){0};
+	if (entry->type != 0 || entry->str == null) return 0;
+	if (type != ADDI && type != SUBI && type != SHFTLI && type != SHFTRI && type != MOV && type != BRR) return 0;
+
+	char * text = resolvedText(entry, table, address);
+	if (text == null) return 0; // a missing label is reported later
+	Operand ops[5] = {0};
+	int count = parseOperands(text, ops);
+	asmFree(text);
+
+	Sequence cand;
+	if ((type == ADDI || type == SUBI || type == SHFTLI || type == SHFTRI) && count == 2 &&
+			ops[0].kind == K_REG && ops[1].kind == K_IMM) {
+		int rd = ops[0].reg;
+		long long v = ops[1].imm;
+		const char * name = cmdTable[type].name;
+		if (v >= 0 && v <= 4095) {
+			if (reserved == 0) return 0;
+			emit(seq, "%s r%d, %lld", name, rd, v);
+		} else if (type == SHFTLI || type == SHFTRI) {
+			if (v < 0) return -1;
+			emit(seq, "xor r%d, r%d, r%d", rd, rd, rd);
+			seq->kind = SEQ_CLEAR;
+		} else {
+			long long delta = type == ADDI ? v : -(unsigned long long)v;
+			cand = (Sequence){ .kind = SEQ_SPLIT };
+			if (addChunks(&cand, rd, delta)) pick(seq, &cand);
+			if (scratch >= 0 && scratch != rd) {
+				cand = (Sequence){ .kind = SEQ_SCRATCH };
+				materialize(&cand, scratch, delta);
+				emit(&cand, "add r%d, r%d, r%d", rd, rd, scratch);
+				pick(seq, &cand);
+			}
+		}
+	} else if (type == MOV && count == 2 && ops[0].kind == K_REG && ops[1].kind == K_IMM) {
+		int rd = ops[0].reg;
+		long long v = ops[1].imm;
+		if (v >= 0 && v <= 4095) {
+			if (reserved == 0) return 0;
+			emit(seq, "mov r%d, %lld", rd, v);
+		} else {
+			materialize(seq, rd, v);
+			seq->kind = SEQ_MATERIALIZE;
+		}
+	} else if (type == MOV && count == 2 && ops[0].kind == K_REG && ops[1].kind == K_MEM) {
+		int rd = ops[0].reg, rs = ops[1].reg;
+		long long off = ops[1].imm;
+		if (fitsS12(off)) {
+			if (reserved == 0) return 0;
+			emit(seq, "mov r%d, (r%d)(%lld)", rd, rs, off);
+		} else {
+			long long delta = rebaseDelta(off);
+			cand = (Sequence){ .kind = SEQ_REBASE };
+			if (addChunks(&cand, rs, delta)) {
+				emit(&cand, "mov r%d, (r%d)(%lld)", rd, rs, off - delta);
+				// rd == rs was overwritten by the load anyway
+				if (rd == rs || addChunks(&cand, rs, -delta)) pick(seq, &cand);
+			}
+			if (rd != rs) {
+				cand = (Sequence){ .kind = SEQ_MATERIALIZE };
+				materialize(&cand, rd, off);
+				emit(&cand, "add r%d, r%d, r%d", rd, rd, rs);
+				emit(&cand, "mov r%d, (r%d)(0)", rd, rd);
+				pick(seq, &cand);
+			}
+			if (scratch >= 0 && scratch != rs) {
+				cand = (Sequence){ .kind = SEQ_SCRATCH };
+				materialize(&cand, scratch, off);
+				emit(&cand, "add r%d, r%d, r%d", scratch, scratch, rs);
+				emit(&cand, "mov r%d, (r%d)(0)", rd, scratch);
+				pick(seq, &cand);
+			}
+		}
+	} else if (type == MOV && count == 2 && ops[0].kind == K_MEM && ops[1].kind == K_REG) {
+		int rd = ops[0].reg, rs = ops[1].reg;
+		long long off = ops[0].imm;
+		if (fitsS12(off)) {
+			if (reserved == 0) return 0;
+			emit(seq, "mov (r%d)(%lld), r%d", rd, off, rs);
+		} else {
+			long long delta = rebaseDelta(off);
+			cand = (Sequence){ .kind = SEQ_REBASE };
+			if (rd != rs && addChunks(&cand, rd, delta)) {
+				emit(&cand, "mov (r%d)(%lld), r%d", rd, off - delta, rs);
+				if (addChunks(&cand, rd, -delta)) pick(seq, &cand);
+			}
+			if (scratch >= 0 && scratch != rd && scratch != rs) {
+				cand = (Sequence){ .kind = SEQ_SCRATCH };
+				materialize(&cand, scratch, off);
+				emit(&cand, "add r%d, r%d, r%d", scratch, scratch, rd);
+				emit(&cand, "mov (r%d)(0), r%d", scratch, rs);
+				pick(seq, &cand);
+			}
+		}
+	} else if (type == BRR && count == 1 && ops[0].kind == K_IMM) {
+		long long v = ops[0].imm;
+		if (fitsS12(v)) {
+			if (reserved == 0) return 0;
+			emit(seq, "brr %lld", v);
+		} else if (scratch >= 0) {
+			// the offset is from the brr, after the n words that build it
+			for (int n = 1; n < MAX_SEQUENCE; n++) {
+				cand = (Sequence){ .kind = SEQ_SCRATCH };
+				materialize(&cand, scratch, v - 4 * n);
+				if (cand.count > n) continue;
+				while (cand.count < n) emit(&cand, "and r0, r0, r0");
+				emit(&cand, "brr r%d", scratch);
+				*seq = cand;
+				break;
+			}
+		}
+	} else {
+		return 0;
+	}
+
+	if (seq->count == 0 || seq->count > MAX_SEQUENCE) return -1;
+	return seq->count;
+}
+
+static Entry nopEntry(void) {
+	Entry * entry = handleCmd("and r0, r0, r0", 0);
+	Entry nop = *entry;
+	asmFree(entry);
+	return nop;
+}
+
+// Entries with every reserved slot stood in for by that many no-ops, first[i]
+// is where entry i starts
+static int layout(Script * script, int * slots, Entry nop, Entry * out, int * first) {
+	int written = 0;
+	for (int i = 0; i < script->numEntries; i++) {
+		first[i] = written;
+		if (slots[i] == 0) out[written++] = script->entries[i];
+		else for (int k = 0; k < slots[i]; k++) out[written++] = nop;
+	}
+	return written;
+}
+
+LegalizeStats legalizeImmediates(Script * script, int scratchReg, int sectionAlign) {
+	LegalizeStats stats = {0};
+	int n = script->numEntries;
+	int * slots = asmCalloc(n + 1, sizeof(int));
+	int * first = asmAlloc((n + 1) * sizeof(int));
+	Entry nop = nopEntry();
+	Sequence seq;
+
+	// Find the slot sizes: they only grow, so this settles
+	Script trial = *script;
+	trial.entries = null;
+	int cap = 0;
+	for (;;) {
+		stats.passes++;
+		int size = n;
+		for (int i = 0; i < n; i++) if (slots[i]) size += slots[i] - 1;
+		if (size > cap) trial.entries = asmRealloc(trial.entries, (cap = size) * sizeof(Entry));
+		trial.numEntries = layout(script, slots, nop, trial.entries, first);
+		trial.ltable->count = 0;
+		fillLabelTable(&trial, sectionAlign);
+
+		int grown = 0;
+		stats.failed = 0;
+		for (int i = 0; i < n; i++) {
+			int len = plan(&script->entries[i], trial.ltable, trial.entries[first[i]].address, scratchReg, slots[i], &seq);
+			stats.failed += len < 0;
+			if (len > slots[i]) {
+				slots[i] = len;
+				grown = 1;
+			}
+		}
+		if (!grown) break;
+	}
+
+	if (stats.passes == 1) {
+		// nothing out of range, the caller's layout stands
+		asmFree(trial.entries);
+		return stats;
+	}
+
+	// The last layout is final, write the sequences into it
+	for (int i = 0; i < n; i++) {
+		if (slots[i] == 0) continue;
+		Entry * entry = &script->entries[i];
+		int len = plan(entry, trial.ltable, trial.entries[first[i]].address, scratchReg, slots[i], &seq);
+		if (len < 0) {
+			trial.entries[first[i]] = *entry;
+		} else {
+			for (int k = 0; k < seq.count; k++) {
+				Entry * made = handleCmd(seq.lines[k], 0);
+				trial.entries[first[i] + k] = *made;
+				asmFree(made);
+			}
+			stats.split += seq.kind == SEQ_SPLIT;
+			stats.scratch += seq.kind == SEQ_SCRATCH;
+			stats.materialized += seq.kind == SEQ_MATERIALIZE;
+			stats.rebased += seq.kind == SEQ_REBASE;
+			stats.cleared += seq.kind == SEQ_CLEAR;
+		}
+		stats.wordsAdded += slots[i] - 1;
+	}
+
+	asmFree(script->entries);
+	script->entries = trial.entries;
+	script->numEntries = trial.numEntries;
+	script->ltable->count = 0;
+	fillLabelTable(script, sectionAlign);
+	return stats;
+}
+
+void reportLegalize(LegalizeStats * stats, FILE * out) {
+	fprintf(out, "legalize: %d split, %d via scratch, %d materialized, %d rebased, %d cleared, +%d words in %d passes\n",
+		stats->split, stats->scratch, stats->materialized, stats->rebased, stats->cleared, stats->wordsAdded, stats->passes);
+	if (stats->failed)
+		fprintf(out, "legalize: %d out of range with no sequence (give a scratch register with --legalize=rN)\n", stats->failed);
+}
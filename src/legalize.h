@@ -0,0 +1,31 @@
+#pragma once
+#include "parse.h"
+
+typedef struct LegalizeStats {
+	int split;          // addi / subi done as several immediate ops
+	int scratch;        // sequences through the scratch register
+	int materialized;   // mov rd, L with L past 12 bits built up in rd
+	int rebased;        // memory offsets reached by moving the base register
+	int cleared;        // shifts by 64 or more, which leave zero
+	int failed;         // out of range with no sequence (brr / stores need a scratch)
+	int wordsAdded;
+	int passes;         // layout iterations until the sizes settled
+} LegalizeStats;
+
+// Must run after fillLabelTable, leaves the label table filled in again.
+// Rewrites addi / subi / shftli / shftri / mov immediates and mov memory
+// offsets that do not fit their 12 bit field, and brr offsets (brr :label
+// included) past +-2047, into the shortest sequence that does the same:
+//  - addi / subi by several immediate ops, or the constant in the scratch
+//    register and an add
+//  - mov rd, L by building all of L in rd (a larger L means the whole value)
+//  - mov with a large offset by moving the base register and back, or
+//    through rd / the scratch register
+//  - brr by the offset in the scratch register and brr rS
+// scratchReg is the register free for this (-1 for none). Label operands
+// depend on the layout, so sizes are settled by iterating; a sequence that
+// ends up shorter than its slot is padded with no-ops.
+// Anything left out of range is reported by the encoder as before.
+LegalizeStats legalizeImmediates(Script * script, int scratchReg, int sectionAlign);
+
+void reportLegalize(LegalizeStats * stats, FILE * out);
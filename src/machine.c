@@ -0,0 +1,350 @@
+#include "machine.h"
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+static void fault(Machine * m, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+static void fault(Machine * m, const char * fmt, ...) {
+	if (m->status == MACHINE_FAULT) return;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(m->fault, sizeof(m->fault), fmt, args);
+	va_end(args);
+	m->status = MACHINE_FAULT;
+}
+
+Machine * newMachine(void) {
+	Machine * m = calloc(1, sizeof(Machine));
+	m->in = stdin;
+	m->out = stdout;
+	return m;
+}
+
+static void releasePages(Machine * m) {
+	for (int i = 0; i < MACHINE_PAGES; i++) {
+		if (!m->shared[i]) free(m->pages[i]);
+		m->pages[i] = NULL;
+		m->shared[i] = 0;
+	}
+}
+
+void freeMachine(Machine * m) {
+	if (m == NULL) return;
+	releasePages(m);
+	free(m);
+}
+
+static int inMemory(Machine * m, uint64_t address, int bytes) {
+	if (address <= MACHINE_MEMORY - bytes) return 1;
+	fault(m, "memory access at 0x%" PRIx64 " outside memory", address);
+	return 0;
+}
+
+uint64_t readMemory(Machine * m, uint64_t address, int bytes) {
+	if (!inMemory(m, address, bytes)) return 0;
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		unsigned char * page = m->pages[(address + i) / MACHINE_PAGE];
+		value = value << 8 | (page ? page[(address + i) % MACHINE_PAGE] : 0);
+	}
+	return value;
+}
+
+int dumpMemory(Machine * m, FILE * out) {
+	static const unsigned char zeros[MACHINE_PAGE];
+	for (int i = 0; i < MACHINE_PAGES; i++)
+		if (fwrite(m->pages[i] ? m->pages[i] : zeros, 1, MACHINE_PAGE, out) != MACHINE_PAGE) return 0;
+	return 1;
+}
+
+static unsigned char * writablePage(Machine * m, uint64_t address) {
+	uint64_t index = address / MACHINE_PAGE;
+	unsigned char ** page = &m->pages[index];
+	if (m->shared[index]) {
+		unsigned char * copy = malloc(MACHINE_PAGE);
+		memcpy(copy, *page, MACHINE_PAGE);
+		*page = copy;
+		m->shared[index] = 0;
+	} else if (*page == NULL) {
+		*page = calloc(1, MACHINE_PAGE);
+	}
+	return *page;
+}
+
+void writeMemory(Machine * m, uint64_t address, uint64_t value, int bytes) {
+	if (!inMemory(m, address, bytes)) return;
+	for (int i = 0; i < bytes; i++, value >>= 8)
+		writablePage(m, address + i)[(address + i) % MACHINE_PAGE] = value & 0xff;
+}
+
+static void copyIn(Machine * m, uint64_t address, const unsigned char * bytes, size_t size) {
+	for (size_t i = 0; i < size; i++)
+		writablePage(m, address + i)[(address + i) % MACHINE_PAGE] = bytes[i];
+}
+
+static void reset(Machine * m, uint64_t entry) {
+	memset(m->regs, 0, sizeof(m->regs));
+	m->regs[31] = MACHINE_MEMORY;
+	m->pc = entry;
+	m->steps = 0;
+	m->status = MACHINE_RUNNING;
+	m->fault[0] = '\0';
+	m->atSnapshot = 0;
+}
+
+static int loadSymbols(Machine * m, const unsigned char * image, size_t size, const ImageHeader * hdr, ltable * symbols) {
+	uint64_t names = hdr->symbolOffset + (uint64_t)hdr->numSymbols * sizeof(SymbolEntry);
+	if (hdr->symbolOffset > size || names > size) {
+		fault(m, "symbol table outside the image");
+		return 0;
+	}
+	for (uint32_t i = 0; i < hdr->numSymbols; i++) {
+		SymbolEntry sym;
+		memcpy(&sym, image + hdr->symbolOffset + i * sizeof(SymbolEntry), sizeof(sym));
+		if (names + sym.nameOffset + sym.nameLength > size || sym.nameLength > 62) {
+			fault(m, "symbol name outside the image");
+			return 0;
+		}
+		char label[64] = ":";
+		memcpy(label + 1, image + names + sym.nameOffset, sym.nameLength);
+		label[sym.nameLength + 1] = '\0';
+		insertLabel(label, sym.address, symbols);
+	}
+	return 1;
+}
+
+unsigned char * readImageFile(const char * filename, size_t * len) {
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL) return NULL;
+	size_t cap = 1 << 16;
+	unsigned char * buf = malloc(cap);
+	*len = 0;
+	size_t n;
+	while ((n = fread(buf + *len, 1, cap - *len, file)) > 0) {
+		*len += n;
+		if (*len == cap) buf = realloc(buf, cap *= 2);
+	}
+	fclose(file);
+	return buf;
+}
+
+int loadImage(Machine * m, const unsigned char * image, size_t size, ltable * symbols) {
+	releasePages(m);
+	reset(m, IMAGE_ENTRY);
+
+	ImageHeader hdr;
+	if (size < sizeof(hdr) || memcmp(image, IMAGE_MAGIC, 4) != 0) {
+		// raw: the words as they are, from the entry point
+		if (size > MACHINE_MEMORY - IMAGE_ENTRY) {
+			fault(m, "image of %zu bytes does not fit in memory", size);
+			return 0;
+		}
+		copyIn(m, IMAGE_ENTRY, image, size);
+		return 1;
+	}
+
+	memcpy(&hdr, image, sizeof(hdr));
+	if (hdr.version != IMAGE_VERSION || sizeof(hdr) + hdr.numSections * sizeof(SectionHeader) > size) {
+		fault(m, "unsupported image version %d", hdr.version);
+		return 0;
+	}
+	for (int i = 0; i < hdr.numSections; i++) {
+		SectionHeader sec;
+		memcpy(&sec, image + sizeof(hdr) + i * sizeof(SectionHeader), sizeof(sec));
+		if (sec.address > MACHINE_MEMORY || sec.memSize > MACHINE_MEMORY - sec.address) {
+			fault(m, "section at 0x%" PRIx64 " does not fit in memory", sec.address);
+			return 0;
+		}
+		if (sec.type == SECTION_BSS) continue;
+		if (sec.offset > size || sec.fileSize > size - sec.offset || sec.fileSize > sec.memSize) {
+			fault(m, "section at 0x%" PRIx64 " outside the image", sec.address);
+			return 0;
+		}
+		copyIn(m, sec.address, image + sec.offset, sec.fileSize);
+	}
+	if (symbols && hdr.numSymbols && !loadSymbols(m, image, size, &hdr, symbols)) return 0;
+	m->pc = hdr.entry;
+	return 1;
+}
+
+MachineImage * snapshotMachine(Machine * m) {
+	MachineImage * img = calloc(1, sizeof(MachineImage));
+	for (int i = 0; i < MACHINE_PAGES; i++) {
+		if (m->pages[i] == NULL) continue;
+		img->pages[i] = m->pages[i];
+		img->owned[i] = !m->shared[i];
+		m->shared[i] = 1;
+		img->pageCount++;
+	}
+	memcpy(img->regs, m->regs, sizeof(img->regs));
+	img->pc = m->pc;
+	img->steps = m->steps;
+	return img;
+}
+
+MachineImage * newMachineImage(const unsigned char * image, size_t size, ltable * symbols, char * fault) {
+	Machine * m = newMachine();
+	MachineImage * img = NULL;
+	if (loadImage(m, image, size, symbols)) img = snapshotMachine(m);
+	else if (fault) strcpy(fault, m->fault);
+	freeMachine(m);
+	return img;
+}
+
+void freeMachineImage(MachineImage * image) {
+	if (image == NULL) return;
+	for (int i = 0; i < MACHINE_PAGES; i++)
+		if (image->owned[i]) free(image->pages[i]);
+	free(image);
+}
+
+void startMachine(Machine * m, const MachineImage * image) {
+	releasePages(m);
+	for (int i = 0; i < MACHINE_PAGES; i++) {
+		m->pages[i] = image->pages[i];
+		m->shared[i] = image->pages[i] != NULL;
+	}
+	reset(m, image->pc);
+	memcpy(m->regs, image->regs, sizeof(m->regs));
+	m->steps = image->steps;
+}
+
+static double asDouble(uint64_t bits) {
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+static uint64_t fromDouble(double d) {
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return bits;
+}
+
+// Registers each opcode reads (d / s / t fields) and whether it writes rd
+static const struct { unsigned char d, s, t, def; } fields[32] = {
+	[0x0] = {0, 1, 1, 1},  [0x1] = {0, 1, 1, 1},  [0x2] = {0, 1, 1, 1},  [0x3] = {0, 1, 0, 1},
+	[0x4] = {0, 1, 1, 1},  [0x5] = {1, 0, 0, 1},  [0x6] = {0, 1, 1, 1},  [0x7] = {1, 0, 0, 1},
+	[0x8] = {1, 0, 0, 0},  [0x9] = {1, 0, 0, 0},  [0xa] = {0, 0, 0, 0},  [0xb] = {1, 1, 0, 0},
+	[0xc] = {1, 0, 0, 0},  [0xd] = {0, 0, 0, 0},  [0xe] = {1, 1, 1, 0},  [0xf] = {1, 1, 0, 0},
+	[0x10] = {0, 1, 0, 1}, [0x11] = {0, 1, 0, 1}, [0x12] = {1, 0, 0, 1}, [0x13] = {1, 1, 0, 0},
+	[0x14] = {0, 1, 1, 1}, [0x15] = {0, 1, 1, 1}, [0x16] = {0, 1, 1, 1}, [0x17] = {0, 1, 1, 1},
+	[0x18] = {0, 1, 1, 1}, [0x19] = {1, 0, 0, 1}, [0x1a] = {0, 1, 1, 1}, [0x1b] = {1, 0, 0, 1},
+	[0x1c] = {0, 1, 1, 1}, [0x1d] = {0, 1, 1, 1},
+};
+
+int machineStep(Machine * m, Step * step) {
+	if (m->status != MACHINE_RUNNING) return 0;
+	uint64_t pc = m->pc;
+	uint32_t word = readMemory(m, pc, 4);
+	if (m->status != MACHINE_RUNNING) return 0;
+
+	int op = word >> 27, d = (word >> 22) & 31, s = (word >> 17) & 31, t = (word >> 12) & 31;
+	uint64_t L = word & 0xfff;
+	int64_t offset = L & 0x800 ? (int64_t)L - 4096 : (int64_t)L;
+	uint64_t * r = m->regs;
+	uint64_t next = pc + 4;
+
+	Step st = { .pc = pc, .word = word, .opcode = op, .def = -1 };
+	if (fields[op].d) st.uses |= 1u << d;
+	if (fields[op].s) st.uses |= 1u << s;
+	if (fields[op].t) st.uses |= 1u << t;
+	if (fields[op].def) st.def = d;
+
+	switch (op) {
+		case 0x0: r[d] = r[s] & r[t]; break;
+		case 0x1: r[d] = r[s] | r[t]; break;
+		case 0x2: r[d] = r[s] ^ r[t]; break;
+		case 0x3: r[d] = ~r[s]; break;
+		case 0x4: r[d] = r[t] < 64 ? r[s] >> r[t] : 0; break;
+		case 0x5: r[d] = L < 64 ? r[d] >> L : 0; break;
+		case 0x6: r[d] = r[t] < 64 ? r[s] << r[t] : 0; break;
+		case 0x7: r[d] = L < 64 ? r[d] << L : 0; break;
+		case 0x8: st.branch = 2; st.taken = 1; next = r[d]; break;
+		case 0x9: st.branch = 1; st.taken = 1; next = pc + r[d]; break;
+		case 0xa: st.branch = 1; st.taken = 1; next = pc + offset; break;
+		case 0xb:
+			st.branch = 1;
+			st.taken = r[s] != 0;
+			st.target = r[d];
+			if (st.taken) next = r[d];
+			break;
+		case 0xc:
+			st.branch = 2;
+			st.taken = 1;
+			st.store = 1;
+			st.uses |= 1u << 31;
+			writeMemory(m, r[31] - 8, pc + 4, 8);
+			next = r[d];
+			break;
+		case 0xd:
+			st.branch = 2;
+			st.taken = 1;
+			st.load = 1;
+			st.uses |= 1u << 31;
+			next = readMemory(m, r[31] - 8, 8);
+			break;
+		case 0xe:
+			st.branch = 1;
+			st.taken = (int64_t)r[s] > (int64_t)r[t];
+			st.target = r[d];
+			if (st.taken) next = r[d];
+			break;
+		case 0xf:
+			if (L == PRIV_HALT) {
+				m->status = MACHINE_HALTED;
+			} else if (L == PRIV_INPUT) {
+				st.def = d;
+				uint64_t value = 0;
+				if (r[s] != 0) fault(m, "input from unknown port %" PRIu64, r[s]);
+				else if (fscanf(m->in, "%" SCNu64, &value) != 1) fault(m, "no input on port 0");
+				r[d] = value;
+			} else if (L == PRIV_OUTPUT) {
+				if (r[d] != 1) fault(m, "output to unknown port %" PRIu64, r[d]);
+				else fprintf(m->out, "%" PRIu64 "\n", r[s]);
+			} else if (L == PRIV_SNAPSHOT) {
+				m->atSnapshot = 1;
+			} else {
+				fault(m, "unsupported priv %" PRIu64, L);
+			}
+			break;
+		case 0x10: st.load = 1; r[d] = readMemory(m, r[s] + offset, 8); break;
+		case 0x11: r[d] = r[s]; break;
+		case 0x12: r[d] = (r[d] & ~0xfffull) | L; break;
+		case 0x13: st.store = 1; writeMemory(m, r[d] + offset, r[s], 8); break;
+		case 0x14: r[d] = fromDouble(asDouble(r[s]) + asDouble(r[t])); break;
+		case 0x15: r[d] = fromDouble(asDouble(r[s]) - asDouble(r[t])); break;
+		case 0x16: r[d] = fromDouble(asDouble(r[s]) * asDouble(r[t])); break;
+		case 0x17: r[d] = fromDouble(asDouble(r[s]) / asDouble(r[t])); break;
+		case 0x18: r[d] = r[s] + r[t]; break;
+		case 0x19: r[d] += L; break;
+		case 0x1a: r[d] = r[s] - r[t]; break;
+		case 0x1b: r[d] -= L; break;
+		case 0x1c: r[d] = (uint64_t)((int64_t)r[s] * (int64_t)r[t]); break;
+		case 0x1d:
+			if (r[t] == 0) fault(m, "division by zero");
+			else if (r[t] == (uint64_t)-1) r[d] = -r[s]; // INT64_MIN / -1 wraps
+			else r[d] = (uint64_t)((int64_t)r[s] / (int64_t)r[t]);
+			break;
+		default:
+			fault(m, "illegal instruction %08x", word);
+			break;
+	}
+
+	if (m->status == MACHINE_FAULT) return 0;
+	if (st.taken) st.target = next;
+	if (step) *step = st;
+	m->steps++;
+	if (m->status == MACHINE_HALTED) return 0;
+	m->pc = next;
+	return 1;
+}
+
+MachineStatus runMachine(Machine * m, uint64_t maxSteps) {
+	uint64_t limit = m->steps + maxSteps;
+	while (machineStep(m, NULL))
+		if (maxSteps && m->steps >= limit) break;
+	return m->status;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "labletable.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Functional Tinker machine: loads an image written by hw3 and executes it
+// one instruction at a time. All state lives in the Machine, so any number
+// of machines may run side by side.
+//
+// Memory is MACHINE_MEMORY bytes in MACHINE_PAGE sized pages that are only
+// allocated on the first write; r31 starts at the top of memory. Pages of a
+// MachineImage are shared by every machine started from it and copied on the
+// first write, so starting one costs a page table copy.
+
+#define MACHINE_MEMORY (512 * 1024)
+#define MACHINE_PAGE 4096
+#define MACHINE_PAGES (MACHINE_MEMORY / MACHINE_PAGE)
+
+// priv codes (the L field)
+#define PRIV_HALT 0
+#define PRIV_INPUT 3
+#define PRIV_OUTPUT 4
+#define PRIV_SNAPSHOT 5 // sets atSnapshot, otherwise does nothing
+
+typedef enum MachineStatus {
+	MACHINE_RUNNING,
+	MACHINE_HALTED,
+	MACHINE_FAULT,      // fault says why, pc is the faulting instruction
+} MachineStatus;
+
+typedef struct Machine {
+	uint64_t regs[32];
+	uint64_t pc;
+	unsigned char * pages[MACHINE_PAGES];
+	unsigned char shared[MACHINE_PAGES]; // page belongs to a MachineImage
+	MachineStatus status;
+	char fault[96];
+	uint64_t steps;     // instructions retired
+	int atSnapshot;     // a priv 5 ran, for the caller to clear
+	FILE * in;          // port 0, read by in / priv 3
+	FILE * out;         // port 1, written by out / priv 4
+} Machine;
+
+// Frozen machine state that machines start from without copying it: a loaded
+// image, or a snapshot of a running machine
+typedef struct MachineImage {
+	unsigned char * pages[MACHINE_PAGES];
+	unsigned char owned[MACHINE_PAGES]; // freed with the image, else borrowed
+	uint64_t regs[32];
+	uint64_t pc;
+	uint64_t steps;
+	int pageCount;      // pages holding data
+} MachineImage;
+
+// What one executed instruction did, for models layered on top (timing.h)
+typedef struct Step {
+	uint64_t pc;
+	uint32_t word;
+	int opcode;
+	uint32_t uses;      // registers read, as a bit mask
+	int def;            // register written, -1 for none
+	int load;           // reads memory (mov rd, (rs)(L) and return)
+	int store;          // writes memory (mov (rd)(L), rs and call)
+	int branch;         // brnz / brgt / brr: 1, br / call / return: 2
+	int taken;          // control went to target
+	uint64_t target;    // where a taken branch goes
+} Step;
+
+// A machine with empty memory, I/O on stdin / stdout
+Machine * newMachine(void);
+void freeMachine(Machine * m);
+
+// The bytes of an image file (malloc'd, len set), NULL if it can not be read
+unsigned char * readImageFile(const char * filename, size_t * len);
+
+// Load a sectioned image (image.h) or a raw one at IMAGE_ENTRY and reset the
+// registers. Labels of the symbol table go into symbols when it is not NULL.
+// Returns 0 and sets fault on a malformed image.
+int loadImage(Machine * m, const unsigned char * image, size_t size, ltable * symbols);
+
+// Load an image once for startMachine. Returns NULL and, when fault is not
+// NULL, the reason in fault (96 bytes) on a malformed image.
+MachineImage * newMachineImage(const unsigned char * image, size_t size, ltable * symbols, char * fault);
+void freeMachineImage(MachineImage * image);
+
+// The state of m, which keeps running: the pages it wrote move to the
+// snapshot and both copy them on their next write. Pages m shares with
+// another MachineImage stay borrowed, so that one must outlive the snapshot.
+MachineImage * snapshotMachine(Machine * m);
+
+// Put m in the state of image (registers, pc, instruction count and memory),
+// sharing its pages until they are written. The image must outlive m or the
+// next loadImage / startMachine of m.
+void startMachine(Machine * m, const MachineImage * image);
+
+// Execute one instruction, describing it in step when that is not NULL.
+// Returns 0 once the machine has halted or faulted.
+int machineStep(Machine * m, Step * step);
+
+// Run until halt or fault or maxSteps more instructions (0 for no limit)
+MachineStatus runMachine(Machine * m, uint64_t maxSteps);
+
+// Little endian memory access, outside memory faults and returns 0
+uint64_t readMemory(Machine * m, uint64_t address, int bytes);
+void writeMemory(Machine * m, uint64_t address, uint64_t value, int bytes);
+
+// All MACHINE_MEMORY bytes from address 0 (pages never written are zeros).
+// Returns 0 if out could not take them.
+int dumpMemory(Machine * m, FILE * out);
@@ -1,6 +1,8 @@
 #include "macro.h"
+#include "context.h"
 #include "parse.h"
 #include "argparse.h"
+#include "expr.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -23,7 +25,7 @@ Entry createExpandedEntry(Entry * original, const char * instruction, int addres
     entry.address = original->address + addressOffset;
     entry.size = 4;  // Instructions are 4 bytes
     entry.type = 0;  // 0 = instruction
-    entry.str = strdup(instruction);
+    entry.str = asmStrdup(instruction);
    	
     // Parse the instruction to set cmd.type
     char * cmd = extractCommandName((char*)instruction);
@@ -39,11 +41,10 @@ Entry createExpandedEntry(Entry * original, const char * instruction, int addres
     else if (strcmp(cmd, "mov") == 0) entry.cmd.type = MOV;
     else if (strcmp(cmd, "shftli") == 0) entry.cmd.type = SHFTLI;
     else {
-        fprintf(stderr, "Error: Unknown command in macro expansion: %s\n", cmd);
-        exit(1);
+        asmError("Error: Unknown command in macro expansion: %s\n", cmd);
     }
     
-    free(cmd);
+    asmFree(cmd);
     return entry;
 }
 
@@ -92,12 +93,12 @@ int expandOut(Entry * original, Entry * output) {
 
 // ld rd, L -> Expands to multiple instructions to load full 64-bit value
 int expandLd(Entry * original, Entry * output, uint64_t addr) {
-	    fprintf(stderr, "DEBUG expandLd: address=%llu (0x%llu)\n", addr, addr);
 // Parse register from args (format: "r5, :label" or "r5, 0x1000")
-    char * argsCopy = strdup(original->str);
-    char * reg = strtok(argsCopy, ",");
+    char * argsCopy = asmStrdup(original->str);
+    char * save;
+    char * reg = strtok_r(argsCopy, ",", &save);
     int rd = parseRegister(reg);
-    free(argsCopy);
+    asmFree(argsCopy);
     
     int count = 0;
     char instruction[64];
@@ -191,29 +192,21 @@ int expandMacro(Entry * original, Entry * output, ltable * table) {
             return expandPop(original, output);
         case LD: {
             // Need to resolve label if present
-            char * argsCopy = strdup(original->str);
+            char * argsCopy = asmStrdup(original->str);
             char * comma = strchr(argsCopy, ',');
             if (comma) {
                 char * labelOrAddr = comma + 1;
                 labelOrAddr = trimWhitespace(labelOrAddr);
-				uint64_t address;
-
-				if (isLabelReference(labelOrAddr)) {
-					address = getintAddress(labelOrAddr, table);
-				} else {
-					address = parseLiteral(labelOrAddr);
-				}
-                free(argsCopy);
+				uint64_t address = evalOperand(labelOrAddr, table);
+                asmFree(argsCopy);
                 return expandLd(original, output, address);
             }
-            fprintf(stderr, "Error: Invalid ld macro format\n");
-            exit(1);
+            asmError("Error: Invalid ld macro format\n");
         }
 		case HALT: 
 			return expandHalt(original, output);
 		default:
-            fprintf(stderr, "Error: Unknown macro type\n");
-            exit(1);
+            asmError("Error: Unknown macro type\n");
     }
 }
 
@@ -226,5 +219,5 @@ int isLabelReference(char * str) {
 // Extract label name (remove the ':')
 char * extractLabelName(char * labelRef) {
     if (!isLabelReference(labelRef)) return NULL;
-    return strdup(labelRef + 1);  // Skip the ':'
+    return asmStrdup(labelRef + 1);  // Skip the ':'
 }
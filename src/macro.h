@@ -2,6 +2,9 @@
 #include "parse.h"
 #include "labletable.h"
 
+// Largest number of instructions a single macro expands to (ld)
+#define MAX_EXPANSION 12
+
 // Macro detection
 int isMacro(CommandType type);
 
@@ -1,107 +1,24 @@
 #include "parse.h"
 #include "string.h"
-#include "macro.h"
-#include "encode.h"
+#include "assembler.h"
+#include "stream.h"
+#include "pool.h"
+#include "align.h"
+#include "inline.h"
+#include "instrument.h"
+#include "daemon.h"
+#include "context.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-// Steps:
-// 1: Read the given file and get a script object
-// 2: go through the commands and turn each entry into machine bytecode
-// 3: output the binary into a new file
-
-void expandMacros(Script * script) {
-	int newNumEntries = 0;
-	Entry * newEntries = malloc(10000000 * sizeof(Entry));
-	for (int i = 0; i < script->numEntries; i++) {
-		if (script->entries[i].type == 1) {
-			newEntries[newNumEntries++] = script->entries[i];
-			continue;
-		}
-
-		Entry * add = malloc(sizeof(Entry) * 5);
-		int toAdd = expandMacro(&script->entries[i], add, script->ltable);
-
-		for (int j = 0; j < toAdd; j++)
-			newEntries[newNumEntries++] = add[j];
-	}
-
-	script->entries = newEntries;
-	script->numEntries = newNumEntries;
-}
+// Sources hw3 --daemon keeps parsed, by path, modification time and size
+#define DAEMON_PARSE_CACHE 64
 
-void fillLabelTable(Script * script) {
-	uint64_t address = 0x1000;
-	for (int i = 0; i < script->numEntries; i++) {
-		if (script->entries[i].type != 2) script->entries[i].address = address;
-		if (script->entries[i].type == 2) {
-			script->entries[i].address = address;
-			insertLabel(script->entries[i].lbl, address, script->ltable);
-		} else if (script->entries[i].type == 1) { 
-			address += 8;
-		}
-		else if (script->entries[i].type == 0) {
-			address += 4 * cmdTable[script->entries[i].cmd.type].cnt;
-		}
-	}
-}
-
-void replaceLabels(Script * script) {
-	for (int i = 0; i < script->numEntries; i++) {
-		Entry * entry = &script->entries[i];
-		char * modified = malloc(50000 * sizeof(char));
-		int len = 0;
-		if (entry->str == null) continue;
-		for (int j = 0; j < strlen(entry->str); j++)
-			if (entry->str[j] == ':') {
-				char buf[500];
-				int k = j;
-				while (entry->str[k] != ' ')
-					buf[k - j] = entry->str[k], k++;
-				buf[k] = '\0';
-				uint64_t address = getintAddress(buf, script->ltable);
-				char str[20];
-				sprintf(str, "%" PRIu64, address);
-				for (int m = 0; m < strlen(str); m++)
-					modified[len++] = str[m];
-				j = k-1;
-			} else modified[len++] = entry->str[j];
-
-		modified[len] = '\0';
-		entry->str = modified;
-	}
-}
-
-void printToIntermediate(Script * script, char * filename) {
-	FILE * file = fopen(filename, "w");
-	int mode = -1;
-	int nmode = mode;
-
-	int b = 0;
-	for (int i = 0; i < script->numEntries; i++) {
-		b |= (script->entries[i].type == 3);
-	}
-	if (!b) fprintf(file, ".code\n"), mode = 3;
-	
-	for (int i = 0; i < script->numEntries; i++) {
-		Entry entry = script->entries[i];
-		
-		if (entry.type == 2) continue;
-		
-		if (entry.type == 1) { // data
-			fprintf(file, "\t%llu\n", entry.value);
-		} else if (entry.type == 0){ // code
-			fprintf(file, "\t%s %s\n", cmdTable[entry.cmd.type].name, entry.str);
-		} else if (entry.type == 3 && mode != 3) {
-			fprintf(file, ".code\n");
-			mode = entry.type;
-		} else if (entry.type == 4 && mode != 4) {
-			fprintf(file, ".data\n");
-			mode = entry.type;
-		}
-
-	}
-}
+// Steps:
+// 1: Read the given file into memory
+// 2: assemble it (assembler.c)
+// 3: write the intermediate file and the binary
 
 int * binNum(int num, int sz) {
 	int * bin = malloc(sizeof(int)*(sz+1));
@@ -123,36 +40,216 @@ char * charNum(int num, int sz) {
 	return bin;
 }
 
-void printToBinary(Script * script, char * filename) {
-	FILE * file = fopen(filename, "wb");
-	for (int i = 0; i < script->numEntries; i++) {
-		Entry entry = script->entries[i];
-		if (entry.type == 2) continue;
-		if (entry.type == 1) { // data
-			fwrite(&entry.value, sizeof(long long), 1, file);
-		} else if (entry.type == 0) { // instruction
-									  //
-			uint32_t x = getInstruction(&entry);
-			fwrite(&x, sizeof(uint32_t), 1, file);
+// Where one run reads and writes: the process' own on the command line, the
+// client's for a daemon request
+typedef struct Invocation {
+	const char * cwd;       // relative paths start here, NULL for the current directory
+	FILE * in;
+	FILE * out;
+	FILE * err;
+	AsmWorkspace * ws;      // the daemon worker's, NULL on the command line
+	AsmParseCache * cache;  // the daemon's, NULL on the command line
+} Invocation;
+
+// filename as seen from the invocation's directory, malloc'd
+static char * inDirectory(Invocation * inv, const char * filename) {
+	if (inv->cwd == null || filename[0] == '/') return strdup(filename);
+	char * path = malloc(strlen(inv->cwd) + strlen(filename) + 2);
+	sprintf(path, "%s/%s", inv->cwd, filename);
+	return path;
+}
+
+// The whole file. With key, also the parse cache key of its contents:
+// path, modification time and size
+static char * readFile(Invocation * inv, char * filename, size_t * len, char ** key) {
+	char * path = inDirectory(inv, filename);
+	FILE * file = fopen(path, "rb");
+	if (file == null) {
+		free(path);
+		return null;
+	}
+	if (key) {
+		struct stat st;
+		*key = null;
+		if (fstat(fileno(file), &st) == 0) {
+			*key = malloc(strlen(path) + 64);
+			sprintf(*key, "%s %lld.%09ld %lld", path, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size);
 		}
 	}
+	free(path);
+	size_t cap = 1 << 16;
+	char * buf = malloc(cap);
+	*len = 0;
+	size_t n;
+	while ((n = fread(buf + *len, 1, cap - *len, file)) > 0) {
+		*len += n;
+		if (*len == cap) buf = realloc(buf, cap *= 2);
+	}
+	fclose(file);
+	return buf;
 }
 
-int main(int argc, char * argv[]) {
-	Script * script = getScript(argv[1]);
-	
-	// 1: Intermediate file created
-	fillLabelTable(script);
+static int writeFile(Invocation * inv, char * filename, const void * data, size_t len) {
+	char * path = inDirectory(inv, filename);
+	FILE * file = fopen(path, "wb");
+	free(path);
+	if (file == null || fwrite(data, 1, len, file) != len) {
+		fprintf(inv->err, "could not write %s\n", filename);
+		if (file) fclose(file);
+		return 0;
+	}
+	fclose(file);
+	return 1;
+}
+
+static int usage(Invocation * inv, const char * name) {
+	fprintf(inv->err, "usage: %s [--pool[=rN]] [--raw | --symbols] [--align-loops[=N]] [--profile=file] [--strip-dead] [--const-prop] [--strip-spills] [--inline[=words]] [--legalize[=rN]] [--schedule] [--instrument[=rN]] input.tk [intermediate.tk] output.tko\n"
+			"       %s --stream [output.tko] < input.tk\n"
+			"       %s --daemon [--jobs=N] [socket]\n", name, name, name);
+	return 1;
+}
 
-	for (int i = 0; i < script->numEntries; i++) {
-		Entry entry = script->entries[i];
+// One assembler invocation, also what the daemon runs for each request
+static int run(Invocation * inv, int argc, char * argv[]) {
+	int stream = 0;
+	AsmOptions options = {0};
+	char * files[3] = {null, null, null};
+	int numFiles = 0;
+	int positional = 0;
+	char * profileFile = null;
+
+	// a bad register in an option fails this run, not a daemon serving it
+	AsmContext ctx;
+	asmBegin(&ctx, inv->err);
+	if (setjmp(ctx.fail)) {
+		asmEnd(&ctx);
+		return 1;
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--stream") == 0) stream++;
+		else if (strcmp(argv[i], "--pool") == 0) options.pool = 1, options.poolReg = POOL_DEFAULT_REG;
+		else if (strncmp(argv[i], "--pool=", 7) == 0) options.pool = 1, options.poolReg = parseRegister(argv[i] + 7);
+		else if (strcmp(argv[i], "--raw") == 0) options.raw = 1;
+		else if (strcmp(argv[i], "--symbols") == 0) options.symbols = 1;
+		else if (strcmp(argv[i], "--align-loops") == 0) options.alignLoops = ALIGN_LOOP_DEFAULT;
+		else if (strncmp(argv[i], "--align-loops=", 14) == 0) options.alignLoops = atoi(argv[i] + 14);
+		else if (strncmp(argv[i], "--profile=", 10) == 0) profileFile = argv[i] + 10;
+		else if (strcmp(argv[i], "--strip-dead") == 0) options.deadCode = 1;
+		else if (strcmp(argv[i], "--const-prop") == 0) options.constProp = 1;
+		else if (strcmp(argv[i], "--strip-spills") == 0) options.spills = 1;
+		else if (strcmp(argv[i], "--inline") == 0) options.inlineBudget = INLINE_DEFAULT_BUDGET;
+		else if (strncmp(argv[i], "--inline=", 9) == 0) options.inlineBudget = atoi(argv[i] + 9);
+		else if (strcmp(argv[i], "--legalize") == 0) options.legalize = 1, options.scratchReg = -1;
+		else if (strncmp(argv[i], "--legalize=", 11) == 0) options.legalize = 1, options.scratchReg = parseRegister(argv[i] + 11);
+		else if (strcmp(argv[i], "--schedule") == 0) options.schedule = 1;
+		else if (strcmp(argv[i], "--instrument") == 0) options.instrument = 1, options.instrumentReg = INSTRUMENT_DEFAULT_REG;
+		else if (strncmp(argv[i], "--instrument=", 13) == 0) options.instrument = 1, options.instrumentReg = parseRegister(argv[i] + 13);
+		else {
+			if (numFiles < 3) files[numFiles++] = argv[i];
+			positional++;
+		}
+	}
+	asmEnd(&ctx);
+
+	// --stream takes the output file alone: the passes need the whole program,
+	// and a second file name is more likely the input than a second output
+	int passOptions = argc - 1 - stream - positional;
+	if (stream && (positional > 1 || passOptions > 0)) return usage(inv, argv[0]);
+
+	// hw3 --stream [output.tko]: stdin -> output (stdout when omitted or -)
+	if (stream) {
+		FILE * out = inv->out;
+		if (files[0] && strcmp(files[0], "-") != 0) {
+			char * path = inDirectory(inv, files[0]);
+			out = fopen(path, "wb");
+			free(path);
+		}
+		if (out == null) {
+			fprintf(inv->err, "could not open %s\n", files[0]);
+			return 1;
+		}
+		volatile int ok = 0;
+		asmBegin(&ctx, inv->err);
+		ctx.directory = inv->cwd;
+		if (setjmp(ctx.fail) == 0) {
+			assembleStream(inv->in, out);
+			ok = 1;
+		}
+		asmEnd(&ctx);
+		if (out == inv->out) fflush(out);
+		else fclose(out);
+		return ok ? 0 : 1;
+	}
+	if (numFiles < 2) return usage(inv, argv[0]);
+
+	size_t len;
+	char * key = null;
+	char * src = readFile(inv, files[0], &len, inv->cache ? &key : null);
+	if (src == null) {
+		fprintf(inv->err, "could not open %s\n", files[0]);
+		return 1;
+	}
 
+	char * profile = null;
+	if (profileFile) {
+		profile = readFile(inv, profileFile, &options.profileSize, null);
+		if (profile == null) {
+			fprintf(inv->err, "could not open %s\n", profileFile);
+			free(src);
+			free(key);
+			return 1;
+		}
+		options.profile = profile;
+	}
 
+	// the intermediate file is only formatted when it is asked for
+	char * intermediateFile = numFiles == 3 ? files[1] : null;
+	char * outputFile = files[numFiles - 1];
+	options.intermediate = intermediateFile != null;
+
+	options.directory = inv->cwd;
+	AsmResult result = assembleWith(inv->ws, inv->cache, key, src, len, &options);
+	free(src);
+	free(key);
+	free(profile);
+	fputs(result.diagnostics, inv->err);
+
+	// the counter map goes next to the image, output.tko.map
+	char * mapFile = null;
+	if (result.counterMap) {
+		mapFile = malloc(strlen(outputFile) + 5);
+		sprintf(mapFile, "%s.map", outputFile);
 	}
-	expandMacros(script);
 
-	replaceLabels(script);
+	int ok = result.ok &&
+		(intermediateFile == null || writeFile(inv, intermediateFile, result.intermediate, result.intermediateSize)) &&
+		(mapFile == null || writeFile(inv, mapFile, result.counterMap, result.counterMapSize)) &&
+		writeFile(inv, outputFile, result.image, result.imageSize);
+	free(mapFile);
+	freeAsmResult(&result);
+	return ok ? 0 : 1;
+}
+
+static AsmParseCache * parseCache; // the daemon's, its workers share it
 
-	printToIntermediate(script, argv[2]);
-	printToBinary(script, argv[3]);
+static void * newWorker(void) {
+	return newAsmWorkspace();
+}
+
+static int serveCall(DaemonCall * call) {
+	Invocation inv = { call->cwd, call->in, call->out, call->err, call->worker, parseCache };
+	return run(&inv, call->argc, call->argv);
+}
+
+int main(int argc, char * argv[]) {
+	// hw3 --daemon [--jobs=N] [socket]: serve requests from hw3c on N threads
+	if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+		int threads = 0;
+		int next = 2;
+		if (next < argc && strncmp(argv[next], "--jobs=", 7) == 0) threads = atoi(argv[next++] + 7);
+		parseCache = newAsmParseCache(DAEMON_PARSE_CACHE);
+		return runDaemon(next < argc ? argv[next] : null, threads, newWorker, serveCall);
+	}
+	Invocation inv = { null, stdin, stdout, stderr, null, null };
+	return run(&inv, argc, argv);
 }
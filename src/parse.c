@@ -1,10 +1,17 @@
 #include "parse.h"
+#include "context.h"
+#include "expr.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // FIXED: Properly trim leading and trailing whitespace
 char * trim(char * totrim) {
@@ -18,7 +25,7 @@ char * trim(char * totrim) {
     
     // If entire string is whitespace, return empty string
     if (totrim[l] == '\0') {
-        char * result = malloc(1);
+        char * result = asmAlloc(1);
         result[0] = '\0';
         return result;
     }
@@ -31,7 +38,7 @@ char * trim(char * totrim) {
     
     // Allocate memory for trimmed string
     int length = r - l + 1;
-    char * ret = malloc((length + 1) * sizeof(char));
+    char * ret = asmAlloc((length + 1) * sizeof(char));
     
     // Copy trimmed content
     strncpy(ret, totrim + l, length);
@@ -46,54 +53,315 @@ static CommandType lookupCommand(const char *cmd) {
         if (strcmp(cmd, cmdTable[i].name) == 0)
             return cmdTable[i].type;
     }
-	fprintf(stderr, "unknown command %s\n", cmd);
-	exit(1);
+	asmError("unknown command %s\n", cmd);
+}
+
+// SWAR helpers: 8 ASCII characters loaded little endian into one word
+static inline int isEightDigits(uint64_t chunk) {
+	return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+			(((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+static inline uint64_t eightDigitsValue(uint64_t chunk) {
+	chunk -= 0x3030303030303030ULL;
+	chunk = (chunk * 10) + (chunk >> 8);
+	chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+			(((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+	return chunk & 0xFFFFFFFF;
+}
+
+int parseDecimal(const char ** str, const char * end, uint64_t * value) {
+	const char * p = *str;
+	uint64_t v = 0;
+
+	while (end - p >= 8) {
+		uint64_t chunk;
+		memcpy(&chunk, p, 8);
+		if (!isEightDigits(chunk)) break;
+		if (__builtin_mul_overflow(v, 100000000ULL, &v) ||
+				__builtin_add_overflow(v, eightDigitsValue(chunk), &v))
+			return 0;
+		p += 8;
+	}
+	while (p < end && isdigit((unsigned char)*p)) {
+		if (__builtin_mul_overflow(v, 10ULL, &v) ||
+				__builtin_add_overflow(v, (uint64_t)(*p - '0'), &v))
+			return 0;
+		p++;
+	}
+	if (p == *str) return 0;
+
+	*str = p;
+	*value = v;
+	return 1;
+}
+
+// "1, 2, 3" -> one type 5 entry holding the words back to back
+static Entry * handleDataArray(char * dataline, int address) {
+	const char * p = dataline;
+	const char * end = dataline + strlen(dataline);
+
+	size_t cap = 16, count = 0;
+	uint64_t * words = asmAlloc(cap * sizeof(uint64_t));
+	for (;;) {
+		while (p < end && isspace((unsigned char)*p)) p++;
+		if (p < end && *p == '-') {
+			asmError("no negatives allowed\n");
+		}
+		if (count == cap) words = asmRealloc(words, (cap *= 2) * sizeof(uint64_t));
+		const char * start = p;
+		if (!parseDecimal(&p, end, &words[count++])) {
+			while (p < end && isdigit((unsigned char)*p)) p++;
+			asmError(p > start ? "data exceeds maximum limit\n" : "invalid data\n");
+		}
+		while (p < end && isspace((unsigned char)*p)) p++;
+		if (p == end) break;
+		if (*p++ != ',') {
+			asmError("invalid data\n");
+		}
+	}
+
+	Entry * ret = asmCalloc(1, sizeof(Entry));
+	ret->address = address;
+	ret->size = count * 8;
+	ret->type = 5;
+	ret->bytes = (unsigned char *)words;
+	ret->str = asmStrdup(dataline);
+	return ret;
+}
+
+// Words that are not all plain decimals: ":end - :start", "N * 8", "sizeof(.data)".
+// Their values wait in lbl for resolveEquates / resolveDataExpressions
+static Entry * handleDataExpression(char * dataline, int address) {
+	Entry * ret = asmCalloc(1, sizeof(Entry));
+	ret->address = address;
+	ret->lbl = asmStrdup(dataline);
+	if (strchr(dataline, ',')) {
+		int count = 1;
+		for (char * p = dataline; *p; p++) count += *p == ',';
+		ret->type = 5;
+		ret->size = count * 8;
+		ret->bytes = asmCalloc(count, 8);
+		ret->str = asmStrdup(dataline);
+	} else {
+		ret->type = 1;
+		ret->size = 8;
+	}
+	return ret;
 }
 
 Entry * handleData(char * dataline, int address) {
-	Entry * ret = malloc(sizeof(Entry));
+	if (dataline[0] != '-' && dataline[strspn(dataline, "0123456789, \t")] != '\0')
+		return handleDataExpression(dataline, address);
+	if (strchr(dataline, ',')) return handleDataArray(dataline, address);
+
+	Entry * ret = asmAlloc(sizeof(Entry));
 	ret->address = address;
 	ret->size = 8; 
 	ret->type = 1;
-	if (trim(dataline)[0] == '-') {
-		fprintf(stderr, "no negatives allowed\n");
-		exit(1);
+	ret->str = null;
+	ret->lbl = null;
+	ret->bytes = null;
+	if (trimWhitespace(dataline)[0] == '-') {
+		asmError("no negatives allowed\n");
 	}
 	char * ptr;
 
+	errno = 0;
 	ret->value = strtoull(dataline, &ptr, 10);
 	if (*ptr != '\0' || ptr == dataline) {
-		fprintf(stderr, "invalid data\n");
-		exit(1);
+		asmError("invalid data\n");
 	}
 	if (errno == ERANGE) {
-		fprintf(stderr, "data exceeds maximum limit\n");
-		exit(1);
+		asmError("data exceeds maximum limit\n");
 	}
 	return ret;
 }
 
+// Map the whole file read only, the mapping is copied straight into the output
+static unsigned char * mapFile(char * path, int * size) {
+	const char * dir = asmDirectory();
+	int fd;
+	if (dir && path[0] != '/') {
+		char * full = asmAlloc(strlen(dir) + strlen(path) + 2);
+		sprintf(full, "%s/%s", dir, path);
+		fd = open(full, O_RDONLY);
+		asmFree(full);
+	} else {
+		fd = open(path, O_RDONLY);
+	}
+	if (fd < 0) {
+		asmError("Error: cannot open .incbin file '%s'\n", path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size > INT_MAX) {
+		close(fd);
+		asmError("Error: .incbin file '%s' cannot be read or is too large\n", path);
+	}
+	*size = st.st_size;
+	unsigned char * bytes = null;
+	if (st.st_size > 0) {
+		bytes = mmap(null, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (bytes == MAP_FAILED) {
+			close(fd);
+			asmError("Error: cannot map .incbin file '%s'\n", path);
+		}
+		asmTrackMapping(bytes, st.st_size);
+	}
+	close(fd);
+	return bytes;
+}
+
+// A literal, or a constant expression of the symbols defined before address
+// (then *folded is set, the directive is written out with the value)
+static unsigned long long parseDirectiveNumber(char * text, char * directive, Equates * equates, int address, int * folded) {
+	char * ptr;
+	text = trimWhitespace(text);
+	errno = 0;
+	unsigned long long value = strtoull(text, &ptr, 0);
+	if (ptr != text && *trimWhitespace(ptr) == '\0' && text[0] != '-' && errno != ERANGE) return value;
+
+	int64_t v = 0;
+	int status = -1;
+	if (text[0] != '-' && errno != ERANGE) {
+		char * expanded = expandEquates(text, equates, address);
+		status = evalExpression(expanded, null, &v, null);
+		asmFree(expanded);
+	}
+	if (status != 1 || v < 0) {
+		asmError("Error: invalid number '%s' in %s\n", text, directive);
+	}
+	*folded = 1;
+	return v;
+}
+
+Entry * handleDirective(char * line, int address, int * mode, Equates * equates) {
+	char * text = trim(line);
+	char * name = extractCommandName(text);
+	char * args = extractArguments(text);
+
+	Entry * entry = asmCalloc(1, sizeof(Entry));
+	entry->address = address;
+	entry->str = text;
+	int folded = 0;
+
+	if (strcmp(name, ".equ") == 0 || strcmp(name, ".set") == 0) {
+		char * comma = strchr(args, ',');
+		if (!comma) {
+			asmError("Error: expected %s name, value\n", name);
+		}
+		*comma = '\0';
+		defineEquate(equates, trimWhitespace(args), trimWhitespace(comma + 1), address, name[1] == 's');
+		entry->type = 8;
+	} else if (strcmp(name, ".incbin") == 0) {
+		entry->type = 5;
+		entry->bytes = mapFile(args, &entry->size);
+	} else if (strcmp(name, ".fill") == 0) {
+		char * comma = strchr(args, ',');
+		if (!comma) {
+			asmError("Error: expected .fill count, value\n");
+		}
+		*comma = '\0';
+		unsigned long long count = parseDirectiveNumber(args, ".fill", equates, address, &folded);
+		if (count > INT_MAX / 8) {
+			asmError("Error: .fill count %llu is too large\n", count);
+		}
+		entry->type = 6;
+		entry->size = count * 8;
+		entry->value = parseDirectiveNumber(comma + 1, ".fill", equates, address, &folded);
+	} else if (strcmp(name, ".space") == 0) {
+		unsigned long long bytes = parseDirectiveNumber(args, ".space", equates, address, &folded);
+		if (bytes > INT_MAX) {
+			asmError("Error: .space %llu is too large\n", bytes);
+		}
+		entry->type = 6;
+		entry->size = bytes;
+		entry->value = 0;
+	} else if (strcmp(name, ".align") == 0 || strcmp(name, ".balign") == 0) {
+		unsigned long long align = parseDirectiveNumber(args, name, equates, address, &folded);
+		if (align == 0 || (align & (align - 1)) || align > MAX_ALIGN) {
+			asmError("Error: %s %llu is not a power of two up to %d\n", name, align, MAX_ALIGN);
+		}
+		entry->type = 7;
+		entry->align = align;
+		entry->size = -address & (align - 1);
+		entry->value = *mode == 0 ? (unsigned long long)NOP_WORD << 32 | NOP_WORD : 0;
+	} else { // switch modes
+		*mode = line[1] == 'd' ? 1 : 0;
+		entry->type = 3 + *mode; // 3 for code, 4 for data
+	}
+	if (folded) {
+		// the intermediate file has no symbols
+		char buf[64];
+		if (entry->type == 6 && strcmp(name, ".fill") == 0)
+			snprintf(buf, sizeof(buf), ".fill %d, %llu", entry->size / 8, entry->value);
+		else
+			snprintf(buf, sizeof(buf), "%s %d", name, entry->type == 7 ? entry->align : entry->size);
+		entry->str = asmStrdup(buf);
+	}
+
+	asmFree(name);
+	asmFree(args);
+	return entry;
+}
+
 Entry * handleCmd(char * line, int address) {
-	Entry * newEntry = malloc(sizeof(Entry));
+	Entry * newEntry = asmAlloc(sizeof(Entry));
 	char * cmd = extractCommandName(line);
 	char * args = extractArguments(line);
 	newEntry->str = args;
+	newEntry->lbl = null;
+	newEntry->bytes = null;
 	newEntry->address = address;
+	newEntry->size = 4;
+	newEntry->type = 0;
 	newEntry->cmd.type = lookupCommand(cmd);
-	free(cmd);  // Free the command string since we don't need it anymore
+	asmFree(cmd);  // Free the command string since we don't need it anymore
 	return newEntry;
 }
 
-Script * getScript(char * filename) {
+// getline, but the buffer comes from asmRealloc so an abandoned assembly frees it
+int readLine(FILE * file, char ** line, size_t * cap) {
+	size_t len = 0;
+	for (;;) {
+		if (*cap - len < 2) {
+			*cap = *cap ? *cap * 2 : 256;
+			*line = asmRealloc(*line, *cap);
+		}
+		if (fgets(*line + len, *cap - len, file) == NULL) break;
+		len += strlen(*line + len);
+		if ((*line)[len - 1] == '\n') break;
+	}
+	return len > 0;
+}
 
-	Script * ret = malloc(sizeof(Script));
+Script * getScript(char * filename) {
 	FILE * file = fopen(filename, "r");
-	ltable * table = malloc(sizeof(ltable));
+	if (file == null) {
+		asmError("could not open %s\n", filename);
+	}
+	Script * ret = parseScript(file);
+	fclose(file);
+	return ret;
+}
+
+Script * parseScript(FILE * file) {
+	return parseScriptWith(file, asmAlloc(sizeof(ltable)));
+}
+
+Script * parseScriptWith(FILE * file, ltable * table) {
+
+	Script * ret = asmAlloc(sizeof(Script));
+	table->count = 0;
+	table->sized = 0;
 	ret->ltable = table;
-	char line[5000];
+	ret->equates = asmCalloc(1, sizeof(Equates));
+	char * line = null;
+	size_t lineCap = 0;
 
 	int numEntries = 0;
-	Entry * allEntries = malloc(50000 * sizeof(Entry));	
+	int maxEntries = 50000;
+	Entry * allEntries = asmAlloc(maxEntries * sizeof(Entry));
 
 	// first passthrough:
 	// 1: Create label table
@@ -104,16 +372,17 @@ Script * getScript(char * filename) {
 	// first passthrough, create label table and expand macros
 	int mode = -1; // 0 for code, 1 for data
 	int address = 0x1000;
+	int lineNumber = 0;
 	
-	while (fgets(line, sizeof(line), file) != NULL) {
+	while (readLine(file, &line, &lineCap)) {
 		int val;
 		Entry * entry = NULL;
+		lineNumber++;
 		switch (line[0]) {
 			case '\t': // save either the data or instruction at the current address and increment counter
-				entry = malloc(sizeof(Entry));
 				if (mode) {
 					entry = handleData(trim(line), address);
-					address += 8;
+					address += entry->size;
 				} else {
 					entry = handleCmd(trim(line), address);
 					address += 4;
@@ -121,36 +390,114 @@ Script * getScript(char * filename) {
 				break;
 				
 			case ':': // save this label as the current address, but don't increment current counter
-				entry = malloc(sizeof(Entry));
+				entry = asmCalloc(1, sizeof(Entry));
 				char * label = trim(line);
 				entry->size = 0;
 				entry->type = 2;
 				entry->lbl = label;
 				break;
 
-			case '.': // switch modes
-				if (line[1] == 'd') mode = 1;
-				else mode = 0;
-				entry = malloc(sizeof(Entry));
-				entry->type = 3 + mode; // 3 for code, 4 for data
+			case '.': // switch modes or a bulk data block
+				entry = handleDirective(line, address, &mode, ret->equates);
+				address += entry->size;
 				break;
 		}
 
 
-		if (entry) allEntries[numEntries++] = *entry;
+		// .equ / .set leave nothing in the script
+		if (entry && entry->type != 8) {
+			if (numEntries == maxEntries)
+				allEntries = asmRealloc(allEntries, (maxEntries *= 2) * sizeof(Entry));
+			entry->line = lineNumber;
+			allEntries[numEntries++] = *entry;
+		}
 	}
+	asmFree(line);
 
-	Entry * orderedEntries = malloc(numEntries * sizeof(Entry));
+	Entry * orderedEntries = asmAlloc(numEntries * sizeof(Entry));
 	for (int i = 0; i < numEntries; i++)
 		orderedEntries[i] = allEntries[i];
 
 	ret->numEntries = numEntries;
 	ret->entries = orderedEntries;
 
-	
-	fclose(file);
 	return ret;
 }
 
+// Copy of text / bytes from alloc, NULL stays NULL
+static void * cloneBytes(const void * from, size_t size, void * (*alloc)(size_t)) {
+	if (from == null) return null;
+	void * copy = alloc(size);
+	memcpy(copy, from, size);
+	return copy;
+}
+
+static char * cloneText(const char * from, void * (*alloc)(size_t)) {
+	return from ? cloneBytes(from, strlen(from) + 1, alloc) : null;
+}
+
+static Script * cloneScript(const Script * from, ltable * table, void * (*alloc)(size_t)) {
+	Script * to = alloc(sizeof(Script));
+	*to = *from;
+	to->ltable = table;
+	to->entries = alloc((from->numEntries ? from->numEntries : 1) * sizeof(Entry));
+	for (int i = 0; i < from->numEntries; i++) {
+		Entry * e = &to->entries[i];
+		*e = from->entries[i];
+		e->str = cloneText(e->str, alloc);
+		e->lbl = cloneText(e->lbl, alloc);
+		e->bytes = cloneBytes(e->bytes, e->size, alloc);
+		e->cmd.args = null;
+	}
+	Equates * equates = alloc(sizeof(Equates));
+	*equates = (Equates){ alloc((from->equates->count ? from->equates->count : 1) * sizeof(Equate)),
+			from->equates->count, from->equates->count };
+	for (int i = 0; i < equates->count; i++) {
+		equates->items[i] = from->equates->items[i];
+		equates->items[i].name = cloneText(equates->items[i].name, alloc);
+		equates->items[i].expr = cloneText(equates->items[i].expr, alloc);
+	}
+	to->equates = equates;
+	return to;
+}
+
+// malloc that fails like asmAlloc does
+static void * keepAlloc(size_t size) {
+	void * p = malloc(size);
+	if (p == null) asmError("Error: out of memory\n");
+	return p;
+}
+
+Script * keepScript(Script * script) {
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * e = &script->entries[i];
+		if (e->type == 5 && e->str && strncmp(e->str, ".incbin", 7) == 0) return null;
+	}
+	return cloneScript(script, null, keepAlloc);
+}
+
+Script * copyScript(const Script * kept, ltable * table) {
+	table->count = 0;
+	table->sized = 0;
+	return cloneScript(kept, table, asmAlloc);
+}
+
+void freeKeptScript(Script * kept) {
+	if (kept == null) return;
+	for (int i = 0; i < kept->numEntries; i++) {
+		free(kept->entries[i].str);
+		free(kept->entries[i].lbl);
+		free(kept->entries[i].bytes);
+	}
+	free(kept->entries);
+	for (int i = 0; i < kept->equates->count; i++) {
+		free(kept->equates->items[i].name);
+		free(kept->equates->items[i].expr);
+	}
+	free(kept->equates->items);
+	free(kept->equates);
+	free(kept);
+}
+
 void printScript(Script * script, char * outputFile) { // prints to a new file the parsed assembly code with macros expanded and labels replaced 
 };
@@ -2,6 +2,7 @@
 typedef struct Script Script;
 typedef struct Entry Entry;
 typedef struct Command Command;
+typedef struct Equates Equates;
 
 #define null NULL
 #include <stdio.h>
@@ -59,63 +60,110 @@ struct Entry {
 	unsigned long long value;
 	int address;
 	int size;
-	int type;
+	int type; // 0 instruction, 1 data word, 2 label, 3 .code, 4 .data, 5 raw bytes, 6 fill, 7 align, 8 .equ / .set
 	
 	int numArgs;
 	char * str;
-	char * lbl;
+	char * lbl;            // type 2: the label, type 1 / 5: the words as expressions, until they are resolved
+	unsigned char * bytes; // type 5: .incbin contents or a multi-value data line, size bytes long
+	int align;             // type 7: boundary in bytes, size is the padding up to it
+	int line;              // source line, 0 for entries the assembler made
 	Command cmd;
 };
 
+// and r0, r0, r0 encodes as all zeros; code is padded with it
+#define NOP_WORD 0x00000000u
+// Alignments are kept within a page, the finest alignment of a section
+#define MAX_ALIGN 4096
+
 struct Script {
 	Entry * entries;
 	ltable * ltable;
 	int numEntries;
 	int byteSize;
+	int hasCode; // there is a .code directive somewhere, set by fillLabelTable
+	Equates * equates; // .equ / .set symbols (expr.h)
 };
 
 typedef struct {
     const char *name;
 	CommandType type;
 	int cnt;
-	int opcode;
 } CmdMap;
 
 static CmdMap cmdTable[] = {
-    {"add", ADD, 1,   0x18}, 
-	{"addi", ADDI, 1, 0x19},
-    {"sub", SUB, 1,   0x1a}, 
-	{"subi", SUBI, 1, 0x1b},
-    {"mul", MUL, 1, 0x1c}, 
-	{"div", DIV, 1, 0x1d},
-    {"and", AND, 1, 0x0}, 
-	{"or", OR, 1, 0x1}, 
-	{"xor", XOR, 1, 0x2}, 
-	{"not", NOT, 1, 0x3},
-    {"shftr", SHFTR, 1, 0x4}, 
-	{"shftri", SHFTRI, 1, 0x5},
-    {"shftl", SHFTL, 1, 0x6},
-	{"shftli", SHFTLI, 1, 0x7},
-    {"br", BR, 1, 0x8},
-	{"brr", BRR, 1, 0x9}, 
-	{"brnz", BRNZ, 1, 0xb}, 
-    {"call", CALL, 1, 0xc},
-	{"return", RETURN, 1, 0xd},
-	{"brgt", BRGT, 1, 0xe},
-    {"priv", PRIV, 1, 0xf},
-    {"mov", MOV, 1, 0x10},
-    {"addf", ADDF, 1, 0x14}, 
-	{"subf", SUBF, 1, 0x15},
-    {"mulf", MULF, 1, 0x16}, 
-	{"divf", DIVF, 1, 0x17},
-    {"in", IN, 1, -1},
-	{"out", OUT, 1, -1},
-    {"clr", CLR, 1, -1}, 
-	{"ld", LD, 12, -1},
-    {"push", PUSH, 2, -1}, 
-	{"pop", POP, 2, -1},
-    {"data", DATA, 1, -1},
-	{"halt", HALT, 1, -1}
+    {"add", ADD, 1}, 
+	{"addi", ADDI, 1},
+    {"sub", SUB, 1}, 
+	{"subi", SUBI, 1},
+    {"mul", MUL, 1}, 
+	{"div", DIV, 1},
+    {"and", AND, 1}, 
+	{"or", OR, 1}, 
+	{"xor", XOR, 1}, 
+	{"not", NOT, 1},
+    {"shftr", SHFTR, 1}, 
+	{"shftri", SHFTRI, 1},
+    {"shftl", SHFTL, 1},
+	{"shftli", SHFTLI, 1},
+    {"br", BR, 1},
+	{"brr", BRR, 1}, 
+	{"brnz", BRNZ, 1}, 
+    {"call", CALL, 1},
+	{"return", RETURN, 1},
+	{"brgt", BRGT, 1},
+    {"priv", PRIV, 1},
+    {"mov", MOV, 1},
+    {"addf", ADDF, 1}, 
+	{"subf", SUBF, 1},
+    {"mulf", MULF, 1}, 
+	{"divf", DIVF, 1},
+    {"in", IN, 1},
+	{"out", OUT, 1},
+    {"clr", CLR, 1}, 
+	{"ld", LD, 12},
+    {"push", PUSH, 2}, 
+	{"pop", POP, 2},
+    {"data", DATA, 1},
+	{"halt", HALT, 1}
 };
 
 Script * getScript(char * filename);
+Script * parseScript(FILE * file);
+// parseScript with a label table the caller keeps (it is emptied first)
+Script * parseScriptWith(FILE * file, ltable * table);
+
+// Copy of a freshly parsed script outside any assembly (malloc'd), for
+// later assemblies of the same source to start from without parsing it
+// again. NULL when an .incbin maps a file into it: the mapping ends with
+// the assembly that made it
+Script * keepScript(Script * script);
+// Copy of a kept script made in the current assembly, labels go into table
+Script * copyScript(const Script * kept, ltable * table);
+void freeKeptScript(Script * kept);
+
+// Reads one whole line (any length) into *line, returns 0 at end of file
+int readLine(FILE * file, char ** line, size_t * cap);
+
+// Build a single data / instruction entry from a trimmed source line.
+// A data line with several comma separated words becomes one type 5 entry.
+// Words that are expressions are kept as text in lbl (expr.h resolves them)
+Entry * handleData(char * dataline, int address);
+Entry * handleCmd(char * line, int address);
+
+// .code / .data switch mode and return a type 3 / 4 entry.
+// .incbin file, .fill count, value and .space bytes return a type 5 / 6 entry
+// covering the whole block. .align / .balign n return a type 7 entry padding
+// address up to a multiple of n bytes, with no-ops in code and zeros in data.
+// .equ / .set name, expr define a symbol in equates and return a type 8 entry.
+// Counts may be constant expressions of the symbols defined so far
+Entry * handleDirective(char * line, int address, int * mode, Equates * equates);
+
+// Assign every entry its address from 0x1000 and fill the label table
+// (assembler.c). With sectionAlign, a switch between .code and .data starts
+// the next section on a multiple of it.
+void fillLabelTable(Script * script, int sectionAlign);
+
+// Decimal parser that converts 8 digits per step, advances *str past the number.
+// Returns 0 if there is no number or it does not fit in 64 bits
+int parseDecimal(const char ** str, const char * end, uint64_t * value);
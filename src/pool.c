@@ -0,0 +1,117 @@
+#include "pool.h"
+#include "context.h"
+#include "argparse.h"
+#include "macro.h"
+#include "expr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Find (or add) the pool slot for an ld operand
+static int poolSlot(ConstantPool * pool, char * operand) {
+	int isLbl = isLayoutExpression(operand);
+	uint64_t value = isLbl ? 0 : parseLiteral(operand);
+
+	for (int i = 0; i < pool->numConsts; i++) {
+		PoolConst * c = &pool->consts[i];
+		if (isLbl ? (c->label && strcmp(c->label, operand) == 0) : (!c->label && c->value == value))
+			return i;
+	}
+	if (pool->numConsts == POOL_MAX_ENTRIES) return -1;
+
+	PoolConst * c = &pool->consts[pool->numConsts];
+	c->label = isLbl ? asmStrdup(operand) : null;
+	c->value = value;
+	c->hits = 0;
+	return pool->numConsts++;
+}
+
+ConstantPool * buildConstantPool(Script * script, int baseReg) {
+	ConstantPool * pool = asmCalloc(1, sizeof(ConstantPool));
+	pool->consts = asmAlloc(POOL_MAX_ENTRIES * sizeof(PoolConst));
+	pool->baseReg = baseReg;
+
+	char instruction[64];
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type != 0 || entry->cmd.type != LD) continue;
+
+		char * argsCopy = asmStrdup(entry->str);
+		char * comma = strchr(argsCopy, ',');
+		if (!comma) {
+			asmError("Error: Invalid ld macro format\n");
+		}
+		*comma = '\0';
+		int rd = parseRegister(argsCopy);
+		int slot = poolSlot(pool, trimWhitespace(comma + 1));
+		asmFree(argsCopy);
+
+		if (slot < 0) {
+			pool->expanded++;
+			continue;
+		}
+		pool->consts[slot].hits++;
+		pool->rewritten++;
+
+		snprintf(instruction, sizeof(instruction), "r%d, (r%d)(%d)", rd, baseReg, slot * 8);
+		entry->cmd.type = MOV;
+		entry->str = asmStrdup(instruction);
+	}
+
+	if (pool->rewritten == 0) {
+		asmFree(pool->consts);
+		asmFree(pool);
+		return null;
+	}
+
+	// .code / ld rB, :__pool / <program> / .data / :__pool / <constants>
+	int n = script->numEntries;
+	Entry * entries = asmAlloc((n + 4 + pool->numConsts) * sizeof(Entry));
+	int k = 0;
+
+	entries[k++] = (Entry){ .type = 3 };
+	snprintf(instruction, sizeof(instruction), "r%d, %s", baseReg, POOL_LABEL);
+	entries[k++] = (Entry){ .type = 0, .size = 4, .str = asmStrdup(instruction), .cmd.type = LD };
+
+	memcpy(entries + k, script->entries, n * sizeof(Entry));
+	k += n;
+
+	entries[k++] = (Entry){ .type = 4 };
+	entries[k++] = (Entry){ .type = 2, .lbl = asmStrdup(POOL_LABEL) };
+	for (int i = 0; i < pool->numConsts; i++)
+		entries[k++] = (Entry){ .type = 1, .size = 8, .value = pool->consts[i].value, .lbl = pool->consts[i].label };
+
+	script->entries = entries;
+	script->numEntries = k;
+	return pool;
+}
+
+void resolveConstantPool(ConstantPool * pool, Script * script) {
+	if (pool == null) return;
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type == 1 && entry->lbl != null)
+			entry->value = evalOperand(entry->lbl, script->ltable);
+	}
+	for (int i = 0; i < pool->numConsts; i++)
+		if (pool->consts[i].label)
+			pool->consts[i].value = evalOperand(pool->consts[i].label, script->ltable);
+}
+
+void reportConstantPool(ConstantPool * pool, FILE * out) {
+	if (pool == null) {
+		fprintf(out, "constant pool: empty (no ld instructions)\n");
+		return;
+	}
+	int ldSize = cmdTable[LD].cnt;
+	// each rewritten ld drops to one instruction, the base setup costs one full ld
+	long saved = (long)pool->rewritten * (ldSize - 1) - ldSize;
+
+	fprintf(out, "constant pool: %d entries (%d bytes) in r%d, %d ld hits, %d ld left expanded, %ld instructions saved\n",
+			pool->numConsts, pool->numConsts * 8, pool->baseReg, pool->rewritten, pool->expanded, saved);
+	for (int i = 0; i < pool->numConsts; i++) {
+		PoolConst * c = &pool->consts[i];
+		fprintf(out, "  (r%d)(%d)\t0x%016" PRIx64 "\t%s\t%d hits\n",
+				pool->baseReg, i * 8, c->value, c->label ? c->label : "", c->hits);
+	}
+}
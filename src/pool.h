@@ -0,0 +1,35 @@
+#pragma once
+#include "parse.h"
+
+// Register that holds the pool address when --pool is given without one
+#define POOL_DEFAULT_REG 30
+// mov offsets are 12 bits, so only this many 8 byte constants are reachable from the base
+#define POOL_MAX_ENTRIES 256
+#define POOL_LABEL ":__pool"
+
+typedef struct PoolConst {
+	char * label;       // label operand of the ld, or NULL for a literal
+	uint64_t value;     // literal value, or the label address once resolved
+	int hits;           // number of ld instructions that load it
+} PoolConst;
+
+typedef struct ConstantPool {
+	PoolConst * consts;
+	int numConsts;
+	int baseReg;
+	int rewritten;      // ld instructions turned into a single mov
+	int expanded;       // ld instructions left as the full sequence (pool full)
+} ConstantPool;
+
+// Must run before fillLabelTable.
+// Every "ld rd, L" becomes "mov rd, (rB)(off)" where off is the slot of L in a
+// deduplicated pool appended to the end of the image as a .data section.
+// A single "ld rB, :__pool" is placed at the entry point to set up the base.
+// Returns NULL if the script has no ld to pool.
+ConstantPool * buildConstantPool(Script * script, int baseReg);
+
+// Must run after fillLabelTable: fills in the label addresses stored in the pool
+void resolveConstantPool(ConstantPool * pool, Script * script);
+
+// Pool size and per constant hit counts
+void reportConstantPool(ConstantPool * pool, FILE * out);
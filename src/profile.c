@@ -0,0 +1,93 @@
+#include "profile.h"
+#include "context.h"
+#include "parse.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+// Label token with the leading ':' added when it is missing
+static char * labelName(const char * token) {
+	size_t n = strlen(token);
+	char * name = asmAlloc(n + 2);
+	name[0] = ':';
+	strcpy(name + (token[0] != ':'), token);
+	return name;
+}
+
+static uint64_t parseCount(char * token, int line) {
+	char * end;
+	errno = 0;
+	unsigned long long value = strtoull(token, &end, 0);
+	if (end == token || *end != '\0' || token[0] == '-' || errno == ERANGE) {
+		asmError("Error: profile line %d: invalid count '%s'\n", line, token);
+	}
+	return value;
+}
+
+static int compareCount(const void * a, const void * b) {
+	return strcmp(((const ProfileCount *)a)->label, ((const ProfileCount *)b)->label);
+}
+
+Profile * parseProfile(const char * text, size_t len) {
+	Profile * profile = asmCalloc(1, sizeof(Profile));
+	int capCounts = 0, capEdges = 0;
+
+	char * copy = asmAlloc(len + 1);
+	memcpy(copy, text, len);
+	copy[len] = '\0';
+
+	int lineNum = 0;
+	char * save = null;
+	for (char * line = strtok_r(copy, "\n", &save); line; line = strtok_r(null, "\n", &save)) {
+		lineNum++;
+		char * hash = strchr(line, '#');
+		if (hash) *hash = '\0';
+
+		char * tokens[4];
+		int n = 0;
+		char * tokSave = null;
+		for (char * tok = strtok_r(line, " \t\r", &tokSave); tok; tok = strtok_r(null, " \t\r", &tokSave)) {
+			if (strcmp(tok, "->") == 0) continue;
+			if (n == 3) {
+				asmError("Error: profile line %d: too many fields\n", lineNum);
+			}
+			tokens[n++] = tok;
+		}
+
+		if (n == 0) continue;
+		if (n == 1) {
+			asmError("Error: profile line %d: expected a label and a count\n", lineNum);
+		}
+		uint64_t count = parseCount(tokens[n - 1], lineNum);
+
+		if (n == 2) {
+			if (profile->numCounts == capCounts)
+				profile->counts = asmRealloc(profile->counts, (capCounts = capCounts ? capCounts * 2 : 64) * sizeof(ProfileCount));
+			profile->counts[profile->numCounts++] = (ProfileCount){ labelName(tokens[0]), count };
+		} else {
+			if (profile->numEdges == capEdges)
+				profile->edges = asmRealloc(profile->edges, (capEdges = capEdges ? capEdges * 2 : 64) * sizeof(ProfileEdge));
+			profile->edges[profile->numEdges++] = (ProfileEdge){ labelName(tokens[0]), labelName(tokens[1]), count };
+		}
+	}
+	asmFree(copy);
+
+	// sorted and merged so lookups can bsearch
+	qsort(profile->counts, profile->numCounts, sizeof(ProfileCount), compareCount);
+	int k = 0;
+	for (int i = 0; i < profile->numCounts; i++) {
+		if (k > 0 && strcmp(profile->counts[k - 1].label, profile->counts[i].label) == 0)
+			profile->counts[k - 1].count += profile->counts[i].count;
+		else
+			profile->counts[k++] = profile->counts[i];
+	}
+	profile->numCounts = k;
+	return profile;
+}
+
+uint64_t profileCount(Profile * profile, const char * label) {
+	ProfileCount key = { (char *)label, 0 };
+	ProfileCount * found = bsearch(&key, profile->counts, profile->numCounts, sizeof(ProfileCount), compareCount);
+	return found ? found->count : 0;
+}
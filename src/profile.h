@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Execution profile for profile guided layout, a text file:
+//
+//   # comment
+//   :label count            times the block starting at label ran
+//   :from :to count         times control went from the block of from to to
+//                           (a taken branch, "->" between the labels is allowed)
+//
+// Labels without the leading ':' are accepted. Repeated lines add up.
+
+typedef struct ProfileCount {
+	char * label;
+	uint64_t count;
+} ProfileCount;
+
+typedef struct ProfileEdge {
+	char * from;
+	char * to;
+	uint64_t count;
+} ProfileEdge;
+
+typedef struct Profile {
+	ProfileCount * counts;
+	int numCounts;
+	ProfileEdge * edges;
+	int numEdges;
+} Profile;
+
+// Parse profile text, errors go through asmError
+Profile * parseProfile(const char * text, size_t len);
+
+// Execution count of label, 0 if the profile does not mention it
+uint64_t profileCount(Profile * profile, const char * label);
@@ -0,0 +1,109 @@
+#include "instrument.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Reads the block counters of an --instrument build out of a memory dump
+// (tkemu --dump, or any executor's) and writes them as a profile (profile.h),
+// most executed block first, for --profile. Blocks without a label can not
+// be named in a profile and come out as comments.
+
+typedef struct Block {
+	char label[64];
+	int line;
+	uint64_t count;
+} Block;
+
+static int usage(const char * name) {
+	fprintf(stderr, "usage: %s [--base=addr] [--top=N] image.tko.map dump\n"
+			"base: the address of the first byte of the dump (0)\n", name);
+	return 1;
+}
+
+static int compareBlocks(const void * a, const void * b) {
+	const Block * x = a;
+	const Block * y = b;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return x->line - y->line;
+}
+
+int main(int argc, char * argv[]) {
+	uint64_t base = 0;
+	int top = 0;
+	const char * files[2] = {NULL, NULL};
+	int numFiles = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--base=", 7) == 0) base = strtoull(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--top=", 6) == 0) top = atoi(argv[i] + 6);
+		else if (argv[i][0] == '-' && argv[i][1] == '-') {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return usage(argv[0]);
+		} else if (numFiles < 2) files[numFiles++] = argv[i];
+		else return usage(argv[0]);
+	}
+	if (numFiles < 2) return usage(argv[0]);
+
+	FILE * map = fopen(files[0], "r");
+	if (map == NULL) {
+		fprintf(stderr, "could not open %s\n", files[0]);
+		return 1;
+	}
+	unsigned long long region;
+	int count;
+	if (fscanf(map, "counters %llx %d", &region, &count) != 2 || count < 0 || count >= INSTRUMENT_MAX_SLOTS) {
+		fprintf(stderr, "%s is not a counter map\n", files[0]);
+		fclose(map);
+		return 1;
+	}
+	Block * blocks = calloc(count + 1, sizeof(Block));
+	for (int i = 0; i < count; i++) {
+		int slot;
+		if (fscanf(map, "%d %d %63s", &slot, &blocks[i].line, blocks[i].label) != 3 || slot != i + 1) {
+			fprintf(stderr, "%s: bad counter line %d\n", files[0], i + 1);
+			fclose(map);
+			free(blocks);
+			return 1;
+		}
+	}
+	fclose(map);
+
+	// slot 0 is the scratch save slot, the counters follow it
+	FILE * dump = fopen(files[1], "rb");
+	if (dump == NULL) {
+		fprintf(stderr, "could not open %s\n", files[1]);
+		free(blocks);
+		return 1;
+	}
+	unsigned char * words = malloc((count + 1) * 8);
+	int read = region >= base && fseek(dump, region - base, SEEK_SET) == 0 &&
+			fread(words, 8, count + 1, dump) == (size_t)count + 1;
+	fclose(dump);
+	if (!read) {
+		fprintf(stderr, "%s does not hold the counters at 0x%llx (base 0x%" PRIx64 ")\n", files[1], region, base);
+		free(words);
+		free(blocks);
+		return 1;
+	}
+	uint64_t total = 0;
+	for (int i = 0; i < count; i++) {
+		uint64_t v = 0;
+		for (int b = 7; b >= 0; b--) v = v << 8 | words[(i + 1) * 8 + b];
+		blocks[i].count = v;
+		total += v;
+	}
+	free(words);
+
+	qsort(blocks, count, sizeof(Block), compareBlocks);
+	printf("# %d counters, %" PRIu64 " block entries\n", count, total);
+	if (top <= 0 || top > count) top = count;
+	for (int i = 0; i < top; i++) {
+		Block * b = &blocks[i];
+		double share = total ? 100.0 * b->count / total : 0;
+		if (strcmp(b->label, "-") == 0)
+			printf("# (no label) %" PRIu64 " # line %d, %.1f%%\n", b->count, b->line, share);
+		else
+			printf("%s %" PRIu64 " # line %d, %.1f%%\n", b->label, b->count, b->line, share);
+	}
+	free(blocks);
+	return 0;
+}
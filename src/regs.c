@@ -0,0 +1,90 @@
+#include "regs.h"
+#include "encode.h"
+
+static uint32_t regBit(Operand * op) {
+	return op->kind == K_REG || op->kind == K_MEM ? REG_BIT(op->reg) : 0;
+}
+
+RegEffects registerEffects(Entry * entry) {
+	Operand ops[5] = {0};
+	int count = parseOperands(entry->str, ops);
+	if (count > 4) count = 4;
+	uint32_t rd = count > 0 ? regBit(&ops[0]) : 0;
+	uint32_t rest = 0;
+	for (int i = 1; i < count; i++) rest |= regBit(&ops[i]);
+
+	RegEffects fx = {0};
+	switch (entry->cmd.type) {
+		case ADD: case SUB: case MUL: case AND: case OR: case XOR:
+		case SHFTR: case SHFTL: case NOT:
+		case ADDF: case SUBF: case MULF: case DIVF:
+			fx.defs = rd;
+			fx.uses = rest;
+			break;
+		case DIV: // divide by zero faults
+			fx.defs = rd;
+			fx.uses = rest;
+			fx.sideEffects = 1;
+			break;
+		case ADDI: case SUBI: case SHFTRI: case SHFTLI:
+			fx.defs = fx.uses = rd;
+			break;
+		case MOV:
+			if (ops[0].kind == K_MEM) {             // mov (rd)(L), rs
+				fx.uses = rd | rest;
+				fx.sideEffects = 1;
+			} else if (count > 1 && ops[1].kind == K_MEM) { // mov rd, (rs)(L)
+				fx.defs = rd;
+				fx.uses = rest;
+				fx.sideEffects = 1;
+			} else if (count > 1 && ops[1].kind == K_REG) {
+				fx.defs = rd;
+				fx.uses = rest;
+			} else if (count > 1 && (ops[1].imm < 0 || ops[1].imm > 4095)) { // legalized to the whole value
+				fx.defs = rd;
+			} else {                                // mov rd, L only sets the low 12 bits
+				fx.defs = fx.uses = rd;
+			}
+			break;
+		case CLR: case LD:
+			fx.defs = rd;
+			break;
+		case IN:
+			fx.defs = rd;
+			fx.uses = rest;
+			fx.sideEffects = 1;
+			break;
+		case OUT: case BR: case BRR: case BRNZ: case BRGT:
+			fx.uses = rd | rest;
+			fx.sideEffects = 1;
+			break;
+		case PUSH:
+			fx.uses = rd | REG_BIT(STACK_REG);
+			fx.defs = REG_BIT(STACK_REG);
+			fx.sideEffects = 1;
+			break;
+		case POP:
+			fx.uses = REG_BIT(STACK_REG);
+			fx.defs = rd | REG_BIT(STACK_REG);
+			fx.sideEffects = 1;
+			break;
+		default: // call, return, priv, halt: the callee / handler may touch anything
+			fx.uses = fx.defs = ALL_REGS;
+			fx.sideEffects = 1;
+			break;
+	}
+	return fx;
+}
+
+uint32_t usedRegisters(Script * script) {
+	uint32_t used = REG_BIT(STACK_REG);
+	for (int i = 0; i < script->numEntries; i++) {
+		Entry * entry = &script->entries[i];
+		if (entry->type != 0 || entry->str == null) continue;
+		Operand ops[5] = {0};
+		int count = parseOperands(entry->str, ops);
+		for (int k = 0; k < count && k < 4; k++)
+			used |= regBit(&ops[k]);
+	}
+	return used;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "parse.h"
+#include <stdint.h>
+
+#define ALL_REGS 0xffffffffu
+#define REG_BIT(r) (1u << (r))
+#define STACK_REG 31
+
+// What one instruction entry (macros included, before expansion) does to the
+// registers, as bit masks. A partial write (mov rd, L) also reads rd, unless L
+// is past 12 bits and so (under --legalize) sets all of rd.
+typedef struct RegEffects {
+	uint32_t uses;
+	uint32_t defs;
+	int sideEffects;    // memory, I/O, control flow or a possible fault: never removed
+} RegEffects;
+
+RegEffects registerEffects(Entry * entry);
+
+// Registers the program names anywhere, the stack register always. The whole
+// program is here, so a call touches no others (registerEffects has to assume
+// it touches them all)
+uint32_t usedRegisters(Script * script);
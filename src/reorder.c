@@ -0,0 +1,379 @@
+#include "reorder.h"
+#include "context.h"
+#include "argparse.h"
+#include "expr.h"
+#include "regs.h"
+#include "cfg.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A label delimited run of entries inside one code region
+typedef struct Block {
+	int first;          // entries [first, last)
+	int last;
+	uint64_t count;     // profile count of its hottest label
+	int fallsThrough;   // the last instruction can continue into the next block
+	char * label;       // first label, what a jump to the block targets
+	int next;           // neighbours in its chain, -1 at the ends
+	int prev;
+	int set;            // union-find parent, blocks of one chain share a root
+	int fixed;          // kept in source order: joins no chain, ranks as never run
+	int farJump;        // its added jump is "ld rX, :next / br rX", brr would not reach
+	int outFirst;       // where the last layout put it: out entries [outFirst, outLast)
+	int outLast;
+	int outJump;        // its added jump among them, -1 for none
+} Block;
+
+typedef struct Edge {
+	int from;
+	int to;
+	uint64_t weight;
+} Edge;
+
+typedef struct LabelBlock {
+	char * label;
+	int block;
+} LabelBlock;
+
+// Reordering state for the region being laid out
+typedef struct Region {
+	Entry * entries;
+	Block * blocks;
+	int numBlocks;
+	LabelBlock * labels;
+	int numLabels;
+	int farReg;         // register free for far jumps, -1 for none
+} Region;
+
+static int compareLabel(const void * a, const void * b) {
+	return strcmp(((const LabelBlock *)a)->label, ((const LabelBlock *)b)->label);
+}
+
+static int compareEdge(const void * a, const void * b) {
+	const Edge * x = a, * y = b;
+	if (x->weight != y->weight) return x->weight < y->weight ? 1 : -1;
+	if (x->from != y->from) return x->from - y->from;
+	return x->to - y->to;
+}
+
+static int blockOf(Region * r, char * label) {
+	LabelBlock key = { label, 0 };
+	LabelBlock * found = bsearch(&key, r->labels, r->numLabels, sizeof(LabelBlock), compareLabel);
+	return found ? found->block : -1;
+}
+
+static int findSet(Block * blocks, int b) {
+	while (blocks[b].set != b) {
+		blocks[b].set = blocks[blocks[b].set].set;
+		b = blocks[b].set;
+	}
+	return b;
+}
+
+// Labels, and .align directly in front of a label, open a block
+static int isBlockHead(Entry * entries, int i, int end) {
+	return entries[i].type == 2 || (entries[i].type == 7 && i + 1 < end && entries[i + 1].type == 2);
+}
+
+// Can control run off the end of the entries [first, last)
+static int fallsThrough(Entry * entries, int first, int last) {
+	for (int i = last - 1; i >= first; i--) {
+		if (entries[i].type != 0) continue;
+		CommandType type = entries[i].cmd.type;
+		return !(type == BR || type == BRR || type == RETURN || isHalt(&entries[i]));
+	}
+	return 1;
+}
+
+// brr :L as the very last entry of the block, the L, else NULL
+static char * trailingJump(Entry * entries, Block * block) {
+	Entry * last = &entries[block->last - 1];
+	if (block->last > block->first && last->type == 0 && last->cmd.type == BRR && isPlainLabel(last->str))
+		return last->str;
+	return null;
+}
+
+static Entry makeEntry(char * text) {
+	Entry * entry = handleCmd(text, 0);
+	Entry made = *entry;
+	asmFree(entry);
+	return made;
+}
+
+// Writes the jump to label that replaces a fall-through, returns the entries written
+static int writeJump(Entry * out, char * label, int farReg) {
+	char text[96];
+	if (farReg < 0) {
+		snprintf(text, sizeof(text), "brr %s", label);
+		out[0] = makeEntry(text);
+		return 1;
+	}
+	snprintf(text, sizeof(text), "ld r%d, %s", farReg, label);
+	out[0] = makeEntry(text);
+	snprintf(text, sizeof(text), "br r%d", farReg);
+	out[1] = makeEntry(text);
+	return 2;
+}
+
+// Bytes the entry takes, an .align counted with all the padding it may need
+static int entryBytes(Entry * entry) {
+	switch (entry->type) {
+		case 0: return 4 * cmdTable[entry->cmd.type].cnt;
+		case 1: return 8;
+		case 5: case 6: return entry->size;
+		case 7: return entry->align - 1;
+		default: return 0;
+	}
+}
+
+// Chain order: the entry block's chain, hot chains by count, then the
+// chains that never ran in source order
+typedef struct ChainKey {
+	int head;
+	uint64_t heat;
+	int position;
+} ChainKey;
+
+static int compareChain(const void * a, const void * b) {
+	const ChainKey * x = a, * y = b;
+	if ((x->position == 0) != (y->position == 0)) return x->position == 0 ? -1 : 1;
+	if (x->heat != y->heat) return x->heat < y->heat ? 1 : -1;
+	return x->position - y->position;
+}
+
+// Lays out the code region [start, end) into out, returns the number of entries written
+static int layoutRegion(Region * r, Profile * profile, Entry * out, int regionId, ReorderStats * stats) {
+	Entry * entries = r->entries;
+	Block * blocks = r->blocks;
+	int n = r->numBlocks;
+
+	// edges: taken branches from the profile plus the estimated fall-through
+	// share (block count minus its taken branches)
+	Edge * edges = asmAlloc((profile->numEdges + n) * sizeof(Edge));
+	uint64_t * taken = asmCalloc(n, sizeof(uint64_t));
+	int numEdges = 0;
+	for (int i = 0; i < profile->numEdges; i++) {
+		int from = blockOf(r, profile->edges[i].from);
+		int to = blockOf(r, profile->edges[i].to);
+		if (from < 0 || to < 0) continue;
+		edges[numEdges++] = (Edge){ from, to, profile->edges[i].count };
+		taken[from] += profile->edges[i].count;
+	}
+	for (int b = 0; b + 1 < n; b++)
+		if (blocks[b].fallsThrough && blocks[b].count > taken[b])
+			edges[numEdges++] = (Edge){ b, b + 1, blocks[b].count - taken[b] };
+	qsort(edges, numEdges, sizeof(Edge), compareEdge);
+
+	// greedily join the heaviest edges into fall-through chains
+	for (int b = 0; b < n; b++) {
+		blocks[b].next = blocks[b].prev = -1;
+		blocks[b].set = b;
+	}
+	for (int i = 0; i < numEdges; i++) {
+		int a = edges[i].from, b = edges[i].to;
+		if (edges[i].weight == 0 || a == b || b == 0 || blocks[a].fixed || blocks[b].fixed) continue;
+		if (blocks[a].next != -1 || blocks[b].prev != -1) continue;
+		if (findSet(blocks, a) == findSet(blocks, b)) continue;
+		blocks[a].next = b;
+		blocks[b].prev = a;
+		blocks[findSet(blocks, b)].set = findSet(blocks, a);
+	}
+
+	ChainKey * chains = asmAlloc(n * sizeof(ChainKey));
+	int numChains = 0;
+	for (int b = 0; b < n; b++) {
+		if (blocks[b].prev != -1) continue;
+		ChainKey key = { b, 0, b };
+		for (int c = b; c != -1; c = blocks[c].next) {
+			if (!blocks[c].fixed && blocks[c].count > key.heat) key.heat = blocks[c].count;
+			if (c < key.position) key.position = c;
+		}
+		chains[numChains++] = key;
+	}
+	qsort(chains, numChains, sizeof(ChainKey), compareChain);
+
+	int * order = asmAlloc(n * sizeof(int));
+	int k = 0;
+	for (int i = 0; i < numChains; i++)
+		for (int c = chains[i].head; c != -1; c = blocks[c].next)
+			order[k++] = c;
+
+	char endLabel[64];
+	snprintf(endLabel, sizeof(endLabel), ":__reorder_end%d", regionId);
+	int needEnd = 0;
+	int written = 0;
+	for (int i = 0; i < n; i++) {
+		Block * block = &blocks[order[i]];
+		int follower = i + 1 < n ? order[i + 1] : -1;
+		int last = block->last;
+
+		if (i > 0 && order[i] != order[i - 1] + 1) stats->moved++;
+
+		char * jump = trailingJump(entries, block);
+		if (jump && follower != -1 && blockOf(r, jump) == follower) {
+			last--;
+			stats->jumpsRemoved++;
+		}
+		block->outFirst = written;
+		memcpy(out + written, entries + block->first, (last - block->first) * sizeof(Entry));
+		written += last - block->first;
+
+		// source successor, -1 for whatever follows the region
+		int successor = order[i] + 1 < n ? order[i] + 1 : -1;
+		block->outJump = -1;
+		if (block->fallsThrough && successor != follower) {
+			if (successor == -1) needEnd = 1;
+			block->outJump = written;
+			written += writeJump(out + written, successor == -1 ? endLabel : blocks[successor].label,
+					block->farJump ? r->farReg : -1);
+			stats->jumpsAdded++;
+			stats->farJumps += block->farJump;
+		}
+		block->outLast = written;
+	}
+	if (needEnd) out[written++] = (Entry){ .type = 2, .lbl = asmStrdup(endLabel) };
+
+	asmFree(order);
+	asmFree(chains);
+	asmFree(taken);
+	asmFree(edges);
+	return written;
+}
+
+// Out of range brr :L in the layout just written: a jump that was added goes
+// through the free register when there is one, else the chains at both ends
+// keep source order. Returns whether that changed anything, the region then
+// has to be laid out again. Distances count every .align at its most padding.
+static int settleFarJumps(Region * r, Entry * out, int written) {
+	int * offset = asmAlloc((written + 1) * sizeof(int));
+	offset[0] = 0;
+	for (int k = 0; k < written; k++) offset[k + 1] = offset[k] + entryBytes(&out[k]);
+
+	int changed = 0;
+	for (int b = 0; b < r->numBlocks; b++) {
+		Block * block = &r->blocks[b];
+		for (int k = block->outFirst; k < block->outLast; k++) {
+			if (out[k].type != 0 || out[k].cmd.type != BRR || !isPlainLabel(out[k].str)) continue;
+			int t = blockOf(r, out[k].str);
+			if (t < 0) continue;
+			int at = r->blocks[t].outFirst;
+			while (out[at].type != 2 || strcmp(out[at].lbl, out[k].str) != 0) at++;
+			long long distance = (long long)offset[at] - offset[k];
+			if (distance >= -2048 && distance <= 2047) continue;
+
+			if (k == block->outJump && r->farReg >= 0) {
+				block->farJump = 1;
+				changed = 1;
+				continue;
+			}
+			int ends[2] = { b, t };
+			for (int e = 0; e < 2; e++) {
+				int c = ends[e];
+				while (r->blocks[c].prev != -1) c = r->blocks[c].prev;
+				for (; c != -1; c = r->blocks[c].next) {
+					changed |= !r->blocks[c].fixed;
+					r->blocks[c].fixed = 1;
+				}
+			}
+		}
+	}
+	asmFree(offset);
+	return changed;
+}
+
+// Reorders the code region [start, end), or copies it when it cannot move
+static int reorderRegion(Entry * entries, int start, int end, Profile * profile, int farReg, Entry * out, int regionId, ReorderStats * stats) {
+	int pinned = 0;
+	int numBlocks = 0, numLabels = 0;
+	for (int i = start; i < end; i++) {
+		if (entries[i].type == 0 && entries[i].cmd.type == BRR && !isPlainLabel(entries[i].str)) pinned = 1;
+		if (i == start || (isBlockHead(entries, i, end) && !isBlockHead(entries, i - 1, end))) numBlocks++;
+		if (entries[i].type == 2) numLabels++;
+	}
+	if (pinned || numBlocks < 2) {
+		stats->pinned += pinned;
+		memcpy(out, entries + start, (end - start) * sizeof(Entry));
+		return end - start;
+	}
+
+	Region r = { entries, asmAlloc(numBlocks * sizeof(Block)), 0, asmAlloc((numLabels + 1) * sizeof(LabelBlock)), 0, farReg };
+	for (int i = start; i < end; i++) {
+		if (i == start || (isBlockHead(entries, i, end) && !isBlockHead(entries, i - 1, end))) {
+			if (r.numBlocks > 0) r.blocks[r.numBlocks - 1].last = i;
+			r.blocks[r.numBlocks] = (Block){ .first = i, .next = -1, .prev = -1, .set = r.numBlocks };
+			r.numBlocks++;
+		}
+		Block * block = &r.blocks[r.numBlocks - 1];
+		if (entries[i].type != 2) continue;
+		uint64_t count = profileCount(profile, entries[i].lbl);
+		if (count > block->count) block->count = count;
+		if (block->label == null) block->label = entries[i].lbl;
+		r.labels[r.numLabels++] = (LabelBlock){ entries[i].lbl, r.numBlocks - 1 };
+	}
+	r.blocks[r.numBlocks - 1].last = end;
+	for (int b = 0; b < r.numBlocks; b++)
+		r.blocks[b].fallsThrough = fallsThrough(entries, r.blocks[b].first, r.blocks[b].last);
+	qsort(r.labels, r.numLabels, sizeof(LabelBlock), compareLabel);
+
+	// counts of the last layout only, far jumps can take a few
+	ReorderStats layout;
+	int written;
+	do {
+		layout = (ReorderStats){0};
+		written = layoutRegion(&r, profile, out, regionId, &layout);
+	} while (settleFarJumps(&r, out, written));
+	stats->regions++;
+	stats->blocks += r.numBlocks;
+	stats->moved += layout.moved;
+	stats->jumpsAdded += layout.jumpsAdded;
+	stats->jumpsRemoved += layout.jumpsRemoved;
+	stats->farJumps += layout.farJumps;
+	for (int b = 0; b < r.numBlocks; b++) stats->kept += r.blocks[b].fixed;
+
+	asmFree(r.labels);
+	asmFree(r.blocks);
+	return written;
+}
+
+ReorderStats reorderBlocks(Script * script, Profile * profile, uint32_t avoid) {
+	ReorderStats stats = {0};
+	Entry * entries = script->entries;
+	int n = script->numEntries;
+	// every block gains at most a two entry jump, every region at most one label
+	Entry * out = asmAlloc((3 * n + 1) * sizeof(Entry));
+
+	uint32_t taken = usedRegisters(script) | avoid;
+	int farReg = -1;
+	for (int reg = 0; reg < 32 && farReg < 0; reg++)
+		if (!(taken & REG_BIT(reg))) farReg = reg;
+	int written = 0;
+	int regionId = 0;
+
+	int i = 0;
+	while (i < n) {
+		if (entries[i].type != 3) {
+			out[written++] = entries[i++];
+			continue;
+		}
+		out[written++] = entries[i++];
+		int end = i;
+		while (end < n && entries[end].type != 3 && entries[end].type != 4) end++;
+		written += reorderRegion(entries, i, end, profile, farReg, out + written, regionId++, &stats);
+		i = end;
+	}
+
+	asmFree(script->entries);
+	script->entries = out;
+	script->numEntries = written;
+	stats.farReg = farReg;
+	return stats;
+}
+
+void reportReorder(ReorderStats * stats, FILE * out) {
+	fprintf(out, "reorder: %d blocks in %d code regions, %d moved, %d jumps added, %d removed",
+			stats->blocks, stats->regions, stats->moved, stats->jumpsAdded, stats->jumpsRemoved);
+	if (stats->pinned) fprintf(out, ", %d regions kept in source order (pc relative brr)", stats->pinned);
+	if (stats->farJumps) fprintf(out, ", %d jumps through r%d (too far for brr)", stats->farJumps, stats->farReg);
+	if (stats->kept) fprintf(out, ", %d blocks kept in source order (brr too far)", stats->kept);
+	fputc('\n', out);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "parse.h"
+#include "profile.h"
+
+typedef struct ReorderStats {
+	int regions;        // code regions (runs between directives) reordered
+	int pinned;         // regions left alone because they use pc relative brr offsets
+	int blocks;
+	int moved;          // blocks no longer behind their source predecessor
+	int jumpsAdded;     // brr inserted where a fall-through was broken
+	int jumpsRemoved;   // brr dropped because its target now follows it
+	int farJumps;       // added jumps done as "ld rX, :next / br rX", brr would not reach
+	int farReg;         // the rX, -1 when the program leaves no register free
+	int kept;           // blocks left in source order because a brr would not reach
+} ReorderStats;
+
+// Must run before fillLabelTable.
+// Splits every code region into label delimited blocks and lays them out again
+// from the profile: blocks joined by the heaviest edges become fall-through
+// chains, hot chains follow the entry block, blocks that never ran move to the
+// end of the region. The first block of a region stays in place. Broken
+// fall-throughs get a "brr :next" and brr to the block that now follows is
+// dropped. A brr that the new layout puts past +-2047 bytes (every .align
+// counted at its most padding) is an added jump through a register the
+// program never names and avoid (a bit mask) leaves, or if there is none the
+// chains at both of its ends are kept in source order. Later passes that grow
+// the code are --legalize's to reach. Regions with brr by a number, a
+// register or a label expression are not touched.
+ReorderStats reorderBlocks(Script * script, Profile * profile, uint32_t avoid);
+
+void reportReorder(ReorderStats * stats, FILE * out);
@@ -0,0 +1,213 @@
+#include "schedule.h"
+#include "context.h"
+#include "encode.h"
+#include "regs.h"
+#include <string.h>
+
+typedef enum MemKind { MEM_NONE, MEM_LOAD, MEM_STORE } MemKind;
+
+typedef struct Node {
+	Entry entry;
+	RegEffects fx;
+	MemKind mem;
+	int base;           // base register of a load / store
+	long long offset;
+	int version;        // writes to base before this access
+	int latency;
+	int height;         // latency weighted path to the end of the run
+	int waiting;        // predecessors not scheduled yet
+	long earliest;      // cycle all operands are ready
+} Node;
+
+// edges[i][j]: cycles j waits after i issues, 0 for no dependency
+typedef struct Region {
+	Node nodes[SCHEDULE_WINDOW];
+	unsigned char edges[SCHEDULE_WINDOW][SCHEDULE_WINDOW];
+	int order[SCHEDULE_WINDOW];
+	int count;
+} Region;
+
+static int isBarrier(Entry * entry) {
+	if (entry->type != 0) return 1;
+	switch (entry->cmd.type) {
+		case BR: case BRR: case BRNZ: case BRGT: case CALL: case RETURN: case PRIV:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static int latencyOf(CommandType type, MemKind mem) {
+	if (mem == MEM_LOAD) return 2;
+	switch (type) {
+		case MUL: return 3;
+		case DIV: case DIVF: return 12;
+		case ADDF: case SUBF: return 4;
+		case MULF: return 5;
+		default: return 1;
+	}
+}
+
+static void describe(Node * node, int version[32]) {
+	Entry * entry = &node->entry;
+	node->fx = registerEffects(entry);
+	node->mem = MEM_NONE;
+	if (entry->cmd.type == MOV) {
+		Operand ops[5] = {0};
+		int count = parseOperands(entry->str, ops);
+		if (count == 2 && ops[0].kind == K_MEM) {
+			node->mem = MEM_STORE;
+			node->base = ops[0].reg;
+			node->offset = ops[0].imm;
+		} else if (count == 2 && ops[1].kind == K_MEM) {
+			node->mem = MEM_LOAD;
+			node->base = ops[1].reg;
+			node->offset = ops[1].imm;
+		}
+		if (node->mem != MEM_NONE) node->version = version[node->base];
+	}
+	// xor rd, rd, rd does not read rd (ld and clr start with it)
+	if (entry->cmd.type == XOR) {
+		Operand ops[5] = {0};
+		if (parseOperands(entry->str, ops) == 3 && ops[0].reg == ops[1].reg && ops[1].reg == ops[2].reg)
+			node->fx.uses = 0;
+	}
+	for (int r = 0; r < 32; r++)
+		if (node->fx.defs & REG_BIT(r)) version[r]++;
+	node->latency = latencyOf(entry->cmd.type, node->mem);
+}
+
+static int mayOverlap(Node * a, Node * b) {
+	if (a->base != b->base || a->version != b->version) return 1;
+	long long d = a->offset - b->offset;
+	return d > -8 && d < 8;
+}
+
+static void buildEdges(Region * r) {
+	for (int j = 0; j < r->count; j++) {
+		Node * b = &r->nodes[j];
+		for (int i = 0; i < j; i++) {
+			Node * a = &r->nodes[i];
+			int wait = 0;
+			if (a->fx.defs & b->fx.uses) wait = a->latency;
+			else if ((a->fx.uses & b->fx.defs) || (a->fx.defs & b->fx.defs)) wait = 1;
+			if (!wait && a->mem && b->mem && (a->mem == MEM_STORE || b->mem == MEM_STORE) && mayOverlap(a, b))
+				wait = a->latency;
+			// a div that faults must not overtake a store, nor be overtaken by one
+			if (!wait && ((a->mem == MEM_STORE && b->entry.cmd.type == DIV) || (a->entry.cmd.type == DIV && b->mem == MEM_STORE)))
+				wait = a->latency;
+			r->edges[i][j] = wait;
+		}
+	}
+}
+
+// Cycles to issue the nodes in order, one per cycle in order
+static long estimate(Region * r, int * order) {
+	long issue[SCHEDULE_WINDOW];
+	int pos[SCHEDULE_WINDOW];
+	for (int k = 0; k < r->count; k++) pos[order[k]] = k;
+	long cycle = 0, end = 0;
+	for (int k = 0; k < r->count; k++) {
+		int j = order[k];
+		long t = cycle;
+		// only earlier nodes have edges to j
+		for (int i = 0; i < j; i++)
+			if (r->edges[i][j] && pos[i] < k && issue[i] + r->edges[i][j] > t) t = issue[i] + r->edges[i][j];
+		issue[j] = t;
+		cycle = t + 1;
+		if (t + r->nodes[j].latency > end) end = t + r->nodes[j].latency;
+	}
+	return end;
+}
+
+static void listSchedule(Region * r) {
+	for (int i = r->count - 1; i >= 0; i--) {
+		int below = 0;
+		for (int j = i + 1; j < r->count; j++)
+			if (r->edges[i][j] && r->nodes[j].height > below) below = r->nodes[j].height;
+		r->nodes[i].height = r->nodes[i].latency + below;
+	}
+	for (int j = 0; j < r->count; j++) {
+		r->nodes[j].waiting = 0;
+		r->nodes[j].earliest = 0;
+		for (int i = 0; i < j; i++) r->nodes[j].waiting += r->edges[i][j] != 0;
+	}
+
+	char done[SCHEDULE_WINDOW] = {0};
+	long cycle = 0;
+	for (int k = 0; k < r->count; k++) {
+		// the ready node that can go first, then the longest path, then source order
+		int best = -1;
+		long bestStart = 0;
+		for (int j = 0; j < r->count; j++) {
+			if (done[j] || r->nodes[j].waiting) continue;
+			long start = r->nodes[j].earliest > cycle ? r->nodes[j].earliest : cycle;
+			if (best < 0 || start < bestStart || (start == bestStart && r->nodes[j].height > r->nodes[best].height)) {
+				best = j;
+				bestStart = start;
+			}
+		}
+		done[best] = 1;
+		r->order[k] = best;
+		cycle = bestStart + 1;
+		for (int j = best + 1; j < r->count; j++) {
+			if (!r->edges[best][j]) continue;
+			r->nodes[j].waiting--;
+			if (bestStart + r->edges[best][j] > r->nodes[j].earliest) r->nodes[j].earliest = bestStart + r->edges[best][j];
+		}
+	}
+}
+
+// Schedule entries [first, first + count) in place
+static void scheduleRegion(Region * r, Entry * entries, int first, int count, ScheduleStats * stats) {
+	int version[32] = {0};
+	r->count = count;
+	for (int i = 0; i < count; i++) {
+		r->nodes[i].entry = entries[first + i];
+		describe(&r->nodes[i], version);
+	}
+	buildEdges(r);
+	listSchedule(r);
+	stats->regions++;
+
+	int source[SCHEDULE_WINDOW];
+	for (int i = 0; i < count; i++) source[i] = i;
+	long before = estimate(r, source);
+	long after = estimate(r, r->order);
+	if (after >= before) return;
+
+	stats->reordered++;
+	stats->cyclesBefore += before;
+	stats->cyclesAfter += after;
+	for (int k = 0; k < count; k++) {
+		Entry * slot = &entries[first + k];
+		int address = slot->address;
+		*slot = r->nodes[r->order[k]].entry;
+		slot->address = address;
+		stats->moved += r->order[k] != k;
+	}
+}
+
+ScheduleStats scheduleBlocks(Script * script) {
+	ScheduleStats stats = {0};
+	Region * region = asmAlloc(sizeof(Region));
+	int n = script->numEntries;
+	int i = 0;
+	while (i < n) {
+		if (isBarrier(&script->entries[i])) {
+			i++;
+			continue;
+		}
+		int end = i;
+		while (end < n && end - i < SCHEDULE_WINDOW && !isBarrier(&script->entries[end])) end++;
+		if (end - i > 1) scheduleRegion(region, script->entries, i, end - i, &stats);
+		i = end;
+	}
+	asmFree(region);
+	return stats;
+}
+
+void reportSchedule(ScheduleStats * stats, FILE * out) {
+	fprintf(out, "schedule: %d of %d regions reordered, %d instructions moved, estimated %ld -> %ld cycles\n",
+		stats->reordered, stats->regions, stats->moved, stats->cyclesBefore, stats->cyclesAfter);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "parse.h"
+
+// Instructions scheduled together at most, longer runs are cut into windows
+#define SCHEDULE_WINDOW 256
+
+typedef struct ScheduleStats {
+	int regions;        // straight line runs of two or more instructions
+	int reordered;      // regions given a new order
+	int moved;          // instructions not at their original position
+	long cyclesBefore;  // estimated cycles of the reordered regions, as written
+	long cyclesAfter;   // and as scheduled
+} ScheduleStats;
+
+// Must run after expandMacros and before replaceLabels.
+// List scheduling of every straight line run of instructions: labels,
+// directives, data and control flow (br, brr, brnz, brgt, call, return, priv)
+// stay where they are and the instructions between them are reordered.
+// Register dependencies (read after write, write after read, write after
+// write) and memory ones are kept: a store stays ordered with every load and
+// store it may overlap, which is any of them unless both use the same base
+// register, unchanged in between, at offsets 8 or more apart. A div, which
+// can fault, stays ordered with stores.
+// Ready instructions go by the longest latency weighted path to the end of
+// the run. Latencies match the tkemu defaults (timing.h): mul 3, div 12,
+// addf / subf 4, mulf 5, divf 12, loads 2, everything else 1. A run keeps its
+// order unless the schedule is estimated to take fewer cycles.
+ScheduleStats scheduleBlocks(Script * script);
+
+void reportSchedule(ScheduleStats * stats, FILE * out);
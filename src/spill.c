@@ -0,0 +1,467 @@
+#include "spill.h"
+#include "cfg.h"
+#include "regs.h"
+#include "encode.h"
+#include "context.h"
+#include "argparse.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_CALL -2
+
+typedef struct Routine {
+	int entry;          // block
+	uint32_t mod;       // registers it or its callees may write
+	uint32_t ref;       // and may read
+	int safe;           // r31 only through balanced push / pop / addi / subi and call
+	int clean;          // only ever entered by the calls we know of
+	int * body;         // blocks
+	int numBody;
+	int * callees;      // routines called from the body
+	int numCallees;
+	uint32_t retLive;   // live after its returns
+} Routine;
+
+// A push / call / pop site being rewritten
+typedef struct Site {
+	int regs[32];       // pushed registers left, in push order
+	int count;
+} Site;
+
+typedef struct Analysis {
+	Cfg * cfg;
+	Entry * entries;
+	int * target;       // per block: callee / branch target block, -1 unknown, NO_CALL
+	int * routineOf;    // per block: routine entered there, -1
+	Routine * routines;
+	int numRoutines;
+	uint32_t * liveIn;
+	uint32_t * liveOut;
+} Analysis;
+
+static Entry * lastInstruction(Analysis * a, BasicBlock * block, int * index) {
+	for (int i = block->last - 1; i >= block->first; i--)
+		if (a->entries[i].type == 0) {
+			if (index) *index = i;
+			return &a->entries[i];
+		}
+	return null;
+}
+
+// Block of the ":label" token at p
+static int tokenBlock(Cfg * cfg, const char * p) {
+	char label[64];
+	snprintf(label, sizeof(label), "%.*s", labelLength(p), p);
+	return cfgLabelBlock(cfg, label);
+}
+
+// Targets of the calls and register branches that end a block, through the
+// ld that loaded the register in the same block. feeding counts, per block,
+// the ld entries whose label is used that way.
+static void resolveTargets(Analysis * a, int * feeding) {
+	Cfg * cfg = a->cfg;
+	char * used = asmCalloc(cfg->script->numEntries + 1, 1);
+	for (int b = 0; b < cfg->numBlocks; b++) {
+		BasicBlock * block = &cfg->blocks[b];
+		a->target[b] = NO_CALL;
+		if (block->data) continue;
+		int ldEntry[32];
+		for (int r = 0; r < 32; r++) ldEntry[r] = -1;
+		for (int i = block->first; i < block->last; i++) {
+			Entry * entry = &a->entries[i];
+			if (entry->type != 0) continue;
+			Operand ops[5] = {0};
+			int count = parseOperands(entry->str, ops);
+			CommandType type = entry->cmd.type;
+			if ((type == CALL || type == BR || type == BRNZ || type == BRGT) && count >= 1 && ops[0].kind == K_REG) {
+				int ld = ldEntry[ops[0].reg];
+				a->target[b] = ld < 0 ? -1 : tokenBlock(cfg, trimWhitespace(strchr(a->entries[ld].str, ',') + 1));
+				if (ld >= 0 && type == CALL && !used[ld] && a->target[b] >= 0) {
+					used[ld] = 1;
+					feeding[a->target[b]]++;
+				}
+			}
+			RegEffects fx = registerEffects(entry);
+			for (int r = 0; r < 32; r++)
+				if (fx.defs & REG_BIT(r)) ldEntry[r] = -1;
+			if (type == LD && count == 2 && ops[0].kind == K_REG && ops[1].kind == K_LABEL)
+				ldEntry[ops[0].reg] = i;
+		}
+	}
+	asmFree(used);
+}
+
+static int addRoutine(Analysis * a, int entry) {
+	if (a->routineOf[entry] >= 0) return a->routineOf[entry];
+	Routine * r = &a->routines[a->numRoutines];
+	*r = (Routine){ .entry = entry, .safe = 1 };
+	a->routineOf[entry] = a->numRoutines;
+	return a->numRoutines++;
+}
+
+// Blocks of the routine, its own register effects and the routines it calls
+static void scanRoutine(Analysis * a, Routine * r, int * stamp, int mark) {
+	Cfg * cfg = a->cfg;
+	r->body = asmAlloc(cfg->numBlocks * sizeof(int));
+	r->callees = asmAlloc(cfg->numBlocks * sizeof(int));
+	int top = 0, balance = 0;
+	int * stack = asmAlloc((cfg->numBlocks + 1) * sizeof(int));
+	stack[top++] = r->entry;
+	stamp[r->entry] = mark;
+	while (top > 0) {
+		int b = stack[--top];
+		BasicBlock * block = &cfg->blocks[b];
+		r->body[r->numBody++] = b;
+
+		for (int i = block->first; i < block->last; i++) {
+			Entry * entry = &a->entries[i];
+			if (entry->type != 0) continue;
+			CommandType type = entry->cmd.type;
+			if (type == RETURN || isHalt(entry)) continue;
+			if (type == CALL) {
+				if (a->target[b] < 0) {
+					r->mod = r->ref = ALL_REGS;
+					r->safe = 0;
+				} else {
+					r->callees[r->numCallees++] = a->routineOf[a->target[b]];
+				}
+				continue;
+			}
+			RegEffects fx = registerEffects(entry);
+			r->mod |= fx.defs;
+			r->ref |= fx.uses;
+			Operand ops[5] = {0};
+			int count = parseOperands(entry->str, ops);
+			if (type == PUSH) balance += 8;
+			else if (type == POP) balance -= 8;
+			else if ((type == SUBI || type == ADDI) && count == 2 && ops[0].reg == STACK_REG && ops[1].kind == K_IMM)
+				balance += type == SUBI ? ops[1].imm : -ops[1].imm;
+			else if ((fx.uses | fx.defs) & REG_BIT(STACK_REG)) r->safe = 0;
+		}
+
+		Entry * last = lastInstruction(a, block, null);
+		int next[3] = { block->succs[0], block->succs[1], -1 };
+		if (last && (last->cmd.type == BR || last->cmd.type == BRNZ || last->cmd.type == BRGT)) {
+			if (a->target[b] < 0) {
+				r->mod = r->ref = ALL_REGS;
+				r->safe = 0;
+			}
+			next[2] = a->target[b];
+		}
+		for (int k = 0; k < 3; k++) {
+			if (next[k] < 0 || stamp[next[k]] == mark) continue;
+			stamp[next[k]] = mark;
+			stack[top++] = next[k];
+		}
+	}
+	if (balance != 0) r->safe = 0;
+	asmFree(stack);
+}
+
+// Live before the instruction, given what is live after it
+static uint32_t liveBefore(Analysis * a, Entry * entry, int block, uint32_t live) {
+	if (entry->type != 0) return live;
+	if (entry->cmd.type == CALL) {
+		int t = a->target[block];
+		return t < 0 ? ALL_REGS : live | a->routines[a->routineOf[t]].ref | REG_BIT(STACK_REG);
+	}
+	if (entry->cmd.type == RETURN) return live | REG_BIT(STACK_REG);
+	if (isHalt(entry)) return 0;
+	RegEffects fx = registerEffects(entry);
+	return (live & ~fx.defs) | fx.uses;
+}
+
+static uint32_t blockLiveOut(Analysis * a, int b, uint32_t * returnLive) {
+	BasicBlock * block = &a->cfg->blocks[b];
+	Entry * last = lastInstruction(a, block, null);
+	if (last == null) return block->succs[0] >= 0 ? a->liveIn[block->succs[0]] : ALL_REGS;
+	if (last->cmd.type == RETURN) return returnLive[b];
+	if (isHalt(last)) return 0;
+
+	uint32_t out = REG_BIT(STACK_REG);
+	int any = 0;
+	for (int k = 0; k < 2; k++)
+		if (block->succs[k] >= 0) {
+			out |= a->liveIn[block->succs[k]];
+			any = 1;
+		}
+	CommandType type = last->cmd.type;
+	if (type == BR || type == BRNZ || type == BRGT) {
+		if (a->target[b] < 0) return ALL_REGS;
+		out |= a->liveIn[a->target[b]];
+		any = 1;
+	}
+	// falls off the end of the code
+	return any ? out : ALL_REGS;
+}
+
+static void computeLiveness(Analysis * a) {
+	Cfg * cfg = a->cfg;
+	uint32_t * returnLive = asmCalloc(cfg->numBlocks + 1, sizeof(uint32_t));
+	for (int changed = 1; changed;) {
+		changed = 0;
+		// what each routine's returns go back to
+		for (int i = 0; i < a->numRoutines; i++) a->routines[i].retLive = a->routines[i].clean ? 0 : ALL_REGS;
+		for (int b = 0; b < cfg->numBlocks; b++) {
+			if (a->target[b] < 0 || lastInstruction(a, &cfg->blocks[b], null)->cmd.type != CALL) continue;
+			int cont = cfg->blocks[b].succs[0];
+			a->routines[a->routineOf[a->target[b]]].retLive |= cont >= 0 ? a->liveIn[cont] : 0;
+		}
+		for (int b = 0; b < cfg->numBlocks; b++) returnLive[b] = 0;
+		for (int i = 0; i < a->numRoutines; i++)
+			for (int k = 0; k < a->routines[i].numBody; k++)
+				returnLive[a->routines[i].body[k]] |= a->routines[i].retLive | REG_BIT(STACK_REG);
+		for (int b = 0; b < cfg->numBlocks; b++) {
+			// a return in no routine we know of goes anywhere
+			if (returnLive[b] == 0) returnLive[b] = ALL_REGS;
+		}
+
+		for (int b = cfg->numBlocks - 1; b >= 0; b--) {
+			BasicBlock * block = &cfg->blocks[b];
+			if (block->data) continue;
+			uint32_t live = blockLiveOut(a, b, returnLive);
+			a->liveOut[b] = live;
+			for (int i = block->last - 1; i >= block->first; i--) live = liveBefore(a, &a->entries[i], b, live);
+			if (live != a->liveIn[b]) {
+				a->liveIn[b] = live;
+				changed = 1;
+			}
+		}
+	}
+	asmFree(returnLive);
+}
+
+static void analyze(Analysis * a) {
+	Cfg * cfg = a->cfg;
+	int n = cfg->numBlocks;
+	int * feeding = asmCalloc(n + 1, sizeof(int));
+	int * refs = asmCalloc(n + 1, sizeof(int));
+	int * stamp = asmCalloc(n + 1, sizeof(int));
+	a->target = asmAlloc((n + 1) * sizeof(int));
+	a->routineOf = asmAlloc((n + 1) * sizeof(int));
+	a->routines = asmAlloc((n + 1) * sizeof(Routine));
+	a->liveIn = asmCalloc(n + 1, sizeof(uint32_t));
+	a->liveOut = asmCalloc(n + 1, sizeof(uint32_t));
+	for (int b = 0; b < n; b++) a->routineOf[b] = -1;
+
+	resolveTargets(a, feeding);
+	for (int b = 0; b < n; b++) {
+		Entry * last = cfg->blocks[b].data ? null : lastInstruction(a, &cfg->blocks[b], null);
+		if (last && last->cmd.type == CALL && a->target[b] >= 0) addRoutine(a, a->target[b]);
+	}
+
+	// a routine is clean when every reference to its label is an ld feeding a
+	// call and nothing jumps or falls into it
+	for (int i = 0; i < cfg->script->numEntries; i++) {
+		Entry * entry = &a->entries[i];
+		if (entry->type != 0 || entry->str == null) continue;
+		for (char * p = strchr(entry->str, ':'); p; p = strchr(p + 1, ':')) {
+			int b = tokenBlock(cfg, p);
+			if (b >= 0) refs[b]++;
+		}
+	}
+	int first = -1;
+	for (int b = 0; b < n && first < 0; b++) if (!cfg->blocks[b].data) first = b;
+	for (int i = 0; i < a->numRoutines; i++) {
+		int e = a->routines[i].entry;
+		a->routines[i].clean = refs[e] == feeding[e] && e != first;
+	}
+	for (int b = 0; b < n; b++) {
+		int next[3] = { cfg->blocks[b].succs[0], cfg->blocks[b].succs[1], a->target[b] };
+		Entry * last = cfg->blocks[b].data ? null : lastInstruction(a, &cfg->blocks[b], null);
+		if (last && last->cmd.type == CALL) next[2] = -1;
+		for (int k = 0; k < 3; k++)
+			if (next[k] >= 0 && a->routineOf[next[k]] >= 0) a->routines[a->routineOf[next[k]]].clean = 0;
+	}
+
+	for (int i = 0; i < a->numRoutines; i++) scanRoutine(a, &a->routines[i], stamp, i + 1);
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int i = 0; i < a->numRoutines; i++) {
+			Routine * r = &a->routines[i];
+			for (int k = 0; k < r->numCallees; k++) {
+				Routine * c = &a->routines[r->callees[k]];
+				uint32_t mod = r->mod | c->mod, ref = r->ref | c->ref;
+				int safe = r->safe && c->safe;
+				if (mod != r->mod || ref != r->ref || safe != r->safe) changed = 1;
+				r->mod = mod;
+				r->ref = ref;
+				r->safe = safe;
+			}
+		}
+	}
+	computeLiveness(a);
+	asmFree(feeding);
+	asmFree(refs);
+	asmFree(stamp);
+}
+
+// Any mov rd, (r31)(L) with L < 0: something reads below the stack pointer
+static int loadsBelowStack(Entry * entries, int n) {
+	for (int i = 0; i < n; i++) {
+		if (entries[i].type != 0 || entries[i].cmd.type != MOV) continue;
+		Operand ops[5] = {0};
+		if (parseOperands(entries[i].str, ops) == 2 && ops[1].kind == K_MEM && ops[1].reg == STACK_REG && ops[1].imm < 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int singleReg(Entry * entry) {
+	Operand ops[5] = {0};
+	return parseOperands(entry->str, ops) == 1 && ops[0].kind == K_REG ? ops[0].reg : -1;
+}
+
+static Entry makeEntry(const char * fmt, int a, int b) {
+	char text[64];
+	snprintf(text, sizeof(text), fmt, a, b);
+	Entry * entry = handleCmd(text, 0);
+	Entry made = *entry;
+	asmFree(entry);
+	return made;
+}
+
+SpillStats eliminateSpills(Script * script) {
+	SpillStats stats = {0};
+	Cfg * cfg = buildCfg(script);
+	if (cfg->pcRelative) {
+		stats.pcRelative = 1;
+		freeCfg(cfg);
+		return stats;
+	}
+	Analysis a = { cfg, script->entries };
+	analyze(&a);
+	int mayRemove = !loadsBelowStack(script->entries, script->numEntries);
+
+	Entry * entries = script->entries;
+	int n = script->numEntries;
+	// per entry: 0 keep, -1 drop, k > 0 replaced by site k - 1 (push or pop side)
+	int * action = asmCalloc(n + 1, sizeof(int));
+	Site * sites = asmAlloc((cfg->numBlocks + 1) * sizeof(Site));
+	int numSites = 0;
+
+	for (int b = 0; b + 1 < cfg->numBlocks; b++) {
+		int call;
+		Entry * last = cfg->blocks[b].data ? null : lastInstruction(&a, &cfg->blocks[b], &call);
+		if (last == null || last->cmd.type != CALL || a.target[b] < 0 || cfg->blocks[b].succs[0] != b + 1) continue;
+		Routine * callee = &a.routines[a.routineOf[a.target[b]]];
+
+		// code between the pushes and the call: no stack or memory access
+		uint32_t middleDefs = 0;
+		int i = call - 1;
+		for (; i >= cfg->blocks[b].first && entries[i].type == 0 && entries[i].cmd.type != PUSH; i--) {
+			RegEffects fx = registerEffects(&entries[i]);
+			Operand ops[5] = {0};
+			int count = parseOperands(entries[i].str, ops);
+			int memory = entries[i].cmd.type == POP || (entries[i].cmd.type == MOV && count == 2 &&
+					(ops[0].kind == K_MEM || ops[1].kind == K_MEM));
+			if (memory || ((fx.uses | fx.defs) & REG_BIT(STACK_REG))) break;
+			middleDefs |= fx.defs;
+		}
+		int pushEnd = i + 1;
+		while (i >= cfg->blocks[b].first && entries[i].type == 0 && entries[i].cmd.type == PUSH) i--;
+		int pushStart = i + 1;
+
+		int popStart = call + 1, popEnd = popStart;
+		while (popEnd < cfg->blocks[b + 1].last && entries[popEnd].type == 0 && entries[popEnd].cmd.type == POP &&
+				popEnd - popStart < pushEnd - pushStart)
+			popEnd++;
+		int k = popEnd - popStart;
+		if (k == 0) continue;
+
+		// the innermost k pushes pair with the pops, in reverse
+		uint32_t seen = 0;
+		int ok = 1;
+		for (int j = 0; j < k && ok; j++) {
+			int r = singleReg(&entries[pushEnd - 1 - j]);
+			ok = r >= 0 && r != STACK_REG && r == singleReg(&entries[popStart + j]) && !(seen & REG_BIT(r));
+			if (ok) seen |= REG_BIT(r);
+		}
+		if (!ok) continue;
+		stats.sites++;
+
+		uint32_t liveAfter = a.liveOut[b + 1];
+		for (int j = cfg->blocks[b + 1].last - 1; j >= popEnd; j--) liveAfter = liveBefore(&a, &entries[j], b + 1, liveAfter);
+
+		Site * site = &sites[numSites];
+		site->count = 0;
+		for (int j = pushEnd - k; j < pushEnd; j++) {
+			int r = singleReg(&entries[j]);
+			int pop = popStart + (pushEnd - 1 - j);
+			int dead = !(liveAfter & REG_BIT(r));
+			int kept = !((callee->mod | middleDefs) & REG_BIT(r));
+			if (mayRemove && callee->safe && (dead || kept)) {
+				action[j] = action[pop] = -1;
+				stats.deadPairs += dead;
+				stats.keptPairs += !dead;
+				stats.wordsSaved += 2 * cmdTable[PUSH].cnt;
+				stats.memSaved += 2;
+			} else {
+				site->regs[site->count++] = r;
+			}
+		}
+		if (site->count < 2) continue;
+
+		// one store / load per register around a single r31 adjustment
+		int first = 1;
+		for (int j = pushEnd - k; j < pushEnd; j++) {
+			if (action[j] != 0) continue;
+			action[j] = first ? numSites + 1 : -1;
+			first = 0;
+		}
+		first = 1;
+		for (int j = popStart; j < popEnd; j++) {
+			if (action[j] != 0) continue;
+			action[j] = first ? numSites + 1 : -1;
+			first = 0;
+		}
+		stats.batched++;
+		stats.wordsSaved += 2 * (site->count - 1);
+		numSites++;
+	}
+
+	Entry * out = asmAlloc((n + 2 * numSites * 32 + 1) * sizeof(Entry));
+	int written = 0;
+	for (int i = 0; i < n; i++) {
+		if (action[i] == 0) out[written++] = entries[i];
+		if (action[i] <= 0) continue;
+		Site * site = &sites[action[i] - 1];
+		if (entries[i].cmd.type == PUSH) {
+			for (int j = 0; j < site->count; j++)
+				out[written++] = makeEntry("mov (r31)(%d), r%d", -8 * (j + 1), site->regs[j]);
+			out[written++] = makeEntry("subi r31, %d", 8 * site->count, 0);
+		} else {
+			for (int j = 0; j < site->count; j++)
+				out[written++] = makeEntry("mov r%d, (r31)(%d)", site->regs[site->count - 1 - j], 8 * j);
+			out[written++] = makeEntry("addi r31, %d", 8 * site->count, 0);
+		}
+	}
+
+	for (int i = 0; i < a.numRoutines; i++) {
+		asmFree(a.routines[i].body);
+		asmFree(a.routines[i].callees);
+	}
+	asmFree(a.routines);
+	asmFree(a.target);
+	asmFree(a.routineOf);
+	asmFree(a.liveIn);
+	asmFree(a.liveOut);
+	asmFree(sites);
+	asmFree(action);
+	freeCfg(cfg);
+	asmFree(script->entries);
+	script->entries = out;
+	script->numEntries = written;
+	return stats;
+}
+
+void reportSpills(SpillStats * stats, FILE * out) {
+	if (stats->pcRelative) {
+		fprintf(out, "spills: nothing done (pc relative brr)\n");
+		return;
+	}
+	fprintf(out, "spills: %d call sites, %d push / pop pairs removed (%d dead after the call, %d kept by the callee), "
+			"%d sites batched, %ld instruction words and %ld memory accesses saved\n",
+			stats->sites, stats->deadPairs + stats->keptPairs, stats->deadPairs, stats->keptPairs,
+			stats->batched, stats->wordsSaved, stats->memSaved);
+}
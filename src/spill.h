@@ -0,0 +1,30 @@
+#pragma once
+#include "parse.h"
+
+typedef struct SpillStats {
+	int sites;          // calls with a push run before and the matching pop run after
+	int deadPairs;      // push / pop pairs removed: the register is dead after the call
+	int keptPairs;      // removed: neither the callee nor the code before the call writes it
+	int batched;        // sites whose remaining pushes / pops share one r31 adjustment
+	long wordsSaved;    // instruction words
+	long memSaved;      // loads and stores, per execution of every site
+	int pcRelative;     // nothing done because of brr by a number, a register or a label expression
+} SpillStats;
+
+// Must run before fillLabelTable.
+// Looks at every "push rA ... push rZ; ...; call rX; pop rZ ... pop rA" where
+// rX was loaded with "ld rX, :f" in the same block. Routines are found from
+// the call targets, and for each one the registers it and everything it
+// calls may write, and may read, are collected over the call graph. Liveness
+// runs over the whole program: a call reads what its callee may read, and a
+// return goes back to the instruction after every call of its routine (or
+// anywhere, when the routine is also reached some other way).
+// A pair is removed when its register is dead after the pops, or when the
+// callee does not write it and nothing between the pushes and the call does.
+// Removal needs a callee that does not touch r31 other than through call and
+// balanced push / pop and addi / subi r31, and no code that loads below r31.
+// The pushes and pops left at a site become one store / load each and a
+// single subi / addi r31.
+SpillStats eliminateSpills(Script * script);
+
+void reportSpills(SpillStats * stats, FILE * out);
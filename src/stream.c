@@ -0,0 +1,323 @@
+#include "stream.h"
+#include "context.h"
+#include "parse.h"
+#include "macro.h"
+#include "encode.h"
+#include "expr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+// Pending fixups are chained by the label they wait on, in this many buckets
+#define FIXUP_BUCKETS 4096
+
+// An instruction written as a placeholder because it references a label
+// that has not been seen yet
+typedef struct Fixup {
+	long offset;       // where the placeholder starts in the output, -1 for a free slot
+	Entry entry;       // the instruction, args still containing the label
+	char missing[64];  // first label it is waiting on
+	int next;          // next slot in the same bucket, or the next free slot
+} Fixup;
+
+// A fixup slot in output order, stale once the slot no longer has this offset
+typedef struct Placeholder {
+	int slot;
+	long offset;
+} Placeholder;
+
+typedef struct Stream {
+	FILE * out;
+	int seekable;
+	long base;          // file position of the first output byte
+	long offset;        // output bytes produced so far
+
+	// non seekable output only: bytes not written to out yet
+	unsigned char * window;
+	long windowStart;   // output offset of window[0]
+	long windowLen;
+
+	Fixup * fixups;     // by slot, a slot keeps its index while pending
+	int numSlots;
+	int capSlots;
+	int freeSlot;       // -1 for none
+	int numFixups;      // pending
+	int * waiting;      // FIXUP_BUCKETS chains of pending slots by missing label
+
+	// non seekable output only: pending placeholders oldest first, resolved ones
+	// are dropped when they reach the front. They all lie in the window, which bounds them
+	Placeholder * order;
+	int orderStart;
+	int orderLen;
+	int capOrder;
+
+	ltable * ltable;
+	Equates equates;    // only those defined so far, there is no second pass
+} Stream;
+
+static int isSeekable(FILE * out) {
+	int flags = fcntl(fileno(out), F_GETFL);
+	// appends ignore the file position, so they can't be backpatched either
+	if (flags == -1 || (flags & O_APPEND)) return 0;
+	return fseek(out, 0, SEEK_CUR) == 0;
+}
+
+// Expand the macro (if any) and encode, returns number of words or -1 if a label is still unknown
+static int tryEncode(Stream * s, Entry * entry, uint32_t * words, char * missing) {
+	char * args = entry->cmd.type == BRR && entry->str[0] == ':'
+		? substituteRelative(entry->str, entry->address, s->ltable, missing)
+		: substituteLabels(entry->str, s->ltable, missing);
+	if (args == null) return -1;
+
+	Entry resolved = *entry;
+	resolved.str = args;
+
+	Entry expanded[MAX_EXPANSION];
+	int n = expandMacro(&resolved, expanded, s->ltable);
+	for (int i = 0; i < n; i++)
+		words[i] = getInstruction(&expanded[i]);
+
+	asmFree(args);
+	return n;
+}
+
+static int bucketOf(const char * label) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (; *label; label++) h = (h ^ (unsigned char)*label) * 16777619u;
+	return h & (FIXUP_BUCKETS - 1);
+}
+
+static void waitOn(Stream * s, int slot) {
+	int * head = &s->waiting[bucketOf(s->fixups[slot].missing)];
+	s->fixups[slot].next = *head;
+	*head = slot;
+}
+
+// The pending fixup with the lowest offset, NULL when there is none
+static Fixup * oldestFixup(Stream * s) {
+	if (s->seekable) {
+		// no order is kept, this is only asked for the error at the end
+		Fixup * oldest = null;
+		for (int i = 0; i < s->numSlots; i++)
+			if (s->fixups[i].offset >= 0 && (oldest == null || s->fixups[i].offset < oldest->offset))
+				oldest = &s->fixups[i];
+		return oldest;
+	}
+	while (s->orderLen > 0) {
+		Placeholder * p = &s->order[s->orderStart];
+		if (s->fixups[p->slot].offset == p->offset) return &s->fixups[p->slot];
+		s->orderStart++;
+		s->orderLen--;
+	}
+	return null;
+}
+
+// Write out everything in the window in front of the oldest placeholder
+static void flushWindow(Stream * s) {
+	long limit = s->offset;
+	Fixup * oldest = oldestFixup(s);
+	if (oldest && oldest->offset < limit) limit = oldest->offset;
+
+	long n = limit - s->windowStart;
+	if (n <= 0) return;
+	fwrite(s->window, 1, n, s->out);
+	memmove(s->window, s->window + n, s->windowLen - n);
+	s->windowLen -= n;
+	s->windowStart = limit;
+}
+
+static void emit(Stream * s, const void * bytes, long n) {
+	if (s->seekable || (s->numFixups == 0 && s->windowLen == 0)) {
+		fwrite(bytes, 1, n, s->out);
+		s->windowStart += n;
+	} else {
+		if (s->windowLen + n > STREAM_WINDOW) flushWindow(s);
+		if (s->windowLen + n > STREAM_WINDOW) {
+			asmError("Error: Label '%s' is referenced more than %d bytes before it is defined, "
+					"write to a seekable file instead\n", oldestFixup(s)->missing, STREAM_WINDOW);
+		}
+		memcpy(s->window + s->windowLen, bytes, n);
+		s->windowLen += n;
+	}
+	s->offset += n;
+}
+
+static void patch(Stream * s, long offset, const void * bytes, long n) {
+	if (s->seekable) {
+		fseek(s->out, s->base + offset, SEEK_SET);
+		fwrite(bytes, 1, n, s->out);
+		fseek(s->out, 0, SEEK_END);
+	} else {
+		memcpy(s->window + (offset - s->windowStart), bytes, n);
+	}
+}
+
+static void addFixup(Stream * s, long offset, Entry * entry, char * missing) {
+	int slot = s->freeSlot;
+	if (slot >= 0) {
+		s->freeSlot = s->fixups[slot].next;
+	} else {
+		if (s->numSlots == s->capSlots) {
+			s->capSlots = s->capSlots ? s->capSlots * 2 : 64;
+			s->fixups = asmRealloc(s->fixups, s->capSlots * sizeof(Fixup));
+		}
+		slot = s->numSlots++;
+	}
+	Fixup * f = &s->fixups[slot];
+	f->offset = offset;
+	f->entry = *entry;
+	strcpy(f->missing, missing);
+	waitOn(s, slot);
+	s->numFixups++;
+
+	if (s->seekable) return;
+	if (s->orderStart + s->orderLen == s->capOrder) {
+		if (s->orderStart > s->capOrder / 2) {
+			memmove(s->order, s->order + s->orderStart, s->orderLen * sizeof(Placeholder));
+			s->orderStart = 0;
+		} else {
+			s->capOrder = s->capOrder ? s->capOrder * 2 : 64;
+			s->order = asmRealloc(s->order, s->capOrder * sizeof(Placeholder));
+		}
+	}
+	s->order[s->orderStart + s->orderLen++] = (Placeholder){ slot, offset };
+}
+
+// A label was just defined: backpatch everything that was waiting on it
+static void resolveFixups(Stream * s, char * label) {
+	uint32_t words[MAX_EXPANSION];
+	int retry = -1; // slots now waiting on a different label
+	int * link = &s->waiting[bucketOf(label)];
+	while (*link >= 0) {
+		int slot = *link;
+		Fixup * f = &s->fixups[slot];
+		if (strcmp(f->missing, label) != 0) {
+			link = &f->next;
+			continue;
+		}
+		*link = f->next;
+
+		int n = tryEncode(s, &f->entry, words, f->missing);
+		if (n < 0) {
+			f->next = retry;
+			retry = slot;
+			continue;
+		}
+		patch(s, f->offset, words, n * sizeof(uint32_t));
+		asmFree(f->entry.str);
+		f->offset = -1;
+		f->next = s->freeSlot;
+		s->freeSlot = slot;
+		s->numFixups--;
+	}
+	while (retry >= 0) {
+		int next = s->fixups[retry].next;
+		waitOn(s, retry);
+		retry = next;
+	}
+	if (!s->seekable) flushWindow(s);
+}
+
+void assembleStream(FILE * in, FILE * out) {
+	Stream s = {0};
+	s.out = out;
+	s.seekable = isSeekable(out);
+	s.base = s.seekable ? ftell(out) : 0;
+	if (!s.seekable) s.window = asmAlloc(STREAM_WINDOW);
+	s.ltable = asmCalloc(1, sizeof(ltable));
+	s.freeSlot = -1;
+	s.waiting = asmAlloc(FIXUP_BUCKETS * sizeof(int));
+	for (int i = 0; i < FIXUP_BUCKETS; i++) s.waiting[i] = -1;
+
+	char * line = null;
+	size_t lineCap = 0;
+	int mode = -1; // 0 for code, 1 for data
+	long address = 0x1000;
+	uint32_t words[MAX_EXPANSION];
+	char missing[64];
+
+	while (readLine(in, &line, &lineCap)) {
+		switch (line[0]) {
+			case '\t': {
+				char * text = trim(line);
+				if (mode) {
+					Entry * entry = handleData(text, address);
+					if (entry->lbl) {
+						// labels in data words must be defined before them here
+						char * expanded = expandEquates(entry->lbl, &s.equates, address);
+						asmFree(entry->lbl);
+						entry->lbl = expanded;
+						// it writes the values into str
+						asmFree(entry->str);
+						evalDataEntry(entry, s.ltable);
+					}
+					if (entry->type == 5) emit(&s, entry->bytes, entry->size);
+					else emit(&s, &entry->value, sizeof(entry->value));
+					address += entry->size;
+					// nothing of a data line outlives it, memory stays flat however long the data is
+					asmFree(entry->lbl);
+					asmFree(entry->str);
+					asmFree(entry->bytes);
+					asmFree(entry);
+				} else {
+					Entry * entry = handleCmd(text, address);
+					char * expanded = expandEquates(entry->str, &s.equates, address);
+					asmFree(entry->str);
+					entry->str = expanded;
+					int cnt = cmdTable[entry->cmd.type].cnt;
+					int n = tryEncode(&s, entry, words, missing);
+					if (n < 0) {
+						addFixup(&s, s.offset, entry, missing);
+						memset(words, 0, sizeof(words));
+						n = cnt;
+					} else {
+						asmFree(entry->str);
+					}
+					emit(&s, words, n * sizeof(uint32_t));
+					asmFree(entry);
+					address += 4 * cnt;
+				}
+				asmFree(text);
+				break;
+			}
+
+			case ':': {
+				char * label = trim(line);
+				insertLabel(label, address, s.ltable);
+				resolveFixups(&s, label);
+				asmFree(label);
+				break;
+			}
+
+			case '.': {
+				Entry * entry = handleDirective(line, address, &mode, &s.equates);
+				if (entry->type == 5) {
+					emit(&s, entry->bytes, entry->size);
+				} else if (entry->type == 6 || entry->type == 7) {
+					uint64_t block[512];
+					for (int i = 0; i < 512; i++) block[i] = entry->value;
+					for (long left = entry->size; left > 0; left -= sizeof(block))
+						emit(&s, block, left < (long)sizeof(block) ? left : (long)sizeof(block));
+				}
+				address += entry->size;
+				asmFree(entry->str);
+				asmFree(entry);
+				break;
+			}
+		}
+	}
+
+	if (s.numFixups > 0) {
+		asmError("Error: Label '%s' not found!\n", oldestFixup(&s)->missing);
+	}
+	if (!s.seekable) flushWindow(&s);
+	fflush(out);
+
+	asmFree(line);
+	asmFree(s.window);
+	asmFree(s.fixups);
+	asmFree(s.waiting);
+	asmFree(s.order);
+	asmFree(s.ltable);
+	freeEquates(&s.equates);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdio.h>
+
+// Bytes of output held in memory while waiting on forward label references
+// when the output cannot be seeked (e.g. stdout is a pipe)
+#define STREAM_WINDOW (1 << 20)
+
+// Single pass assembler: reads .tk source from in and writes the .tko to out.
+// Every line is encoded as soon as it is read. References to labels that are
+// not defined yet are written as placeholders and kept on a fixup list, then
+// backpatched once the label shows up -- by seeking if out is a regular file,
+// or inside the in-memory window otherwise.
+// Memory use grows with the number of labels and pending fixups only.
+void assembleStream(FILE * in, FILE * out);
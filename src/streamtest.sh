@@ -0,0 +1,35 @@
+# Memory check of hw3 --stream, run after build.sh:
+#   sh streamtest.sh [lines]      (default: 800000)
+# --stream keeps only labels and unresolved references, so a long program of
+# each kind of line has to assemble within the same small address space limit
+# as a short one. Exit status 1 if one runs out.
+cd "$(dirname "$0")"
+LINES=${1:-800000}
+LIMIT=32768 # KB, hw3 needs about a third of it for the label table and window
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+fail=0
+
+# $LINES lines of one kind: words, lists, expressions, expression lists, code
+program() {
+	awk -v n="$LINES" -v kind="$1" 'BEGIN {
+		print kind == "code" ? ".code" : ".data"
+		for (i = 0; i < n; i++) {
+			if (kind == "words") print "\t" i
+			else if (kind == "lists") print "\t1, 2, 3, 4"
+			else if (kind == "expressions") print "\t8 * 8"
+			else if (kind == "expression-lists") print "\t2 * 8, 3 + 4"
+			else print "\taddi r1, 1"
+		}
+	}'
+}
+
+for kind in words lists expressions expression-lists code; do
+	program $kind >"$TMP/input.tk"
+	if ! (ulimit -v $LIMIT; ./hw3 --stream "$TMP/image.tko" <"$TMP/input.tk" 2>"$TMP/asm.err"); then
+		echo "FAIL $kind: $LINES lines do not assemble in $LIMIT KB: $(head -1 "$TMP/asm.err")"
+		fail=1
+	fi
+done
+[ $fail = 0 ] && echo "streamtest: $LINES lines of every kind in $LIMIT KB"
+exit $fail
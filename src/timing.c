@@ -0,0 +1,254 @@
+#include "timing.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define OP_LOAD 0x10
+#define OP_DIVF 0x17
+#define OP_MUL 0x1c
+#define OP_DIV 0x1d
+
+// Opcodes whose latency can be set, by the name parseLatencies takes
+static const struct { const char * name; int opcode; } latencyNames[] = {
+	{"mul", OP_MUL}, {"div", OP_DIV}, {"addf", 0x14}, {"subf", 0x15},
+	{"mulf", 0x16}, {"divf", OP_DIVF}, {"load", OP_LOAD},
+};
+
+static const char * predictorNames[] = {
+	[PREDICT_STATIC] = "static",
+	[PREDICT_BIMODAL] = "bimodal",
+	[PREDICT_GSHARE] = "gshare",
+};
+
+void defaultTimingConfig(TimingConfig * config) {
+	memset(config, 0, sizeof(*config));
+	config->stages = TIMING_DEFAULT_STAGES;
+	for (int i = 0; i < 32; i++) config->latency[i] = 1;
+	config->latency[OP_MUL] = 3;
+	config->latency[OP_DIV] = 12;
+	config->latency[0x14] = config->latency[0x15] = 4;
+	config->latency[0x16] = 5;
+	config->latency[OP_DIVF] = 12;
+	config->latency[OP_LOAD] = 2;
+	config->forwarding = 1;
+	config->predictor = PREDICT_BIMODAL;
+	config->predictorBits = TIMING_DEFAULT_PREDICTOR_BITS;
+}
+
+int parseLatencies(TimingConfig * config, const char * spec) {
+	char * copy = strdup(spec);
+	char * save = NULL;
+	int ok = 1;
+	for (char * item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+		char * eq = strchr(item, '=');
+		char * end = NULL;
+		long value = eq ? strtol(eq + 1, &end, 10) : 0;
+		ok = eq && end != eq + 1 && *end == '\0' && value >= 1 && value <= 1000;
+		if (!ok) break;
+		*eq = '\0';
+		ok = 0;
+		for (size_t i = 0; i < sizeof(latencyNames) / sizeof(latencyNames[0]); i++)
+			if (strcmp(item, latencyNames[i].name) == 0) {
+				config->latency[latencyNames[i].opcode] = value;
+				ok = 1;
+			}
+	}
+	free(copy);
+	return ok;
+}
+
+int parsePredictor(TimingConfig * config, const char * name) {
+	for (int i = 0; i < 3; i++)
+		if (strcmp(name, predictorNames[i]) == 0) {
+			config->predictor = i;
+			return 1;
+		}
+	return 0;
+}
+
+static int executeStage(const TimingConfig * config) {
+	return config->stages - 2 < 2 ? 2 : config->stages - 2;
+}
+
+void initTiming(TimingModel * model, const TimingConfig * config) {
+	memset(model, 0, sizeof(*model));
+	model->config = *config;
+	if (model->config.stages < 3) model->config.stages = 3;
+	int bits = model->config.predictorBits;
+	if (bits < 1) bits = 1;
+	if (bits > TIMING_MAX_PREDICTOR_BITS) bits = TIMING_MAX_PREDICTOR_BITS;
+	model->config.predictorBits = bits;
+	// weakly not taken
+	model->counters = malloc((size_t)1 << bits);
+	memset(model->counters, 1, (size_t)1 << bits);
+	model->capBranches = 64;
+	model->branches = calloc(model->capBranches, sizeof(BranchStats));
+}
+
+void freeTiming(TimingModel * model) {
+	free(model->counters);
+	free(model->branches);
+	model->counters = NULL;
+	model->branches = NULL;
+}
+
+static BranchStats * branchAt(TimingModel * model, uint64_t pc) {
+	if (2 * (model->numBranches + 1) > model->capBranches) {
+		BranchStats * old = model->branches;
+		int oldCap = model->capBranches;
+		model->capBranches *= 2;
+		model->branches = calloc(model->capBranches, sizeof(BranchStats));
+		for (int i = 0; i < oldCap; i++) {
+			if (old[i].executed == 0) continue;
+			uint64_t h = (old[i].pc >> 2) & (model->capBranches - 1);
+			while (model->branches[h].executed) h = (h + 1) & (model->capBranches - 1);
+			model->branches[h] = old[i];
+		}
+		free(old);
+	}
+	uint64_t h = (pc >> 2) & (model->capBranches - 1);
+	while (model->branches[h].executed && model->branches[h].pc != pc)
+		h = (h + 1) & (model->capBranches - 1);
+	if (model->branches[h].executed == 0) {
+		model->branches[h].pc = pc;
+		model->numBranches++;
+	}
+	return &model->branches[h];
+}
+
+// Predicts the branch, then trains on what it did. Returns 1 on a mispredict.
+static int predict(TimingModel * model, const Step * step) {
+	uint64_t mask = ((uint64_t)1 << model->config.predictorBits) - 1;
+	int taken;
+	if (model->config.predictor == PREDICT_STATIC) {
+		// brr always goes, and its target is known to be where it goes
+		taken = step->opcode == 0x9 || step->opcode == 0xa || step->target <= step->pc;
+		return taken != step->taken;
+	}
+
+	uint64_t index = step->pc >> 2;
+	if (model->config.predictor == PREDICT_GSHARE) index ^= model->history;
+	unsigned char * counter = &model->counters[index & mask];
+	taken = *counter >= 2;
+	if (step->taken && *counter < 3) (*counter)++;
+	if (!step->taken && *counter > 0) (*counter)--;
+	model->history = ((model->history << 1) | step->taken) & mask;
+	return taken != step->taken;
+}
+
+void timeStep(TimingModel * model, const Step * step) {
+	const TimingConfig * config = &model->config;
+	int ex = executeStage(config);
+	int lat = config->latency[step->opcode];
+	if (lat < 1) lat = 1;
+
+	// fetched in cycle 1, so the first instruction reaches execute in cycle ex
+	uint64_t start = model->instructions ? model->lastExecute + 1 : (uint64_t)ex;
+	if (model->redirect > start) {
+		model->stalls[model->redirectCause] += model->redirect - start;
+		start = model->redirect;
+	}
+
+	uint64_t operands = 0;
+	int fromLoad = 0;
+	for (int r = 0; r < 32; r++) {
+		if (!(step->uses & (1u << r)) || model->ready[r] <= operands) continue;
+		operands = model->ready[r];
+		fromLoad = model->readyFromLoad[r];
+	}
+	if (operands > start) {
+		model->stalls[fromLoad ? STALL_LOAD_USE : STALL_DATA] += operands - start;
+		start = operands;
+	}
+
+	int divider = step->opcode == OP_DIV || step->opcode == OP_DIVF;
+	if (divider && model->dividerFree > start) {
+		model->stalls[STALL_STRUCTURAL] += model->dividerFree - start;
+		start = model->dividerFree;
+	}
+	if (divider) model->dividerFree = start + lat;
+
+	if (step->def >= 0) {
+		model->ready[step->def] = config->forwarding ? start + lat : start + lat + config->stages - ex;
+		model->readyFromLoad[step->def] = step->load;
+	}
+
+	if (step->branch) {
+		int wrong = step->branch == 2 || predict(model, step);
+		if (wrong) {
+			// the right path is fetched after the branch leaves execute
+			model->redirect = start + lat - 1 + ex;
+			model->redirectCause = step->branch == 2 ? STALL_JUMP : STALL_MISPREDICT;
+		}
+		if (step->branch == 1) {
+			BranchStats * b = branchAt(model, step->pc);
+			b->executed++;
+			b->taken += step->taken;
+			b->mispredicted += wrong;
+			model->branchesExecuted++;
+			model->mispredicted += wrong;
+		}
+	}
+
+	model->lastExecute = start;
+	uint64_t done = start + lat - 1 + config->stages - ex;
+	if (done > model->cycles) model->cycles = done;
+	model->instructions++;
+}
+
+static int compareMispredicts(const void * a, const void * b) {
+	const BranchStats * x = a, * y = b;
+	if (x->mispredicted != y->mispredicted) return x->mispredicted < y->mispredicted ? 1 : -1;
+	if (x->executed != y->executed) return x->executed < y->executed ? 1 : -1;
+	return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+// ":label+off" for the closest label at or before pc, or the bare address
+static void location(uint64_t pc, ltable * symbols, char * out, size_t size) {
+	int best = -1;
+	for (int i = 0; symbols && i < symbols->count; i++)
+		if (symbols->addresses[i] <= pc && (best < 0 || symbols->addresses[i] > symbols->addresses[best]))
+			best = i;
+	if (best < 0) snprintf(out, size, "0x%" PRIx64, pc);
+	else if (symbols->addresses[best] == pc) snprintf(out, size, "%s", symbols->labels[best]);
+	else snprintf(out, size, "%s+%" PRIu64, symbols->labels[best], pc - symbols->addresses[best]);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+void reportTiming(TimingModel * model, ltable * symbols, int topBranches, FILE * out) {
+	const TimingConfig * config = &model->config;
+	uint64_t stalled = 0;
+	for (int i = 0; i < NUM_STALL_CAUSES; i++) stalled += model->stalls[i];
+
+	fprintf(out, "timing: %" PRIu64 " instructions, %" PRIu64 " cycles, CPI %.3f (%d stages, forwarding %s, %s",
+			model->instructions, model->cycles, model->instructions ? (double)model->cycles / model->instructions : 0.0,
+			config->stages, config->forwarding ? "on" : "off", predictorNames[config->predictor]);
+	if (config->predictor != PREDICT_STATIC) fprintf(out, " %d bits", config->predictorBits);
+	fprintf(out, ")\n");
+	fprintf(out, "stalls: %" PRIu64 " cycles: %" PRIu64 " data, %" PRIu64 " load use, %" PRIu64 " structural, %"
+			PRIu64 " mispredict, %" PRIu64 " jump\n", stalled, model->stalls[STALL_DATA], model->stalls[STALL_LOAD_USE],
+			model->stalls[STALL_STRUCTURAL], model->stalls[STALL_MISPREDICT], model->stalls[STALL_JUMP]);
+	fprintf(out, "branches: %" PRIu64 " executed, %" PRIu64 " mispredicted (%.2f%%) at %d addresses\n",
+			model->branchesExecuted, model->mispredicted, percent(model->mispredicted, model->branchesExecuted),
+			model->numBranches);
+
+	if (topBranches <= 0 || model->numBranches == 0) return;
+	BranchStats * sorted = malloc(model->numBranches * sizeof(BranchStats));
+	int n = 0;
+	for (int i = 0; i < model->capBranches; i++)
+		if (model->branches[i].executed) sorted[n++] = model->branches[i];
+	qsort(sorted, n, sizeof(BranchStats), compareMispredicts);
+
+	fprintf(out, "  %-10s %-28s %12s %12s %12s %8s\n", "pc", "location", "executed", "taken", "mispredicted", "rate");
+	for (int i = 0; i < n && i < topBranches; i++) {
+		char where[96];
+		location(sorted[i].pc, symbols, where, sizeof(where));
+		fprintf(out, "  0x%-8" PRIx64 " %-28s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %7.2f%%\n",
+				sorted[i].pc, where, sorted[i].executed, sorted[i].taken, sorted[i].mispredicted,
+				percent(sorted[i].mispredicted, sorted[i].executed));
+	}
+	free(sorted);
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "machine.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Cycle model of an in-order, single issue pipeline, driven by the Steps of
+// a Machine (machine.h).
+//
+// Stages run fetch, decode, ..., execute, memory, writeback; execute is stage
+// stages - 2 (at least 2). An instruction enters execute one cycle after the
+// one before it unless it waits for:
+//  - data: a source register written by an instruction still in flight. With
+//    forwarding a result can be used latency cycles after its producer entered
+//    execute, without it only once the producer has written back.
+//  - load use: the same, when the producer was a load (mov rd, (rs)(L)).
+//  - structural: div / divf are not pipelined, the next one waits for the unit.
+//  - mispredict: brnz / brgt / brr resolve in execute, a wrong prediction
+//    throws away what was fetched behind them.
+//  - jump: br / call / return take their target from a register or memory and
+//    always wait for execute.
+// Correctly predicted taken branches cost nothing (a target buffer is assumed).
+
+typedef enum Predictor {
+	PREDICT_STATIC,     // backward taken, forward not taken
+	PREDICT_BIMODAL,    // 2 bit counters indexed by pc
+	PREDICT_GSHARE,     // 2 bit counters indexed by pc xor global history
+} Predictor;
+
+typedef enum StallCause {
+	STALL_DATA,
+	STALL_LOAD_USE,
+	STALL_STRUCTURAL,
+	STALL_MISPREDICT,
+	STALL_JUMP,
+	NUM_STALL_CAUSES,
+} StallCause;
+
+#define TIMING_DEFAULT_STAGES 5
+#define TIMING_DEFAULT_PREDICTOR_BITS 12
+#define TIMING_MAX_PREDICTOR_BITS 24
+
+typedef struct TimingConfig {
+	int stages;
+	int latency[32];        // execute cycles per opcode, for loads the memory access too
+	int forwarding;
+	Predictor predictor;
+	int predictorBits;      // log2 of the counter table, also the gshare history length
+} TimingConfig;
+
+typedef struct BranchStats {
+	uint64_t pc;
+	uint64_t executed;
+	uint64_t taken;
+	uint64_t mispredicted;
+} BranchStats;
+
+typedef struct TimingModel {
+	TimingConfig config;
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t stalls[NUM_STALL_CAUSES];
+
+	uint64_t lastExecute;   // cycle the previous instruction entered execute
+	uint64_t redirect;      // earliest execute cycle after a mispredict or jump
+	StallCause redirectCause;
+	uint64_t ready[32];     // cycle each register can be read in execute
+	int readyFromLoad[32];
+	uint64_t dividerFree;
+
+	unsigned char * counters;
+	uint64_t history;
+
+	BranchStats * branches; // open addressing on pc, numBranches used of capBranches
+	int numBranches;
+	int capBranches;
+	uint64_t branchesExecuted;
+	uint64_t mispredicted;
+} TimingModel;
+
+// 5 stages, forwarding, bimodal: mul 3, div 12, addf / subf 4, mulf 5,
+// divf 12, loads 2 (one load use bubble), everything else 1
+void defaultTimingConfig(TimingConfig * config);
+
+// Set latencies from "mul=4,div=20,load=3": a mnemonic of the integer / float
+// arithmetic or "load". Returns 0 on an unknown name or bad number.
+int parseLatencies(TimingConfig * config, const char * spec);
+
+// Returns 0 on an unknown name (static, bimodal, gshare)
+int parsePredictor(TimingConfig * config, const char * name);
+
+void initTiming(TimingModel * model, const TimingConfig * config);
+void freeTiming(TimingModel * model);
+
+// Account for one executed instruction
+void timeStep(TimingModel * model, const Step * step);
+
+// Cycles, CPI, stalls by cause, prediction accuracy and the topBranches
+// branches with the most mispredicts, at label+offset when symbols has labels
+void reportTiming(TimingModel * model, ltable * symbols, int topBranches, FILE * out);